@@ -141,6 +141,16 @@ public:
   }
 };
 
+// Indicates the tokens needed a refresh but the lock shared with other
+// processes using the same tokens could not be taken, most likely because
+// another one holds it. The tokens themselves may well be fine.
+class TokenLockException: public std::exception {
+public:
+  const char* what() const noexcept override {
+      return "Another autolab process holds the token lock.";
+  }
+};
+
 // Indicates the client failed to receive the data it expected.
 // This likely indicates a version mismatch between the client and the server.
 class InvalidResponseException: public std::exception {
@@ -9,6 +9,12 @@
 #ifndef LIBAUTOLAB_CLIENT_H_
 #define LIBAUTOLAB_CLIENT_H_
 
+#include <cstddef>
+#include <ctime>
+
+#include <chrono>
+#include <future>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -24,13 +30,44 @@ private:
 public:
   /* setup-related */
   Client(std::string domain, std::string client_id, std::string client_secret,
-         std::string redirect_uri, void (*new_token_callback)(std::string, std::string));
-  void set_tokens(std::string access_token, std::string refresh_token);
+         std::string redirect_uri, RawClient::NewTokensCallback new_token_callback);
+  // expires_at is when the access token expires, 0 if unknown
+  void set_tokens(std::string access_token, std::string refresh_token,
+                  std::time_t expires_at = 0);
+  // refresh the tokens in the background before they expire
+  void set_background_token_refresh(bool enabled);
 
   /* oauth-related */
   void device_flow_init(std::string &user_code, std::string &verification_uri);
   int device_flow_authorize(size_t timeout);
 
+  // limit on how many asynchronous requests are performed at the same time
+  void set_max_concurrent_requests(size_t limit);
+  // HTTP version negotiated by the last request, e.g. "HTTP/2"
+  std::string get_http_protocol();
+  // how transient failures (timeouts, resets, 429/502/503/504) are retried
+  void set_retry_policy(const RawClient::RetryPolicy &policy);
+  // client-side limit on requests per second and on concurrent requests
+  // (zero for no limit), applied to every request including polling
+  void set_rate_limit(double requests_per_second, size_t max_concurrent = 0);
+  // called with the phase timings of every HTTP transfer, see RawClient
+  void set_timing_callback(RawClient::TimingCallback callback);
+  // called with the progress of submission uploads, nullptr for none
+  void set_upload_progress_callback(UploadProgressCallback callback);
+  // caps the upload speed of submissions in bytes per second, 0 for none
+  void set_max_upload_speed(long long bytes_per_second);
+  // how many segments of a large attachment are fetched at once, see RawClient
+  void set_max_download_streams(std::size_t streams);
+  // send requests through transport instead of libcurl, see RawClient
+  void set_transport(std::shared_ptr<Transport> transport);
+  // record all traffic into a corpus directory for MockServer to replay
+  void start_recording(const std::string &dir);
+  // called with the new tokens after a refresh, nullptr for none
+  void set_new_tokens_callback(RawClient::NewTokensCallback cb);
+  // take turns refreshing with other processes, see RawClient
+  void set_token_lock_callbacks(RawClient::TokenLockCallback lock,
+    RawClient::TokenUnlockCallback unlock);
+
   /* resource-related */
   void get_user_info(User &user);
   void get_courses(std::vector<Course> &courses);
@@ -39,6 +76,9 @@ public:
   void get_problems(std::vector<Problem> &probs, const std::string &course_name, const std::string &asmt_name);
   void get_submissions(std::vector<Submission> &subs, const std::string &course_name, const std::string &asmt_name);
   void get_feedback(std::string &feedback, const std::string &course_name, const std::string &asmt_name, int sub_version, const std::string &problem_name);
+  // like get_submissions, but returns false and leaves subs alone if they
+  // did not change since etag, see RawClient::poll_submissions
+  bool poll_submissions(std::vector<Submission> &subs, const std::string &course_name, const std::string &asmt_name, std::string &etag, std::chrono::seconds wait = std::chrono::seconds(0));
 
   void get_enrollments(std::vector<Enrollment> &enrollments, const std::string &course_name);
   void crud_enrollment(Enrollment &result, const std::string &course_name, std::string email, EnrollmentOption &input, CrudAction action);
@@ -48,6 +88,31 @@ public:
   void download_writeup(Attachment &writeup, std::string download_dir, const std::string &course_name, const std::string &asmt_name);
   // returns the new submission version number on success
   int submit_assessment(const std::string &course_name, const std::string &asmt_name, std::string filename);
+  // submits the length bytes at data as a file named filename
+  int submit_assessment(const std::string &course_name, const std::string &asmt_name, std::string filename, const char *data, std::size_t length);
+  // submits the contents of stream as a file named filename
+  int submit_assessment(const std::string &course_name, const std::string &asmt_name, std::string filename, UploadStream &stream);
+
+  /* asynchronous variants
+   *
+   * These return immediately and perform the request concurrently with other
+   * asynchronous requests. The output argument is filled in once the returned
+   * future becomes ready, so it must stay alive until then. Errors are thrown
+   * by future.get() as the same exceptions the synchronous methods throw.
+   */
+  std::future<void> get_user_info_async(User &user);
+  std::future<void> get_courses_async(std::vector<Course> &courses);
+  std::future<void> get_assessments_async(std::vector<Assessment> &asmts, const std::string &course_name);
+  std::future<void> get_assessment_details_async(DetailedAssessment &dasmt, const std::string &course_name, const std::string &asmt_name);
+  std::future<void> get_problems_async(std::vector<Problem> &probs, const std::string &course_name, const std::string &asmt_name);
+  std::future<void> get_submissions_async(std::vector<Submission> &subs, const std::string &course_name, const std::string &asmt_name);
+  std::future<void> get_feedback_async(std::string &feedback, const std::string &course_name, const std::string &asmt_name, int sub_version, const std::string &problem_name);
+
+  std::future<void> get_enrollments_async(std::vector<Enrollment> &enrollments, const std::string &course_name);
+  std::future<void> crud_enrollment_async(Enrollment &result, const std::string &course_name, std::string email, EnrollmentOption &input, CrudAction action);
+
+  std::future<void> download_handout_async(Attachment &handout, std::string download_dir, const std::string &course_name, const std::string &asmt_name);
+  std::future<void> download_writeup_async(Attachment &writeup, std::string download_dir, const std::string &course_name, const std::string &asmt_name);
 };
 
 }
@@ -0,0 +1,158 @@
+/*
+ * An in-process stand-in for an Autolab server.
+ *
+ * MockServer is a Transport that answers requests from a table of canned
+ * responses instead of sending them anywhere, so that RawClient, Client and
+ * the command line tool can be run, benchmarked and load-tested offline and
+ * deterministically. Routes are matched on the method and the unescaped path
+ * (and, for recorded routes, the parameters other than credentials, so any
+ * access token is accepted). Unknown paths get a 404 error response like
+ * the real server's.
+ *
+ * JSON responses carry an ETag, and a GET whose If-None-Match matches it is
+ * answered with 304 Not Modified. With "Prefer: wait=<seconds>", that answer
+ * is held back until a timed route changes or the wait has passed, like a
+ * server that supports long polls.
+ *
+ * Each response can be held back by a fixed latency. Asynchronous requests
+ * are served concurrently on a single worker thread, at most max_in_flight
+ * at a time, so their timing does not depend on thread scheduling.
+ */
+
+#ifndef LIBAUTOLAB_MOCK_SERVER_H_
+#define LIBAUTOLAB_MOCK_SERVER_H_
+
+#include <cstddef>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "autolab/transport.h"
+
+namespace Autolab {
+
+class MockServer : public Transport {
+public:
+  MockServer();
+  ~MockServer();
+
+  MockServer(const MockServer &) = delete;
+  MockServer &operator=(const MockServer &) = delete;
+
+  // serve body with the given status for method ("*" for any) and path,
+  // e.g. "/api/v1/courses". Replaces an existing route, and a route for any
+  // method replaces those for specific methods.
+  void add_route(const std::string &method, const std::string &path,
+    long status, const std::string &body);
+  // serve each of bodies in turn as time passes: the first one until step
+  // after the route is added, then the next one, and so on, the last one
+  // for good
+  void add_timed_route(const std::string &method, const std::string &path,
+    long status, const std::vector<std::string> &bodies,
+    std::chrono::milliseconds step);
+  // serve contents as a file download named filename
+  void add_file_route(const std::string &path, const std::string &filename,
+    const std::string &contents);
+
+  // A course "mock-course" with three assessments, their problems,
+  // submissions, feedback, attachments, the given number of enrolled
+  // students, and the OAuth endpoints (device flow and token refresh).
+  // The latest submission of attacklab only gets its scores three seconds
+  // after the fixtures are added.
+  void add_default_fixtures(std::size_t students = 20);
+  // Adds a route for every file below dir, for any method. A file ending in
+  // .json is served as is for its path without the extension, e.g.
+  // dir/api/v1/courses.json for /api/v1/courses. Any other file is served as
+  // a download for the path of its directory, e.g. dir/api/v1/courses/c/
+  // assessments/a/handout/a.tar for .../handout. Throws HttpException if
+  // dir cannot be read.
+  void load_fixtures(const std::string &dir);
+  // Replays a corpus written by RawClient::start_recording. A request is
+  // answered by the exchanges recorded for the same method, path and
+  // parameters in turn, the last one repeatedly. With original_timing each
+  // response takes as long as it did when recorded, otherwise it takes the
+  // server's latency. Throws HttpException if dir cannot be read.
+  void load_recording(const std::string &dir, bool original_timing);
+
+  // simulated time the server takes to answer each request
+  void set_latency(std::chrono::milliseconds latency);
+  // number of requests answered so far
+  std::size_t request_count();
+
+  CURLcode perform(const HttpRequest &request, ResponseSink &sink,
+    TransferInfo &info) override;
+  void perform_async(const HttpRequest &request, ResponseSink &sink,
+    TransferInfo &info, DoneCallback done,
+    std::chrono::milliseconds delay) override;
+  void set_max_in_flight(std::size_t limit) override;
+
+private:
+  struct response {
+    long status;
+    std::vector<std::string> headers;
+    std::string body;
+    CURLcode result; // of the recorded transfer, CURLE_OK otherwise
+    long latency_ms; // -1 for the server's latency
+
+    response() : status(200), result(CURLE_OK), latency_ms(-1) {}
+  };
+  typedef std::chrono::steady_clock::time_point time_point;
+  // the responses of a route are served in turn, the last one repeatedly,
+  // or one after the other every step from start for a timed route
+  struct route {
+    std::vector<response> responses;
+    std::size_t next;
+    std::chrono::milliseconds step; // zero unless timed
+    time_point start;
+
+    route() : next(0), step(0) {}
+  };
+  // an asynchronous request that has not been answered yet
+  struct job {
+    const HttpRequest *request;
+    ResponseSink *sink;
+    TransferInfo *info;
+    DoneCallback done;
+    response answer; // known once the request is running
+  };
+
+  std::mutex mutex;
+  // keyed by "METHOD /path", or "METHOD /path?params" for recorded ones
+  std::map<std::string, route> routes;
+  std::chrono::milliseconds latency;
+  std::size_t requests;
+
+  // asynchronous requests wait in delayed until their delay has passed, in
+  // pending for a free slot, and in running until their latency has passed
+  std::condition_variable changed;
+  std::thread worker;
+  bool worker_started;
+  bool stopping;
+  std::size_t max_in_flight;
+  std::multimap<time_point, job> delayed;
+  std::deque<job> pending;
+  std::multimap<time_point, job> running;
+
+  void set_route(const std::string &method, const std::string &path,
+    const response &r);
+  static response json_response(long status, const std::string &body);
+  response answer(const HttpRequest &request);
+  response not_modified(const HttpRequest &request, const route &rt,
+    std::size_t index, time_point now);
+  std::chrono::milliseconds response_latency(const response &r);
+  static response requested_range(const HttpRequest &request,
+    const response &r);
+  CURLcode serve(const HttpRequest &request, const response &answer,
+    ResponseSink &sink, TransferInfo &info);
+  void run();
+};
+
+}
+
+#endif /* LIBAUTOLAB_MOCK_SERVER_H_ */
@@ -10,70 +10,275 @@
 #ifndef LIBAUTOLAB_RAW_CLIENT_H_
 #define LIBAUTOLAB_RAW_CLIENT_H_
 
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <fstream>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <ostream>
+#include <random>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <curl/curl.h>
 #include <rapidjson/document.h>
 
 #include "autolab/autolab.h"
+#include "autolab/transport.h"
 
 namespace Autolab {
 
+class DownloadResponse;
+class PartialDownload;
+class RateLimiter;
+class StreamingParser;
+
 class RawClient {
 public:
+  // Receives a json response as a stream of SAX events while it downloads,
+  // following the rapidjson Handler concept. Returning false from an event
+  // stops parsing. Finish is called once the response is over, with whether
+  // it parsed completely.
+  class ResponseHandler {
+  public:
+    virtual ~ResponseHandler() {}
+    virtual bool Null() = 0;
+    virtual bool Bool(bool b) = 0;
+    virtual bool Int(int i) = 0;
+    virtual bool Uint(unsigned u) = 0;
+    virtual bool Int64(int64_t i) = 0;
+    virtual bool Uint64(uint64_t u) = 0;
+    virtual bool Double(double d) = 0;
+    virtual bool RawNumber(const char *str, rapidjson::SizeType length, bool copy) = 0;
+    virtual bool String(const char *str, rapidjson::SizeType length, bool copy) = 0;
+    virtual bool StartObject() = 0;
+    virtual bool Key(const char *str, rapidjson::SizeType length, bool copy) = 0;
+    virtual bool EndObject(rapidjson::SizeType member_count) = 0;
+    virtual bool StartArray() = 0;
+    virtual bool EndArray(rapidjson::SizeType element_count) = 0;
+    virtual void Finish(bool parsed) = 0;
+  };
+
+  // called with the new tokens whenever they are replaced by the server,
+  // and the time they expire at (0 if unknown)
+  typedef void (*NewTokensCallback)(std::string access_token,
+    std::string refresh_token, std::time_t expires_at);
+  // called around every token refresh, so that processes sharing stored
+  // tokens take turns refreshing them. The lock callback fills in the tokens
+  // currently stored (an empty access token if there are none), and returns
+  // false if it could not take the lock, after still filling in the stored
+  // tokens if it can: the client then uses them if another process replaced
+  // the tokens, and fails with TokenLockException otherwise rather than
+  // refreshing unlocked. The unlock callback is only called after a
+  // successful lock, once the new tokens have been stored.
+  typedef bool (*TokenLockCallback)(std::string &access_token,
+    std::string &refresh_token, std::time_t &expires_at);
+  typedef void (*TokenUnlockCallback)();
+
   RawClient(const std::string &domain, const std::string &id, 
     const std::string &st, const std::string &ru, 
-    void (*tk_cb)(std::string, std::string));
-
-  // setters and getters
-  void set_tokens(std::string at, std::string rt);
-  const std::string get_access_token() { return access_token; }
-  const std::string get_refresh_token() { return refresh_token; }
-  void set_new_tokens_callback(void (*cb)(std::string, std::string)) {
+    NewTokensCallback tk_cb);
+  ~RawClient();
+
+  // owns its transport, so it cannot be copied
+  RawClient(const RawClient &) = delete;
+  RawClient &operator=(const RawClient &) = delete;
+
+  // setters and getters, safe to call from any thread
+  // expires_at is when the access token expires, 0 if unknown. Requests
+  // made less than a minute before then refresh the tokens first.
+  void set_tokens(std::string at, std::string rt, std::time_t expires_at = 0);
+  const std::string get_access_token();
+  const std::string get_refresh_token();
+  std::time_t get_token_expiry();
+  void set_new_tokens_callback(NewTokensCallback cb) {
     new_tokens_callback = cb;
   }
+  // if another process refreshed the tokens while the lock was held by
+  // someone else, the stored tokens are used instead of refreshing again
+  void set_token_lock_callbacks(TokenLockCallback lock,
+    TokenUnlockCallback unlock)
+  {
+    token_lock_callback = lock;
+    token_unlock_callback = unlock;
+  }
+  // refresh the tokens on a background thread shortly before they expire,
+  // instead of when the next request is made
+  void set_background_token_refresh(bool enabled);
+  // maximum number of asynchronous requests that are in flight at once
+  void set_max_in_flight(std::size_t limit);
+  // performs requests through transport instead of libcurl. Must be called
+  // before the first request, and the transport must have finished every
+  // asynchronous request before the client is destroyed. The rate limiter's
+  // concurrency limit only applies to libcurl transfers.
+  void set_transport(std::shared_ptr<Transport> transport);
+  // writes every exchange of the current transport to the corpus directory
+  // dir, to be replayed by MockServer::load_recording. Must be called before
+  // the first request and after set_transport.
+  void start_recording(const std::string &dir);
+  // HTTP version used by the most recently completed request, e.g. "HTTP/2"
+  // or "HTTP/1.1". Empty if no request has completed yet.
+  std::string get_http_protocol();
+
+  // How requests that fail transiently are retried: connection failures,
+  // resets and timeouts, and 429, 502, 503 and 504 responses. Retry n waits
+  // a random time between zero and min(max_delay, initial_delay * 2^n), or
+  // as long as the server asks for in Retry-After, up to max_retry_after.
+  // POST requests (e.g. submissions) are only retried when the server cannot
+  // have acted on them: failed connects, 429 and 503.
+  struct RetryPolicy {
+    int max_retries;
+    std::chrono::milliseconds initial_delay;
+    std::chrono::milliseconds max_delay;
+    std::chrono::seconds max_retry_after;
+
+    RetryPolicy() : max_retries(3), initial_delay(500), max_delay(30000),
+      max_retry_after(120) {}
+  };
+  void set_retry_policy(const RetryPolicy &policy);
+
+  // Client-side rate limit shared by every request, including retries,
+  // token refreshes and polling loops: on average at most
+  // requests_per_second requests are started, and at most max_concurrent run
+  // at the same time. Zero means no limit, which is the default.
+  void set_rate_limit(double requests_per_second, std::size_t max_concurrent);
+
+  // Where the time of one HTTP transfer went. Every attempt of a request is
+  // reported separately. The phases follow each other: name lookup, TCP
+  // connect, TLS handshake, and the wait from sending the request to the
+  // first byte of the response. Phases skipped on a reused connection are 0.
+  struct RequestTiming {
+    std::string path;
+    long response_code; // 0 if the transfer failed
+    std::string http_version;
+    double dns_seconds;
+    double connect_seconds;
+    double tls_seconds;
+    double ttfb_seconds;
+    double total_seconds;
+    long long bytes_sent;
+    long long bytes_received;
+
+    RequestTiming() : response_code(0), dns_seconds(0), connect_seconds(0),
+      tls_seconds(0), ttfb_seconds(0), total_seconds(0), bytes_sent(0),
+      bytes_received(0) {}
+  };
+  typedef std::function<void(const RequestTiming &timing)> TimingCallback;
+  // called after every transfer, on the thread that performed it (the
+  // transfer thread for asynchronous requests). Pass nullptr to stop.
+  void set_timing_callback(TimingCallback callback);
+
+  // called while a submission is uploaded, on the thread that performs it.
+  // Pass nullptr to stop.
+  void set_upload_progress_callback(UploadProgressCallback callback);
+  // caps the upload speed of submissions in bytes per second, 0 for none
+  void set_max_upload_speed(long long bytes_per_second);
+  // Large attachments from servers that support ranges are fetched in
+  // segments, this many at once (4 by default). 1 fetches every attachment
+  // with a single request.
+  void set_max_download_streams(std::size_t streams);
 
   /* oauth-related */
   void device_flow_init(std::string &user_code, std::string &verification_uri);
   int device_flow_authorize(size_t timeout);
 
-  // keeps track of state and config for the current request.
-  struct request_state {
+  // keeps track of state and config for the current request, and receives
+  // its response from the transport.
+  struct request_state : public ResponseSink {
     bool file_upload;
     std::string upload_filename;
+    const char *upload_data; // sent instead of the file if set
+    std::size_t upload_length;
+    UploadStream *upload_stream; // sent instead of the file if set
 
     bool is_download;
     std::string suggested_filename;
     std::string download_dir;
     std::string string_output;
-    std::ofstream file_output;
+    // where a download goes, kept across attempts so they can resume it,
+    // and the segment of it this request fetches
+    std::shared_ptr<PartialDownload> download;
+    int download_segment;
+    std::shared_ptr<DownloadResponse> download_response;
+    // sent with every attempt, e.g. to make the request conditional
+    std::vector<std::string> request_headers;
+    std::string etag; // from the ETag header of the response
     long response_code;
+    long http_version;
+    // generation of the access token the request was last sent with
+    unsigned long token_generation;
+
+    // if set, successful responses are parsed into the handler while they
+    // download instead of being collected in string_output.
+    ResponseHandler *stream_handler;
+    long status_code; // from the status line, known before the body
+    long retry_after; // seconds from the Retry-After header, or -1
+    // whether the request counts against the rate limiter's concurrency
+    // limit. OAuth requests do not, since a token refresh may run on the
+    // engine thread while the slots are held by transfers it drives.
+    bool needs_slot;
+    std::shared_ptr<StreamingParser> parser;
+
+    // any other body is parsed once, right after the transfer, and the error
+    // it carries (if any) is recorded for the refresh logic.
+    rapidjson::Document body;
+    bool has_error_response;
+    std::string error_response;
 
     request_state() :
-      file_upload(false), is_download(false) {}
-    request_state(std::string dir, std::string name_hint) :
-      file_upload(false), is_download(false), suggested_filename(name_hint), 
-      download_dir(dir) {}
+      file_upload(false), upload_data(nullptr), upload_length(0),
+      upload_stream(nullptr), is_download(false), download_segment(-1),
+      response_code(0), http_version(CURL_HTTP_VERSION_NONE), token_generation(0),
+      stream_handler(nullptr),
+      status_code(0), retry_after(-1), needs_slot(true),
+      has_error_response(false) {}
+    // a download into dir, continuing download if it is set
+    request_state(std::string dir, std::string name_hint,
+      std::shared_ptr<PartialDownload> download, int segment);
 
     void reset() {
       is_download = false;
       string_output.clear();
+      status_code = 0;
+      retry_after = -1;
+      etag.clear();
+      parser.reset();
+      body.SetNull();
+      has_error_response = false;
+      error_response.clear();
     }
 
-    void close_file_output() {
-      if (file_output.is_open()) file_output.close();
+    bool consider_streaming() {
+      return stream_handler && status_code == 200;
     }
 
     bool consider_download() {
       return download_dir.length() > 0;
     }
+
+    bool on_header(const char *data, std::size_t length) override;
+    bool on_body(const char *data, std::size_t length) override;
   };
 
   typedef std::vector<std::pair<std::string, std::string>> Params;
 
+  // Called once an asynchronous request completes. On failure, error holds
+  // the exception the synchronous variant would have thrown and response
+  // should be ignored. Runs on the client's transfer thread (for a download
+  // fetched in segments, or after a token refresh, on a worker thread the
+  // client joins when destroyed), so it should return quickly.
+  typedef std::function<void(rapidjson::Document &response,
+                             std::exception_ptr error)> ResponseCallback;
+
   /* REST interface methods */
   void get_user_info(rapidjson::Document &result);
   void get_courses(rapidjson::Document &result);
@@ -83,11 +288,51 @@ public:
   void download_handout(rapidjson::Document &result, std::string download_dir, const std::string &course_name, const std::string &asmt_name);
   void download_writeup(rapidjson::Document &result, std::string download_dir, const std::string &course_name, const std::string &asmt_name);
   void submit_assessment(rapidjson::Document &result, const std::string &course_name, const std::string &asmt_name, std::string filename);
+  // submits the length bytes at data as a file named filename
+  void submit_assessment(rapidjson::Document &result, const std::string &course_name, const std::string &asmt_name, std::string filename, const char *data, std::size_t length);
+  // submits the contents of stream as a file named filename, while they are
+  // produced
+  void submit_assessment(rapidjson::Document &result, const std::string &course_name, const std::string &asmt_name, std::string filename, UploadStream &stream);
   void get_submissions(rapidjson::Document &result, const std::string &course_name, const std::string &asmt_name);
   void get_feedback(rapidjson::Document &result, const std::string &course_name, const std::string &asmt_name, int sub_version, const std::string &problem_name);
   void get_enrollments(rapidjson::Document &result, const std::string &course_name);
   void crud_enrollment(rapidjson::Document &result, const std::string &course_name, std::string email, Params &in_params, CrudAction action);
 
+  /* streaming variants of the list methods, which parse the response into
+   * handler as it downloads instead of building a document.
+   */
+  void get_courses(ResponseHandler &handler);
+  void get_assessments(ResponseHandler &handler, const std::string &course_name);
+  void get_problems(ResponseHandler &handler, const std::string &course_name, const std::string &asmt_name);
+  void get_submissions(ResponseHandler &handler, const std::string &course_name, const std::string &asmt_name);
+  void get_enrollments(ResponseHandler &handler, const std::string &course_name);
+
+  // Fetches the submissions into handler like get_submissions, unless they
+  // are unchanged since the response tagged etag (empty for the first poll),
+  // in which case it returns false and handler is left alone. Updates etag.
+  // With a nonzero wait, a server that supports it (Prefer: wait, RFC 7240)
+  // holds the request until the submissions change or wait has passed,
+  // others answer right away.
+  bool poll_submissions(ResponseHandler &handler, const std::string &course_name, const std::string &asmt_name, std::string &etag, std::chrono::seconds wait);
+
+  /* asynchronous REST interface methods, performed concurrently by the
+   * transport (curl_multi by default). Each returns immediately and reports through the callback.
+   * Where a handler can be given, the response is streamed into it (which
+   * must stay alive until the callback runs) and the callback gets an empty
+   * document.
+   */
+  void get_user_info_async(ResponseCallback callback);
+  void get_courses_async(ResponseCallback callback, ResponseHandler *handler = nullptr);
+  void get_assessments_async(ResponseCallback callback, const std::string &course_name, ResponseHandler *handler = nullptr);
+  void get_assessment_details_async(ResponseCallback callback, const std::string &course_name, const std::string &asmt_name);
+  void get_problems_async(ResponseCallback callback, const std::string &course_name, const std::string &asmt_name, ResponseHandler *handler = nullptr);
+  void download_handout_async(ResponseCallback callback, std::string download_dir, const std::string &course_name, const std::string &asmt_name);
+  void download_writeup_async(ResponseCallback callback, std::string download_dir, const std::string &course_name, const std::string &asmt_name);
+  void get_submissions_async(ResponseCallback callback, const std::string &course_name, const std::string &asmt_name, ResponseHandler *handler = nullptr);
+  void get_feedback_async(ResponseCallback callback, const std::string &course_name, const std::string &asmt_name, int sub_version, const std::string &problem_name);
+  void get_enrollments_async(ResponseCallback callback, const std::string &course_name, ResponseHandler *handler = nullptr);
+  void crud_enrollment_async(ResponseCallback callback, const std::string &course_name, std::string email, Params &in_params, CrudAction action);
+
 private:
   // domain of the autolab service
   std::string base_uri;
@@ -96,8 +341,53 @@ private:
   static int curl_ready;
   static int init_curl();
 
+  std::atomic<long> last_http_version;
+
+  // moves the bytes of every request, libcurl unless set_transport is used
+  std::shared_ptr<Transport> transport;
+  std::size_t max_in_flight; // zero until set, leaving the transport default
+
+  // retries of transient failures, see RetryPolicy
+  std::mutex retry_mutex;
+  RetryPolicy retry_policy;
+  std::mt19937 retry_rng;
+
+  // paces all requests, see set_rate_limit
+  std::unique_ptr<RateLimiter> rate_limiter;
+
+  std::mutex timing_mutex;
+  TimingCallback timing_callback;
+
+  std::mutex upload_mutex;
+  UploadProgressCallback upload_progress_callback;
+  long long max_upload_speed;
+  std::atomic<std::size_t> max_download_streams;
+
   // tokens-related
-  void (*new_tokens_callback)(std::string, std::string);
+  NewTokensCallback new_tokens_callback;
+  TokenLockCallback token_lock_callback;
+  TokenUnlockCallback token_unlock_callback;
+  // The tokens are shared by all threads. token_generation counts how often
+  // they were replaced, so that a request rejected with an old access token
+  // just retries with the current one. Only one refresh runs at a time, the
+  // other requests that need one wait for its outcome.
+  std::mutex token_mutex;
+  std::condition_variable tokens_changed;
+  bool refresh_in_progress;
+  std::exception_ptr refresh_error; // of the last refresh, for its waiters
+  unsigned long token_generation;
+  std::time_t token_expires_at;
+  std::thread refresh_thread;
+  bool refresh_thread_stopping;
+
+  // threads running work that must not hold up the transport's thread,
+  // joined once they are done or when the client goes away
+  struct worker {
+    std::thread thread;
+    bool done;
+  };
+  std::mutex worker_mutex;
+  std::list<worker> workers;
 
   enum HttpMethod {GET, POST, PUT, DELETE};
   HttpMethod crud_to_http(CrudAction action);
@@ -106,25 +396,46 @@ private:
   struct request_param {
     std::string key;
     std::string value;
-    char *escaped_value;
 
-    request_param(std::string k, std::string v) :
-      key(k), value(v), escaped_value(nullptr) {}
+    request_param(std::string k, std::string v) : key(k), value(v) {}
   };
   typedef std::vector<request_param> param_list;
 
   struct request_path_segment {
     std::string value;
-    char *escaped_value;
-    request_path_segment(std::string v) :
-      value(v), escaped_value(nullptr) {}
+    request_path_segment(std::string v) : value(v) {}
   };
   typedef std::vector<request_path_segment> path_segments;
 
-  std::string construct_path(CURL *curl, std::string base, RawClient::path_segments &path);
-  void free_path(RawClient::path_segments &path);
-  std::string construct_params(CURL *curl, param_list &params);
-  void free_params(param_list &params);
+  // everything needed to perform (or re-perform) a request.
+  struct request_spec {
+    path_segments path;
+    param_list params;
+    HttpMethod method;
+    bool refresh;
+    std::string download_dir;
+    std::string suggested_filename;
+    std::string upload_filename;
+    const char *upload_data;
+    std::size_t upload_length;
+    UploadStream *upload_stream;
+    ResponseHandler *handler;
+    // set for the requests that fetch further segments of a download
+    std::shared_ptr<PartialDownload> download;
+    int download_segment;
+    // extra request headers, and the ETag of the response once it is made
+    std::vector<std::string> headers;
+    std::string etag;
+
+    request_spec() : method(GET), refresh(true), upload_data(nullptr),
+      upload_length(0), upload_stream(nullptr), handler(nullptr),
+      download_segment(-1) {}
+  };
+  struct async_request;
+  struct segment_fetch;
+
+  std::string construct_path(const path_segments &path);
+  std::string construct_params(const param_list &params);
 
   // private instance vars
   int api_version;
@@ -138,24 +449,57 @@ private:
   std::string device_flow_user_code;
 
   // perform HTTP request and return result, default method is GET.
+  void prepare_request(HttpRequest &request, request_state *rstate, path_segments &path, param_list &params, HttpMethod method);
+  long finish_request(request_state *rstate, const TransferInfo &info, CURLcode res);
+  bool should_retry(request_state *rstate, HttpMethod method, CURLcode res, int &attempt, std::chrono::milliseconds &delay);
+  void report_timing(const TransferInfo &info, path_segments &path);
   long raw_request(request_state *rstate, path_segments &path, param_list &params, HttpMethod method);
   long raw_request_optional_refresh(request_state *rstate, path_segments &path, param_list &params, HttpMethod method, bool refresh);
-  long make_request(rapidjson::Document &response, path_segments &path, param_list &params, HttpMethod method, bool refresh, 
-    const std::string &download_dir, const std::string &suggested_filename, const std::string &upload_filename);
+  long make_request(rapidjson::Document &response, request_spec &spec);
+  void parse_response(rapidjson::Document &response, request_spec &spec, request_state &rstate);
+  void make_request_async(request_spec &spec, ResponseCallback callback);
+  void perform_async(std::shared_ptr<async_request> request,
+    std::chrono::milliseconds delay = std::chrono::milliseconds(0));
+  void complete_async(std::shared_ptr<async_request> request, CURLcode res);
+  void finish_download(request_spec &spec, std::shared_ptr<PartialDownload> download);
+  void fetch_segments(const request_spec &spec,
+    std::shared_ptr<PartialDownload> download,
+    std::function<void(std::exception_ptr error)> done);
+  void fetch_next_segment(std::shared_ptr<segment_fetch> fetch);
+  void run_off_engine(std::function<void()> work);
+  void join_workers();
 
   void clear_device_flow_strings();
 
   bool save_tokens_from_response(rapidjson::Document &response);
   bool get_token_from_authorization_code(std::string authorization_code);
   bool perform_token_refresh();
-
-  bool document_has_error(request_state *rstate, const std::string &error_msg);
+  bool refresh_tokens(unsigned long failed_generation);
+  bool perform_shared_token_refresh();
+  bool token_expiring();
+  void refresh_if_expiring();
+  void run_background_refresh();
+
+  void parse_body(request_state *rstate);
+  bool response_has_error(request_state *rstate, const std::string &error_msg);
   void init_regular_path(path_segments &path);
   void init_regular_params(param_list &params);
   void init_oauth_token_path(path_segments &path);
   void init_device_flow_init_path(path_segments &path);
   void init_device_flow_authorize_path(path_segments &path);
-  void update_access_token_in_params(param_list &params);
+  void update_access_token_in_params(param_list &params, unsigned long &generation);
+
+  // request builders shared by the synchronous and asynchronous interfaces
+  void init_user_info_request(request_spec &spec);
+  void init_courses_request(request_spec &spec);
+  void init_assessments_request(request_spec &spec, const std::string &course_name);
+  void init_assessment_details_request(request_spec &spec, const std::string &course_name, const std::string &asmt_name);
+  void init_problems_request(request_spec &spec, const std::string &course_name, const std::string &asmt_name);
+  void init_attachment_request(request_spec &spec, const std::string &attachment, std::string download_dir, const std::string &course_name, const std::string &asmt_name);
+  void init_submissions_request(request_spec &spec, const std::string &course_name, const std::string &asmt_name);
+  void init_feedback_request(request_spec &spec, const std::string &course_name, const std::string &asmt_name, int sub_version, const std::string &problem_name);
+  void init_enrollments_request(request_spec &spec, const std::string &course_name);
+  void init_crud_enrollment_request(request_spec &spec, const std::string &course_name, std::string email, Params &in_params, CrudAction action);
 };
 
 }
@@ -0,0 +1,127 @@
+/*
+ * The transport interface.
+ *
+ * RawClient decides what to request and what a response means, and leaves
+ * moving the bytes to a Transport. By default that is libcurl, but any other
+ * transport can be plugged in with RawClient::set_transport, e.g. MockServer,
+ * which answers from fixture data without touching the network.
+ *
+ * Transfer results use curl's error codes (CURLE_OK on success), so that the
+ * retry logic treats every transport alike.
+ */
+
+#ifndef LIBAUTOLAB_TRANSPORT_H_
+#define LIBAUTOLAB_TRANSPORT_H_
+
+#include <cstddef>
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <curl/curl.h>
+
+namespace Autolab {
+
+// called while an upload is sent with the number of bytes sent so far and
+// the size of the whole request body, 0 if it is not known in advance
+typedef std::function<void(long long bytes_sent, long long bytes_total)>
+  UploadProgressCallback;
+
+// Contents of an upload that are produced while they are sent, so their
+// length is not known in advance. Each attempt of a request reads the stream
+// from the beginning.
+class UploadStream {
+public:
+  virtual ~UploadStream() {}
+  // fills up to length bytes of buffer and sets length to the number filled,
+  // 0 once the stream is over. Returns false if the stream failed.
+  virtual bool read(char *buffer, std::size_t &length) = 0;
+  // starts over from the beginning. Returns false if that is not possible.
+  virtual bool rewind() = 0;
+};
+
+// one HTTP request, with the path and parameters already url-escaped
+struct HttpRequest {
+  std::string method;           // "GET", "POST", "PUT" or "DELETE"
+  std::string base_uri;         // scheme and host, e.g. https://example.com
+  std::string path;             // starts with '/'
+  std::string query;            // key=value pairs joined by '&', may be empty
+  std::string body;             // form encoded like query, POST only
+  // extra header lines without the line break, e.g. "Range: bytes=100-"
+  std::vector<std::string> headers;
+  std::string upload_filename;  // sent as submission[file] instead of body
+  // if set, the upload_length bytes at upload_data are sent under the name
+  // upload_filename instead of the file. Not copied, they must stay valid
+  // until the transfer is over.
+  const char *upload_data;
+  std::size_t upload_length;
+  // if set, the upload is read from the stream instead. It must stay alive
+  // until the transfer is over.
+  UploadStream *upload_stream;
+  UploadProgressCallback upload_progress; // may be empty
+  long long max_upload_speed;   // bytes per second, 0 for no limit
+
+  HttpRequest() : upload_data(nullptr), upload_length(0),
+    upload_stream(nullptr), max_upload_speed(0) {}
+
+  std::string url() const {
+    return query.empty() ? base_uri + path : base_uri + path + "?" + query;
+  }
+};
+
+// Receives a response while it arrives: every header line (status lines
+// included, terminated by "\r\n") and then the body, in chunks. Returning
+// false aborts the transfer.
+class ResponseSink {
+public:
+  virtual ~ResponseSink() {}
+  virtual bool on_header(const char *data, std::size_t length) = 0;
+  virtual bool on_body(const char *data, std::size_t length) = 0;
+};
+
+// what is known about a transfer once it ended. The timings are measured
+// from the start of the transfer, see RawClient::RequestTiming.
+struct TransferInfo {
+  long response_code;
+  long http_version; // one of CURL_HTTP_VERSION_*
+  double dns_seconds;
+  double connect_seconds;
+  double tls_seconds;
+  double ttfb_seconds;
+  double total_seconds;
+  long long bytes_sent;
+  long long bytes_received;
+
+  TransferInfo() : response_code(0), http_version(CURL_HTTP_VERSION_NONE),
+    dns_seconds(0), connect_seconds(0), tls_seconds(0), ttfb_seconds(0),
+    total_seconds(0), bytes_sent(0), bytes_received(0) {}
+};
+
+class Transport {
+public:
+  typedef std::function<void(CURLcode result)> DoneCallback;
+
+  virtual ~Transport() {}
+
+  // performs request, blocking until the response is complete. Failures are
+  // reported through the result, never thrown.
+  virtual CURLcode perform(const HttpRequest &request, ResponseSink &sink,
+    TransferInfo &info) = 0;
+
+  // starts request once delay has passed and returns immediately. done is
+  // called, possibly on another thread, when the transfer is over; request,
+  // sink and info must stay alive until then. Throws HttpException if the
+  // transfer cannot be started.
+  virtual void perform_async(const HttpRequest &request, ResponseSink &sink,
+    TransferInfo &info, DoneCallback done,
+    std::chrono::milliseconds delay) = 0;
+
+  // maximum number of asynchronous transfers running at once
+  virtual void set_max_in_flight(std::size_t limit) = 0;
+};
+
+}
+
+#endif /* LIBAUTOLAB_TRANSPORT_H_ */
@@ -2,7 +2,11 @@
 
 #include <cmath>
 
+#include <exception>
+#include <functional>
+#include <future>
 #include <map>
+#include <memory>
 #include <vector>
 
 #include <rapidjson/document.h>
@@ -10,16 +14,22 @@
 #include "autolab/raw_client.h"
 #include "json_helpers.h"
 #include "logger.h"
+#include "sax_handlers.h"
 
 namespace Autolab {
 
 Client::Client(std::string domain, std::string client_id,
                std::string client_secret, std::string redirect_uri,
-               void (*new_token_callback)(std::string, std::string))
+               RawClient::NewTokensCallback new_token_callback)
   : raw_client(domain, client_id, client_secret, redirect_uri, new_token_callback) {}
 
-void Client::set_tokens(std::string access_token, std::string refresh_token) {
-  raw_client.set_tokens(access_token, refresh_token);
+void Client::set_tokens(std::string access_token, std::string refresh_token,
+                        std::time_t expires_at) {
+  raw_client.set_tokens(access_token, refresh_token, expires_at);
+}
+
+void Client::set_background_token_refresh(bool enabled) {
+  raw_client.set_background_token_refresh(enabled);
 }
 
 /* oauth-related */
@@ -31,6 +41,56 @@ int Client::device_flow_authorize(size_t timeout) {
   return raw_client.device_flow_authorize(timeout);
 }
 
+void Client::set_max_concurrent_requests(size_t limit) {
+  raw_client.set_max_in_flight(limit);
+}
+
+void Client::set_retry_policy(const RawClient::RetryPolicy &policy) {
+  raw_client.set_retry_policy(policy);
+}
+
+void Client::set_rate_limit(double requests_per_second, size_t max_concurrent) {
+  raw_client.set_rate_limit(requests_per_second, max_concurrent);
+}
+
+void Client::set_timing_callback(RawClient::TimingCallback callback) {
+  raw_client.set_timing_callback(callback);
+}
+
+void Client::set_upload_progress_callback(UploadProgressCallback callback) {
+  raw_client.set_upload_progress_callback(callback);
+}
+
+void Client::set_max_upload_speed(long long bytes_per_second) {
+  raw_client.set_max_upload_speed(bytes_per_second);
+}
+
+void Client::set_max_download_streams(std::size_t streams) {
+  raw_client.set_max_download_streams(streams);
+}
+
+void Client::set_transport(std::shared_ptr<Transport> transport) {
+  raw_client.set_transport(transport);
+}
+
+void Client::start_recording(const std::string &dir) {
+  raw_client.start_recording(dir);
+}
+
+void Client::set_new_tokens_callback(RawClient::NewTokensCallback cb) {
+  raw_client.set_new_tokens_callback(cb);
+}
+
+void Client::set_token_lock_callbacks(RawClient::TokenLockCallback lock,
+  RawClient::TokenUnlockCallback unlock)
+{
+  raw_client.set_token_lock_callbacks(lock, unlock);
+}
+
+std::string Client::get_http_protocol() {
+  return raw_client.get_http_protocol();
+}
+
 /* custom utility */
 void download_response_to_attachment_format(Attachment &attachment,
       rapidjson::Value &response) {
@@ -88,10 +148,10 @@ void enrollment_from_json(Enrollment &enrollment, rapidjson::Value &enrollment_j
   user_from_json(enrollment.user, enrollment_json);
 }
 
-/* resource-related */
-void Client::get_user_info(User &user) {
-  rapidjson::Document user_info_doc;
-  raw_client.get_user_info(user_info_doc);
+/* response packagers, shared by the synchronous and asynchronous interfaces.
+ * Each checks for an error response before reading the document.
+ */
+void user_info_from_response(User &user, rapidjson::Document &user_info_doc) {
   check_for_error_response(user_info_doc);
 
   require_is_object(user_info_doc);
@@ -99,44 +159,7 @@ void Client::get_user_info(User &user) {
   user_from_json(user, user_info_doc);
 }
 
-void Client::get_courses(std::vector<Course> &courses) {
-  rapidjson::Document courses_doc;
-  raw_client.get_courses(courses_doc);
-  check_for_error_response(courses_doc);
-
-  require_is_array(courses_doc);
-  for (auto &c_doc : courses_doc.GetArray()) {
-    Course course;
-    course.name         = get_string_force(c_doc, "name");
-    course.display_name = get_string(c_doc, "display_name");
-    course.semester     = get_string(c_doc, "semester");
-    course.late_slack   = get_int(c_doc, "late_slack", 0);
-    course.grace_days   = get_int(c_doc, "grace_days", 0);
-    course.auth_level   = Utility::string_to_authorization_level(
-        get_string_force(c_doc, "auth_level"));
-
-    courses.push_back(course);
-  }
-}
-
-void Client::get_assessments(std::vector<Assessment> &asmts, const std::string &course_name) {
-  rapidjson::Document asmts_doc;
-  raw_client.get_assessments(asmts_doc, course_name);
-  check_for_error_response(asmts_doc);
-
-  require_is_array(asmts_doc);
-  for (auto &a_doc : asmts_doc.GetArray()) {
-    Assessment asmt;
-    assessment_from_json(asmt, a_doc);
-
-    asmts.push_back(asmt);
-  }
-}
-
-void Client::get_assessment_details(DetailedAssessment &dasmt,
-    const std::string &course_name, const std::string &asmt_name) {
-  rapidjson::Document dasmt_doc;
-  raw_client.get_assessment_details(dasmt_doc, course_name, asmt_name);
+void assessment_details_from_response(DetailedAssessment &dasmt, rapidjson::Document &dasmt_doc) {
   check_for_error_response(dasmt_doc);
 
   require_is_object(dasmt_doc);
@@ -157,84 +180,28 @@ void Client::get_assessment_details(DetailedAssessment &dasmt,
       get_string_force(dasmt_doc, "writeup_format"));
 }
 
-void Client::get_problems(std::vector<Problem> &probs, const std::string &course_name,
-    const std::string &asmt_name) {
-  rapidjson::Document probs_doc;
-  raw_client.get_problems(probs_doc, course_name, asmt_name);
-  check_for_error_response(probs_doc);
-
-  require_is_array(probs_doc);
-  for (auto &p_doc : probs_doc.GetArray()) {
-    Problem prob;
-    prob.name        = get_string_force(p_doc, "name");
-    prob.description = get_string(p_doc, "description");
-    prob.max_score   = get_double(p_doc, "max_score");
-    prob.optional    = get_bool(p_doc, "optional", false);
-
-    probs.push_back(prob);
-  }
-}
-
-void Client::get_submissions(std::vector<Submission> &subs, 
-    const std::string &course_name, const std::string &asmt_name) {
-  rapidjson::Document subs_doc;
-  raw_client.get_submissions(subs_doc, course_name, asmt_name);
-  check_for_error_response(subs_doc);
-
-  require_is_array(subs_doc);
-  for (auto &s_doc : subs_doc.GetArray()) {
-    Submission sub;
-    sub.version    = get_int_force(s_doc, "version");
-    sub.created_at = Utility::string_to_time(get_string_force(s_doc, "created_at"));
-    sub.filename   = get_string(s_doc, "filename");
-    std::map<std::string, double> &scores = sub.scores;
-
-    rapidjson::Value &scores_doc = s_doc["scores"];
-    require_is_object(scores_doc);
-    // iterate through members of the object
-    for (auto &m : scores_doc.GetObject()) {
-      const std::string &problem_name = m.name.GetString();
-      double score;
-      if (m.value.IsDouble()) {
-        score = m.value.GetDouble();
-      } else {
-        score = std::nan(""); // unreleased
-      }
-      scores[problem_name] = score;
-    }
-
-    subs.push_back(sub);
-  }
-}
-
-void Client::get_feedback(std::string &feedback, const std::string &course_name,
-    const std::string &asmt_name, int sub_version, const std::string &problem_name) {
-  rapidjson::Document feedback_doc;
-  raw_client.get_feedback(feedback_doc, course_name, asmt_name, sub_version, problem_name);
+void feedback_from_response(std::string &feedback, rapidjson::Document &feedback_doc) {
   check_for_error_response(feedback_doc);
 
   require_is_object(feedback_doc);
   feedback = get_string_force(feedback_doc, "feedback");
 }
 
-void Client::get_enrollments(std::vector<Enrollment> &enrollments, const std::string &course_name) {
-  rapidjson::Document enrolls_doc;
-  raw_client.get_enrollments(enrolls_doc, course_name);
-  check_for_error_response(enrolls_doc);
-
-  require_is_array(enrolls_doc);
-  for (auto &e_doc : enrolls_doc.GetArray()) {
-    Enrollment enrollment;
-    enrollment_from_json(enrollment, e_doc);
+void enrollment_from_response(Enrollment &result, rapidjson::Document &enroll_doc) {
+  check_for_error_response(enroll_doc);
 
-    enrollments.push_back(enrollment);
-  }
+  require_is_object(enroll_doc);
+  enrollment_from_json(result, enroll_doc);
 }
 
-void Client::crud_enrollment(Enrollment &result, const std::string &course_name,
-    std::string email, EnrollmentOption &input, CrudAction action) {
-  RawClient::Params in_params;
+void attachment_from_response(Attachment &attachment, rapidjson::Document &response_doc) {
+  check_for_error_response(response_doc);
+
+  download_response_to_attachment_format(attachment, response_doc);
+}
 
+void enrollment_input_to_params(RawClient::Params &in_params,
+    EnrollmentOption &input, CrudAction action) {
   if (action == Create || action == Update) {
     if (!input.lecture.NONE)
       in_params.push_back(std::make_pair("lecture", input.lecture.SOME));
@@ -251,13 +218,82 @@ void Client::crud_enrollment(Enrollment &result, const std::string &course_name,
       in_params.push_back(std::make_pair("auth_level",
           Utility::authorization_level_to_string(input.auth_level.SOME)));
   }
+}
+
+/* resource-related */
+void Client::get_user_info(User &user) {
+  rapidjson::Document user_info_doc;
+  raw_client.get_user_info(user_info_doc);
+  user_info_from_response(user, user_info_doc);
+}
+
+void Client::get_courses(std::vector<Course> &courses) {
+  CourseListHandler handler(courses);
+  raw_client.get_courses(handler);
+  handler.check();
+}
+
+void Client::get_assessments(std::vector<Assessment> &asmts, const std::string &course_name) {
+  AssessmentListHandler handler(asmts);
+  raw_client.get_assessments(handler, course_name);
+  handler.check();
+}
+
+void Client::get_assessment_details(DetailedAssessment &dasmt,
+    const std::string &course_name, const std::string &asmt_name) {
+  rapidjson::Document dasmt_doc;
+  raw_client.get_assessment_details(dasmt_doc, course_name, asmt_name);
+  assessment_details_from_response(dasmt, dasmt_doc);
+}
+
+void Client::get_problems(std::vector<Problem> &probs, const std::string &course_name,
+    const std::string &asmt_name) {
+  ProblemListHandler handler(probs);
+  raw_client.get_problems(handler, course_name, asmt_name);
+  handler.check();
+}
+
+void Client::get_submissions(std::vector<Submission> &subs, 
+    const std::string &course_name, const std::string &asmt_name) {
+  SubmissionListHandler handler(subs);
+  raw_client.get_submissions(handler, course_name, asmt_name);
+  handler.check();
+}
+
+bool Client::poll_submissions(std::vector<Submission> &subs,
+    const std::string &course_name, const std::string &asmt_name,
+    std::string &etag, std::chrono::seconds wait) {
+  std::vector<Submission> changed;
+  SubmissionListHandler handler(changed);
+  if (!raw_client.poll_submissions(handler, course_name, asmt_name, etag, wait)) {
+    return false;
+  }
+  handler.check();
+  subs.swap(changed);
+  return true;
+}
+
+void Client::get_feedback(std::string &feedback, const std::string &course_name,
+    const std::string &asmt_name, int sub_version, const std::string &problem_name) {
+  rapidjson::Document feedback_doc;
+  raw_client.get_feedback(feedback_doc, course_name, asmt_name, sub_version, problem_name);
+  feedback_from_response(feedback, feedback_doc);
+}
+
+void Client::get_enrollments(std::vector<Enrollment> &enrollments, const std::string &course_name) {
+  EnrollmentListHandler handler(enrollments);
+  raw_client.get_enrollments(handler, course_name);
+  handler.check();
+}
+
+void Client::crud_enrollment(Enrollment &result, const std::string &course_name,
+    std::string email, EnrollmentOption &input, CrudAction action) {
+  RawClient::Params in_params;
+  enrollment_input_to_params(in_params, input, action);
 
   rapidjson::Document enroll_doc;
   raw_client.crud_enrollment(enroll_doc, course_name, email, in_params, action);
-  check_for_error_response(enroll_doc);
-
-  require_is_object(enroll_doc);
-  enrollment_from_json(result, enroll_doc);
+  enrollment_from_response(result, enroll_doc);
 }
 
 
@@ -265,18 +301,14 @@ void Client::download_handout(Attachment &handout, std::string download_dir,
     const std::string &course_name, const std::string &asmt_name) {
   rapidjson::Document response_doc;
   raw_client.download_handout(response_doc, download_dir, course_name, asmt_name);
-  check_for_error_response(response_doc);
-
-  download_response_to_attachment_format(handout, response_doc);
+  attachment_from_response(handout, response_doc);
 }
 
 void Client::download_writeup(Attachment &writeup, std::string download_dir,
     const std::string &course_name, const std::string &asmt_name) {
   rapidjson::Document response_doc;
   raw_client.download_writeup(response_doc, download_dir, course_name, asmt_name);
-  check_for_error_response(response_doc);
-
-  download_response_to_attachment_format(writeup, response_doc);
+  attachment_from_response(writeup, response_doc);
 }
 
 int Client::submit_assessment(const std::string &course_name, const std::string &asmt_name,
@@ -289,4 +321,152 @@ int Client::submit_assessment(const std::string &course_name, const std::string
   return get_int_force(response_doc, "version");
 }
 
+int Client::submit_assessment(const std::string &course_name, const std::string &asmt_name,
+      std::string filename, const char *data, std::size_t length) {
+  rapidjson::Document response_doc;
+  raw_client.submit_assessment(response_doc, course_name, asmt_name, filename, data, length);
+  check_for_error_response(response_doc);
+
+  require_is_object(response_doc);
+  return get_int_force(response_doc, "version");
+}
+
+int Client::submit_assessment(const std::string &course_name, const std::string &asmt_name,
+      std::string filename, UploadStream &stream) {
+  rapidjson::Document response_doc;
+  raw_client.submit_assessment(response_doc, course_name, asmt_name, filename, stream);
+  check_for_error_response(response_doc);
+
+  require_is_object(response_doc);
+  return get_int_force(response_doc, "version");
+}
+
+/* asynchronous interface */
+
+// returns a raw client callback that runs the packager on the response and
+// fulfills the promise with its outcome.
+RawClient::ResponseCallback fulfill_with(std::shared_ptr<std::promise<void>> promise,
+    std::function<void(rapidjson::Document &)> packager) {
+  return [promise, packager](rapidjson::Document &response, std::exception_ptr error) {
+    if (error) {
+      promise->set_exception(error);
+      return;
+    }
+    try {
+      packager(response);
+      promise->set_value();
+    } catch (...) {
+      promise->set_exception(std::current_exception());
+    }
+  };
+}
+
+std::future<void> Client::get_user_info_async(User &user) {
+  std::shared_ptr<std::promise<void>> promise(new std::promise<void>());
+  raw_client.get_user_info_async(fulfill_with(promise,
+      [&user](rapidjson::Document &doc) { user_info_from_response(user, doc); }));
+  return promise->get_future();
+}
+
+std::future<void> Client::get_courses_async(std::vector<Course> &courses) {
+  std::shared_ptr<std::promise<void>> promise(new std::promise<void>());
+  std::shared_ptr<CourseListHandler> handler(new CourseListHandler(courses));
+  raw_client.get_courses_async(fulfill_with(promise,
+      [handler](rapidjson::Document &) { handler->check(); }),
+      handler.get());
+  return promise->get_future();
+}
+
+std::future<void> Client::get_assessments_async(std::vector<Assessment> &asmts,
+    const std::string &course_name) {
+  std::shared_ptr<std::promise<void>> promise(new std::promise<void>());
+  std::shared_ptr<AssessmentListHandler> handler(new AssessmentListHandler(asmts));
+  raw_client.get_assessments_async(fulfill_with(promise,
+      [handler](rapidjson::Document &) { handler->check(); }),
+      course_name, handler.get());
+  return promise->get_future();
+}
+
+std::future<void> Client::get_assessment_details_async(DetailedAssessment &dasmt,
+    const std::string &course_name, const std::string &asmt_name) {
+  std::shared_ptr<std::promise<void>> promise(new std::promise<void>());
+  raw_client.get_assessment_details_async(fulfill_with(promise,
+      [&dasmt](rapidjson::Document &doc) { assessment_details_from_response(dasmt, doc); }),
+      course_name, asmt_name);
+  return promise->get_future();
+}
+
+std::future<void> Client::get_problems_async(std::vector<Problem> &probs,
+    const std::string &course_name, const std::string &asmt_name) {
+  std::shared_ptr<std::promise<void>> promise(new std::promise<void>());
+  std::shared_ptr<ProblemListHandler> handler(new ProblemListHandler(probs));
+  raw_client.get_problems_async(fulfill_with(promise,
+      [handler](rapidjson::Document &) { handler->check(); }),
+      course_name, asmt_name, handler.get());
+  return promise->get_future();
+}
+
+std::future<void> Client::get_submissions_async(std::vector<Submission> &subs,
+    const std::string &course_name, const std::string &asmt_name) {
+  std::shared_ptr<std::promise<void>> promise(new std::promise<void>());
+  std::shared_ptr<SubmissionListHandler> handler(new SubmissionListHandler(subs));
+  raw_client.get_submissions_async(fulfill_with(promise,
+      [handler](rapidjson::Document &) { handler->check(); }),
+      course_name, asmt_name, handler.get());
+  return promise->get_future();
+}
+
+std::future<void> Client::get_feedback_async(std::string &feedback,
+    const std::string &course_name, const std::string &asmt_name,
+    int sub_version, const std::string &problem_name) {
+  std::shared_ptr<std::promise<void>> promise(new std::promise<void>());
+  raw_client.get_feedback_async(fulfill_with(promise,
+      [&feedback](rapidjson::Document &doc) { feedback_from_response(feedback, doc); }),
+      course_name, asmt_name, sub_version, problem_name);
+  return promise->get_future();
+}
+
+std::future<void> Client::get_enrollments_async(std::vector<Enrollment> &enrollments,
+    const std::string &course_name) {
+  std::shared_ptr<std::promise<void>> promise(new std::promise<void>());
+  std::shared_ptr<EnrollmentListHandler> handler(new EnrollmentListHandler(enrollments));
+  raw_client.get_enrollments_async(fulfill_with(promise,
+      [handler](rapidjson::Document &) { handler->check(); }),
+      course_name, handler.get());
+  return promise->get_future();
+}
+
+std::future<void> Client::crud_enrollment_async(Enrollment &result,
+    const std::string &course_name, std::string email, EnrollmentOption &input,
+    CrudAction action) {
+  RawClient::Params in_params;
+  enrollment_input_to_params(in_params, input, action);
+
+  std::shared_ptr<std::promise<void>> promise(new std::promise<void>());
+  raw_client.crud_enrollment_async(fulfill_with(promise,
+      [&result](rapidjson::Document &doc) { enrollment_from_response(result, doc); }),
+      course_name, email, in_params, action);
+  return promise->get_future();
+}
+
+std::future<void> Client::download_handout_async(Attachment &handout,
+    std::string download_dir, const std::string &course_name,
+    const std::string &asmt_name) {
+  std::shared_ptr<std::promise<void>> promise(new std::promise<void>());
+  raw_client.download_handout_async(fulfill_with(promise,
+      [&handout](rapidjson::Document &doc) { attachment_from_response(handout, doc); }),
+      download_dir, course_name, asmt_name);
+  return promise->get_future();
+}
+
+std::future<void> Client::download_writeup_async(Attachment &writeup,
+    std::string download_dir, const std::string &course_name,
+    const std::string &asmt_name) {
+  std::shared_ptr<std::promise<void>> promise(new std::promise<void>());
+  raw_client.download_writeup_async(fulfill_with(promise,
+      [&writeup](rapidjson::Document &doc) { attachment_from_response(writeup, doc); }),
+      download_dir, course_name, asmt_name);
+  return promise->get_future();
+}
+
 }
\ No newline at end of file
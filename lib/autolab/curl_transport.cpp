@@ -0,0 +1,408 @@
+#include "curl_transport.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <memory>
+
+#include "autolab/autolab.h"
+#include "logger.h"
+#include "multi_engine.h"
+#include "rate_limiter.h"
+
+namespace Autolab {
+
+// how long resolved hostnames stay in the shared DNS cache
+const long dns_cache_timeout_seconds = 600;
+// default limit on concurrent asynchronous requests
+const std::size_t default_max_in_flight = 8;
+
+CurlTransport::CurlTransport(RateLimiter *limiter)
+  : limiter(limiter), max_in_flight(default_max_in_flight)
+{
+  // let the engine start transfers that were waiting for a free slot
+  if (limiter) {
+    limiter->set_slot_released_callback([this] {
+      std::lock_guard<std::mutex> guard(engine_mutex);
+      if (engine) engine->wakeup();
+    });
+  }
+
+  curl_share = curl_share_init();
+  if (curl_share) {
+    curl_share_setopt(curl_share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(curl_share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(curl_share, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  }
+}
+
+CurlTransport::~CurlTransport() {
+  if (limiter) limiter->set_slot_released_callback(nullptr);
+
+  // stop the engine first, aborted transfers hand their handles back
+  std::unique_ptr<MultiEngine> stopped_engine;
+  {
+    std::lock_guard<std::mutex> guard(engine_mutex);
+    stopped_engine.swap(engine);
+  }
+  stopped_engine.reset();
+
+  for (CURL *curl : idle_handles) {
+    curl_easy_cleanup(curl);
+  }
+  idle_handles.clear();
+  if (curl_share) curl_share_cleanup(curl_share);
+}
+
+/* curl handle pool */
+
+void CurlTransport::share_lock(CURL *, curl_lock_data data, curl_lock_access,
+  void *userptr)
+{
+  static_cast<CurlTransport *>(userptr)->share_locks[data].lock();
+}
+
+void CurlTransport::share_unlock(CURL *, curl_lock_data data, void *userptr) {
+  static_cast<CurlTransport *>(userptr)->share_locks[data].unlock();
+}
+
+// returns an easy handle with all options reset to the defaults used by
+// every request, or nullptr if none can be created. Reuses an idle handle
+// (and its open connections) if possible.
+CURL *CurlTransport::acquire_handle() {
+  CURL *curl = nullptr;
+  {
+    std::lock_guard<std::mutex> guard(handle_pool_mutex);
+    if (!idle_handles.empty()) {
+      curl = idle_handles.back();
+      idle_handles.pop_back();
+    }
+  }
+
+  if (curl) {
+    // keeps live connections, the DNS cache and the TLS session cache
+    curl_easy_reset(curl);
+  } else {
+    curl = curl_easy_init();
+    if (!curl) return nullptr;
+  }
+
+  if (curl_share) curl_easy_setopt(curl, CURLOPT_SHARE, curl_share);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, dns_cache_timeout_seconds);
+  // negotiate HTTP/2 through ALPN, falling back to HTTP/1.1 keep-alive if
+  // the server does not offer it. Concurrent requests wait for a pending
+  // connection to the host rather than opening another one, so that they can
+  // be multiplexed over it.
+  curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+  curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+  return curl;
+}
+
+void CurlTransport::release_handle(CURL *curl) {
+  std::lock_guard<std::mutex> guard(handle_pool_mutex);
+  idle_handles.push_back(curl);
+}
+
+/* uploads */
+
+// the contents of an upload, which curl copies from memory into its send
+// buffer: either the caller's buffer or a read-only mapping of the file.
+// Streams fill curl's buffer themselves.
+struct CurlTransport::upload_source {
+  const char *data;
+  std::size_t length;
+  std::size_t position;
+  void *mapping; // to unmap, if the file was mapped
+  UploadStream *stream;
+
+  upload_source() : data(nullptr), length(0), position(0), mapping(nullptr),
+    stream(nullptr) {}
+  ~upload_source() {
+    if (mapping) munmap(mapping, length);
+  }
+};
+
+CurlTransport::transfer::transfer() : curl(nullptr), request(nullptr),
+  info(nullptr), mime(nullptr), headers(nullptr), progress_reported(-1) {}
+
+CurlTransport::transfer::~transfer() {}
+
+// returns the contents to upload for request, or nullptr if its file cannot
+// be read. The file must not shrink while it is uploaded.
+std::unique_ptr<CurlTransport::upload_source> CurlTransport::open_upload(
+  const HttpRequest &request)
+{
+  std::unique_ptr<upload_source> source(new upload_source());
+  if (request.upload_stream) {
+    // an earlier attempt may have read part of it
+    if (!request.upload_stream->rewind()) return nullptr;
+    source->stream = request.upload_stream;
+    return source;
+  }
+  if (request.upload_data) {
+    source->data = request.upload_data;
+    source->length = request.upload_length;
+    return source;
+  }
+
+  int fd = open(request.upload_filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return nullptr;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return nullptr;
+  }
+
+  source->length = static_cast<std::size_t>(st.st_size);
+  if (source->length > 0) {
+    void *mapping = mmap(nullptr, source->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+      close(fd);
+      return nullptr;
+    }
+    madvise(mapping, source->length, MADV_SEQUENTIAL);
+    source->mapping = mapping;
+    source->data = static_cast<const char *>(mapping);
+  }
+  close(fd);
+  return source;
+}
+
+size_t CurlTransport::read_upload(char *buffer, size_t size, size_t nitems,
+  void *arg)
+{
+  upload_source *source = static_cast<upload_source *>(arg);
+  if (source->stream) {
+    std::size_t length = size * nitems;
+    if (!source->stream->read(buffer, length)) return CURL_READFUNC_ABORT;
+    return length;
+  }
+  std::size_t amount = std::min(size * nitems,
+    source->length - source->position);
+  std::memcpy(buffer, source->data + source->position, amount);
+  source->position += amount;
+  return amount;
+}
+
+// lets curl send the upload again, e.g. after a redirect
+int CurlTransport::seek_upload(void *arg, curl_off_t offset, int origin) {
+  upload_source *source = static_cast<upload_source *>(arg);
+  if (source->stream) {
+    bool rewound = origin == SEEK_SET && offset == 0 && source->stream->rewind();
+    return rewound ? CURL_SEEKFUNC_OK : CURL_SEEKFUNC_CANTSEEK;
+  }
+  if (origin != SEEK_SET || offset < 0 ||
+      static_cast<std::size_t>(offset) > source->length) {
+    return CURL_SEEKFUNC_CANTSEEK;
+  }
+  source->position = static_cast<std::size_t>(offset);
+  return CURL_SEEKFUNC_OK;
+}
+
+// libcurl progress callback, passes upload progress on when it changed
+int CurlTransport::report_progress(void *arg, curl_off_t, curl_off_t,
+  curl_off_t ultotal, curl_off_t ulnow)
+{
+  transfer *t = static_cast<transfer *>(arg);
+  if (ulnow != t->progress_reported) {
+    t->progress_reported = ulnow;
+    t->request->upload_progress(ulnow, ultotal);
+  }
+  return 0;
+}
+
+/* transfers */
+
+// libcurl header callback function
+static size_t header_callback(char *data, size_t size, size_t nmemb,
+                  ResponseSink *sink) {
+  if (!data) return 0;
+  return sink->on_header(data, size*nmemb) ? size*nmemb : 0;
+}
+
+// libcurl write callback function
+static size_t write_callback(char *data, size_t size, size_t nmemb,
+                  ResponseSink *sink) {
+  if (!data) return 0;
+  return sink->on_body(data, size*nmemb) ? size*nmemb : 0;
+}
+
+/* set up an easy handle for request. On success, the transfer must be
+ * passed to finish once it is done. Fails with CURLE_FAILED_INIT if no handle
+ * is available, and CURLE_READ_ERROR if the file to upload cannot be read or
+ * its stream cannot start over.
+ */
+CURLcode CurlTransport::prepare(CurlTransport::transfer &t,
+  const HttpRequest &request, ResponseSink &sink)
+{
+  bool is_upload = request.method == "POST" &&
+    request.upload_filename.length() > 0;
+  if (is_upload) {
+    t.upload = open_upload(request);
+    if (!t.upload) return CURLE_READ_ERROR;
+  }
+
+  t.curl = acquire_handle();
+  if (!t.curl) return CURLE_FAILED_INIT;
+  t.request = &request;
+  CURL *curl = t.curl;
+
+  if (request.method == "POST") {
+    if (is_upload) {
+      std::string::size_type slash = request.upload_filename.rfind('/');
+      std::string basename = (slash == std::string::npos) ?
+        request.upload_filename : request.upload_filename.substr(slash + 1);
+
+      t.mime = curl_mime_init(curl);
+      curl_mimepart *part = curl_mime_addpart(t.mime);
+      curl_mime_name(part, "submission[file]");
+      curl_mime_filename(part, basename.c_str());
+      // a stream of unknown length is sent chunked
+      curl_off_t length = t.upload->stream ? -1 :
+        static_cast<curl_off_t>(t.upload->length);
+      curl_mime_data_cb(part, length, read_upload, seek_upload, nullptr,
+        t.upload.get());
+      curl_easy_setopt(curl, CURLOPT_MIMEPOST, t.mime);
+
+      if (request.upload_progress) {
+        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, report_progress);
+        curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &t);
+        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+      }
+      if (request.max_upload_speed > 0) {
+        curl_easy_setopt(curl, CURLOPT_MAX_SEND_SPEED_LARGE,
+          static_cast<curl_off_t>(request.max_upload_speed));
+      }
+    } else {
+      // not copied by curl, the request outlives the transfer
+      curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request.body.c_str());
+    }
+  } else if (request.method == "PUT" || request.method == "DELETE") {
+    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request.method.c_str());
+  } else {
+    // assume GET
+    curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+  }
+
+  curl_easy_setopt(curl, CURLOPT_URL, request.url().c_str());
+  for (auto &header : request.headers) {
+    t.headers = curl_slist_append(t.headers, header.c_str());
+  }
+  if (t.headers) curl_easy_setopt(curl, CURLOPT_HTTPHEADER, t.headers);
+
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &sink);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, &sink);
+  return CURLE_OK;
+}
+
+// fill in the info of a transfer that just ended and release its resources,
+// the handle goes back to the pool for the next request
+void CurlTransport::finish(CurlTransport::transfer &t, CURLcode res) {
+  CURL *curl = t.curl;
+  TransferInfo &info = *t.info;
+  if (res == CURLE_OK) {
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &info.response_code);
+    curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &info.http_version);
+  }
+
+  // curl reports the time from the start of the transfer to each point
+  double namelookup = 0, connect = 0, appconnect = 0, pretransfer = 0,
+         starttransfer = 0;
+  curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &namelookup);
+  curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect);
+  curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &appconnect);
+  curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME, &pretransfer);
+  curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &starttransfer);
+  curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &info.total_seconds);
+  info.dns_seconds = namelookup;
+  info.connect_seconds = std::max(0.0, connect - namelookup);
+  // appconnect stays zero without a TLS handshake
+  info.tls_seconds = std::max(0.0, appconnect - connect);
+  info.ttfb_seconds = std::max(0.0, starttransfer - pretransfer);
+
+#if LIBCURL_VERSION_NUM >= 0x073700
+  curl_off_t sent = 0, received = 0;
+  curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &sent);
+  curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &received);
+#else
+  double sent = 0, received = 0;
+  curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD, &sent);
+  curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD, &received);
+#endif
+  info.bytes_sent = static_cast<long long>(sent);
+  info.bytes_received = static_cast<long long>(received);
+
+  if (t.mime) {
+    curl_mime_free(t.mime);
+    t.mime = nullptr;
+  }
+  if (t.headers) {
+    curl_slist_free_all(t.headers);
+    t.headers = nullptr;
+  }
+  t.upload.reset();
+  release_handle(curl);
+  t.curl = nullptr;
+}
+
+CURLcode CurlTransport::perform(const HttpRequest &request,
+  ResponseSink &sink, TransferInfo &info)
+{
+  transfer t;
+  t.info = &info;
+  CURLcode prepared = prepare(t, request, sink);
+  if (prepared != CURLE_OK) return prepared;
+
+  CURLcode res = curl_easy_perform(t.curl);
+  finish(t, res);
+  return res;
+}
+
+void CurlTransport::perform_async(const HttpRequest &request,
+  ResponseSink &sink, TransferInfo &info, Transport::DoneCallback done,
+  std::chrono::milliseconds delay)
+{
+  std::shared_ptr<transfer> t(new transfer());
+  t->info = &info;
+  CURLcode prepared = prepare(*t, request, sink);
+  if (prepared == CURLE_FAILED_INIT) {
+    throw HttpException("Error initializing libcurl easy interface");
+  } else if (prepared != CURLE_OK) {
+    throw HttpException(curl_easy_strerror(prepared));
+  }
+
+  try {
+    get_engine().submit(t->curl, [this, t, done](CURLcode res) {
+      finish(*t, res);
+      done(res);
+    }, delay);
+  } catch (...) {
+    finish(*t, CURLE_FAILED_INIT);
+    throw;
+  }
+}
+
+void CurlTransport::set_max_in_flight(std::size_t limit) {
+  std::lock_guard<std::mutex> guard(engine_mutex);
+  max_in_flight = (limit > 0) ? limit : 1;
+  if (engine) engine->set_max_in_flight(max_in_flight);
+}
+
+MultiEngine &CurlTransport::get_engine() {
+  std::lock_guard<std::mutex> guard(engine_mutex);
+  if (!engine) engine.reset(new MultiEngine(max_in_flight, limiter));
+  return *engine;
+}
+
+} /* namespace Autolab */
@@ -0,0 +1,96 @@
+/*
+ * The default transport, which performs requests with libcurl.
+ *
+ * Easy handles are pooled: a handle keeps its connections alive between
+ * requests, and all handles share one DNS cache and TLS session cache, so
+ * consecutive requests skip the TCP and TLS handshakes. Asynchronous
+ * transfers run on a MultiEngine, created on first use.
+ *
+ * Uploads are sent as multipart forms through curl's MIME API, read straight
+ * from the caller's buffer or from a read-only mapping of the file.
+ */
+
+#ifndef LIBAUTOLAB_CURL_TRANSPORT_H_
+#define LIBAUTOLAB_CURL_TRANSPORT_H_
+
+#include <cstddef>
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <curl/curl.h>
+
+#include "autolab/transport.h"
+
+namespace Autolab {
+
+class MultiEngine;
+class RateLimiter;
+
+class CurlTransport : public Transport {
+public:
+  // asynchronous transfers wait for a concurrency slot of limiter
+  explicit CurlTransport(RateLimiter *limiter);
+  ~CurlTransport();
+
+  CurlTransport(const CurlTransport &) = delete;
+  CurlTransport &operator=(const CurlTransport &) = delete;
+
+  CURLcode perform(const HttpRequest &request, ResponseSink &sink,
+    TransferInfo &info) override;
+  void perform_async(const HttpRequest &request, ResponseSink &sink,
+    TransferInfo &info, DoneCallback done,
+    std::chrono::milliseconds delay) override;
+  void set_max_in_flight(std::size_t limit) override;
+
+private:
+  struct upload_source;
+
+  // curl state of one transfer that must outlive it
+  struct transfer {
+    CURL *curl;
+    const HttpRequest *request;
+    TransferInfo *info;
+    curl_mime *mime;
+    curl_slist *headers;
+    std::unique_ptr<upload_source> upload;
+    curl_off_t progress_reported;
+
+    transfer();
+    ~transfer();
+  };
+
+  RateLimiter *limiter;
+
+  CURLSH *curl_share;
+  std::mutex share_locks[CURL_LOCK_DATA_LAST];
+  std::mutex handle_pool_mutex;
+  std::vector<CURL *> idle_handles;
+
+  std::mutex engine_mutex;
+  std::unique_ptr<MultiEngine> engine;
+  std::size_t max_in_flight;
+
+  CURL *acquire_handle();
+  void release_handle(CURL *curl);
+  static void share_lock(CURL *curl, curl_lock_data data,
+    curl_lock_access access, void *userptr);
+  static void share_unlock(CURL *curl, curl_lock_data data, void *userptr);
+  MultiEngine &get_engine();
+
+  CURLcode prepare(transfer &t, const HttpRequest &request,
+    ResponseSink &sink);
+  static std::unique_ptr<upload_source> open_upload(const HttpRequest &request);
+  static size_t read_upload(char *buffer, size_t size, size_t nitems,
+    void *arg);
+  static int seek_upload(void *arg, curl_off_t offset, int origin);
+  static int report_progress(void *arg, curl_off_t dltotal, curl_off_t dlnow,
+    curl_off_t ultotal, curl_off_t ulnow);
+  void finish(transfer &t, CURLcode res);
+};
+
+}
+
+#endif /* LIBAUTOLAB_CURL_TRANSPORT_H_ */
@@ -13,6 +13,11 @@ void throw_unexpected_null_error(std::string key, std::string expected_type) {
   throw Autolab::InvalidResponseException(msg_builder.str());
 }
 
+void throw_missing_key_error(std::string key) {
+  throw Autolab::InvalidResponseException(
+    "Expected key " + key + " not found in json object.");
+}
+
 void require_or_throw_invalid_response(bool guard, std::string msg) {
   if (!guard) {
     throw Autolab::InvalidResponseException(msg);
@@ -28,8 +33,9 @@ void require_is_object(rapidjson::Value &obj) {
 }
 
 void require_key_exists(rapidjson::Value &obj, std::string key) {
-  require_or_throw_invalid_response(obj.HasMember(key.c_str()),
-    "Expected key " + key + " not found in json object.");
+  if (!obj.HasMember(key.c_str())) {
+    throw_missing_key_error(key);
+  }
 }
 
 // Methods for getting basic types from objects: Bool, Double, Int, String
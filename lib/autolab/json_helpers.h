@@ -12,6 +12,11 @@
 void require_is_array(rapidjson::Value &obj);
 void require_is_object(rapidjson::Value &obj);
 
+// Throw the InvalidResponseExceptions used by the functions below, for
+// callers that read json without a document (see sax_handlers.h).
+void throw_missing_key_error(std::string key);
+void throw_unexpected_null_error(std::string key, std::string expected_type);
+
 // Methods for getting basic types from objects: Bool, Double, Int, String
 // Default fallbacks:
 //   get_string: empty string ""
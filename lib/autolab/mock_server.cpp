@@ -0,0 +1,659 @@
+#include "autolab/mock_server.h"
+
+#include <dirent.h>
+#include <strings.h> // strncasecmp
+#include <sys/stat.h>
+
+#include <cctype>
+#include <cstdio>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "autolab/autolab.h"
+#include "logger.h"
+#include "recording_transport.h"
+
+namespace Autolab {
+
+// bodies are handed to the sink in pieces, like a network would deliver them
+const std::size_t mock_chunk_size = 16 * 1024;
+const std::size_t default_mock_max_in_flight = 8;
+
+MockServer::MockServer()
+  : latency(0), requests(0), worker_started(false), stopping(false),
+    max_in_flight(default_mock_max_in_flight) {}
+
+MockServer::~MockServer() {
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    stopping = true;
+  }
+  changed.notify_all();
+  if (worker.joinable()) worker.join();
+
+  // fail whatever was not answered, like an interrupted transfer
+  std::vector<job> aborted;
+  for (auto &entry : delayed) aborted.push_back(entry.second);
+  aborted.insert(aborted.end(), pending.begin(), pending.end());
+  for (auto &entry : running) aborted.push_back(entry.second);
+  delayed.clear();
+  pending.clear();
+  running.clear();
+  for (auto &j : aborted) {
+    j.done(CURLE_ABORTED_BY_CALLBACK);
+  }
+}
+
+std::string url_unescape(const std::string &value) {
+  std::string result;
+  for (std::string::size_type i = 0; i < value.size(); i++) {
+    if (value[i] == '%' && i + 2 < value.size() &&
+        std::isxdigit(value[i + 1]) && std::isxdigit(value[i + 2])) {
+      result.push_back(static_cast<char>(
+        std::stoi(value.substr(i + 1, 2), nullptr, 16)));
+      i += 2;
+    } else {
+      result.push_back(value[i]);
+    }
+  }
+  return result;
+}
+
+/* routes */
+
+// tags body so that a client can ask whether it changed
+std::string etag_header(const std::string &body) {
+  std::ostringstream etag;
+  etag << "ETag: \"" << std::hex << std::hash<std::string>()(body) << "\"";
+  return etag.str();
+}
+
+// must be called with the mutex held
+void MockServer::set_route(const std::string &method, const std::string &path,
+  const MockServer::response &r)
+{
+  if (method == "*") {
+    // replaces the routes of the path for specific methods too
+    for (const char *m : {"GET", "POST", "PUT", "DELETE"}) {
+      routes.erase(std::string(m) + " " + path);
+    }
+  }
+  route &rt = routes[method + " " + path];
+  rt.responses.assign(1, r);
+  rt.next = 0;
+  rt.step = std::chrono::milliseconds(0);
+}
+
+MockServer::response MockServer::json_response(long status,
+  const std::string &body)
+{
+  MockServer::response r;
+  r.status = status;
+  r.headers.push_back("Content-Type: application/json; charset=utf-8");
+  r.headers.push_back(etag_header(body));
+  r.body = body;
+  return r;
+}
+
+void MockServer::add_route(const std::string &method, const std::string &path,
+  long status, const std::string &body)
+{
+  std::lock_guard<std::mutex> guard(mutex);
+  set_route(method, path, json_response(status, body));
+}
+
+void MockServer::add_timed_route(const std::string &method,
+  const std::string &path, long status, const std::vector<std::string> &bodies,
+  std::chrono::milliseconds step)
+{
+  if (bodies.empty()) return;
+  std::lock_guard<std::mutex> guard(mutex);
+  set_route(method, path, json_response(status, bodies[0]));
+  route &rt = routes[method + " " + path];
+  for (std::size_t i = 1; i < bodies.size(); i++) {
+    rt.responses.push_back(json_response(status, bodies[i]));
+  }
+  rt.step = step;
+  rt.start = std::chrono::steady_clock::now();
+}
+
+void MockServer::add_file_route(const std::string &path,
+  const std::string &filename, const std::string &contents)
+{
+  response r;
+  r.status = 200;
+  r.headers.push_back("Content-Type: application/octet-stream");
+  r.headers.push_back("Content-Disposition: attachment; filename=\"" +
+    filename + "\"");
+  // so that interrupted downloads can be resumed
+  r.headers.push_back("Accept-Ranges: bytes");
+  r.headers.push_back(etag_header(contents));
+  r.body = contents;
+  std::lock_guard<std::mutex> guard(mutex);
+  set_route("*", path, r);
+}
+
+/* fixtures */
+
+std::string json_quote(const std::string &str) {
+  std::string result("\"");
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      result.push_back('\\');
+      result.push_back(c);
+    } else if (c == '\n') {
+      result.append("\\n");
+    } else {
+      result.push_back(c);
+    }
+  }
+  result.push_back('"');
+  return result;
+}
+
+std::string mock_enrollment(const std::string &first_name,
+  const std::string &email, const std::string &auth_level, int section)
+{
+  std::ostringstream json;
+  json << "{\"first_name\":" << json_quote(first_name)
+    << ",\"last_name\":\"Mock\",\"email\":" << json_quote(email)
+    << ",\"school\":\"SCS\",\"major\":\"CS\",\"year\":\"2\""
+    << ",\"lecture\":\"1\",\"section\":\"" << static_cast<char>('A' + section % 4)
+    << "\",\"grade_policy\":\"\",\"nickname\":\"\",\"dropped\":false"
+    << ",\"auth_level\":" << json_quote(auth_level) << "}";
+  return json.str();
+}
+
+void MockServer::add_default_fixtures(std::size_t students) {
+  const std::string course = "/api/v1/courses/mock-course";
+
+  add_route("POST", "/oauth/token", 200,
+    "{\"access_token\":\"mock-access-token\","
+    "\"refresh_token\":\"mock-refresh-token\","
+    "\"token_type\":\"bearer\",\"expires_in\":7200,"
+    "\"created_at\":1788220800}");
+  add_route("*", "/oauth/device_flow_init", 200,
+    "{\"device_code\":\"mock-device-code\",\"user_code\":\"MOCK01\","
+    "\"verification_uri\":\"http://localhost/activate\"}");
+  add_route("*", "/oauth/device_flow_authorize", 200,
+    "{\"code\":\"mock-authorization-code\"}");
+
+  add_route("GET", "/api/v1/user", 200,
+    "{\"first_name\":\"Mock\",\"last_name\":\"Instructor\","
+    "\"email\":\"instructor@example.com\",\"school\":\"SCS\","
+    "\"major\":\"CS\",\"year\":\"\"}");
+  add_route("GET", "/api/v1/courses", 200,
+    "[{\"name\":\"mock-course\",\"display_name\":\"Mock Course\","
+    "\"semester\":\"f26\",\"late_slack\":0,\"grace_days\":5,"
+    "\"auth_level\":\"instructor\"}]");
+
+  const char *asmt_names[] = {"datalab", "bomblab", "attacklab"};
+  std::string asmt_list;
+  for (int i = 0; i < 3; i++) {
+    std::string name = asmt_names[i];
+    std::string asmt_path = course + "/assessments/" + name;
+    char dates[160];
+    std::snprintf(dates, sizeof(dates),
+      "\"start_at\":\"2026-09-%02dT00:00:00.000-04:00\","
+      "\"due_at\":\"2026-09-%02dT23:59:00.000-04:00\","
+      "\"end_at\":\"2026-09-%02dT23:59:00.000-04:00\"",
+      1 + 7 * i, 14 + 7 * i, 16 + 7 * i);
+    std::string summary = "{\"name\":" + json_quote(name) +
+      ",\"display_name\":" + json_quote("Lab " + std::to_string(i + 1)) +
+      ",\"category_name\":\"Labs\"," + dates;
+
+    if (!asmt_list.empty()) asmt_list.append(",");
+    asmt_list.append(summary + "}");
+    add_route("GET", asmt_path, 200, summary +
+      ",\"description\":\"A mock assessment.\",\"max_grace_days\":2"
+      ",\"max_submissions\":-1,\"max_unpenalized_submissions\":-1"
+      ",\"group_size\":1,\"disable_handins\":false,\"has_scoreboard\":false"
+      ",\"has_autograder\":true,\"handout_format\":\"file\""
+      ",\"writeup_format\":\"url\"}");
+
+    add_route("GET", asmt_path + "/problems", 200,
+      "[{\"name\":\"Correctness\",\"description\":\"\",\"max_score\":60,"
+      "\"optional\":false},{\"name\":\"Style\",\"description\":\"\","
+      "\"max_score\":10,\"optional\":false}]");
+    std::string graded =
+      "{\"version\":2,\"filename\":\"handin.tar\","
+      "\"created_at\":\"2026-09-10T12:00:00.000-04:00\","
+      "\"scores\":{\"Correctness\":60.0,\"Style\":8.0}},"
+      "{\"version\":1,\"filename\":\"handin.tar\","
+      "\"created_at\":\"2026-09-09T12:00:00.000-04:00\","
+      "\"scores\":{\"Correctness\":42.0}}]";
+    if (name == "attacklab") {
+      // the latest submission is still being autograded for a few seconds,
+      // for trying out 'submit --wait'
+      std::string latest = "[{\"version\":3,\"filename\":\"handin.tar\","
+        "\"created_at\":\"2026-09-11T12:00:00.000-04:00\",\"scores\":";
+      add_timed_route("GET", asmt_path + "/submissions", 200, {
+        latest + "{}}," + graded,
+        latest + "{\"Correctness\":55.0,\"Style\":9.0}}," + graded},
+        std::chrono::seconds(3));
+    } else {
+      add_route("GET", asmt_path + "/submissions", 200, "[" + graded);
+    }
+    for (int version = 1; version <= 3; version++) {
+      add_route("GET", asmt_path + "/submissions/" + std::to_string(version) +
+        "/feedback", 200, "{\"feedback\":" + json_quote("Autograder report for " +
+        name + ", version " + std::to_string(version) + "\n") + "}");
+    }
+    add_route("POST", asmt_path + "/submit", 200,
+      "{\"version\":3,\"filename\":\"handin.tar\"}");
+
+    // a handout large enough to arrive in several chunks
+    std::string handout;
+    for (int block = 0; handout.size() < 4 * mock_chunk_size; block++) {
+      handout.append(name + " handout block " + std::to_string(block) + "\n");
+    }
+    add_file_route(asmt_path + "/handout", name + "-handout.tar", handout);
+    add_route("GET", asmt_path + "/writeup", 200,
+      "{\"url\":\"http://localhost/" + name + "/writeup.pdf\"}");
+  }
+  add_route("GET", course + "/assessments", 200, "[" + asmt_list + "]");
+
+  std::string enrollments = "[" + mock_enrollment("Mock",
+    "instructor@example.com", "instructor", 0);
+  for (std::size_t i = 0; i < students; i++) {
+    char email[64];
+    std::snprintf(email, sizeof(email), "student%04zu@example.com", i);
+    std::string enrollment = mock_enrollment("Student " + std::to_string(i),
+      email, "student", static_cast<int>(i));
+    enrollments.append("," + enrollment);
+    add_route("*", course + "/course_user_data/" + email, 200, enrollment);
+  }
+  enrollments.append("]");
+  add_route("GET", course + "/course_user_data", 200, enrollments);
+  add_route("POST", course + "/course_user_data", 200, mock_enrollment(
+    "New", "new.student@example.com", "student", 0));
+}
+
+// collects the paths of all regular files below dir/prefix, relative to dir
+bool list_fixture_files(const std::string &dir, const std::string &prefix,
+  std::vector<std::string> &files)
+{
+  DIR *handle = opendir((dir + "/" + prefix).c_str());
+  if (!handle) return false;
+
+  struct dirent *entry;
+  while ((entry = readdir(handle))) {
+    std::string name(entry->d_name);
+    if (name == "." || name == "..") continue;
+
+    std::string relative = prefix.empty() ? name : prefix + "/" + name;
+    struct stat info;
+    if (stat((dir + "/" + relative).c_str(), &info) != 0) continue;
+    if (S_ISDIR(info.st_mode)) {
+      list_fixture_files(dir, relative, files);
+    } else if (S_ISREG(info.st_mode)) {
+      files.push_back(relative);
+    }
+  }
+  closedir(handle);
+  return true;
+}
+
+void MockServer::load_fixtures(const std::string &dir) {
+  std::vector<std::string> files;
+  if (!list_fixture_files(dir, "", files)) {
+    throw HttpException("Cannot read mock server fixtures from " + dir);
+  }
+
+  const std::string json_extension = ".json";
+  for (auto &relative : files) {
+    std::ifstream file(dir + "/" + relative, std::ifstream::binary);
+    std::string contents((std::istreambuf_iterator<char>(file)),
+      std::istreambuf_iterator<char>());
+
+    if (relative.size() > json_extension.size() &&
+        relative.compare(relative.size() - json_extension.size(),
+          json_extension.size(), json_extension) == 0) {
+      std::string path = relative.substr(0, relative.size() - json_extension.size());
+      add_route("*", "/" + path, 200, contents);
+    } else {
+      std::string::size_type slash = relative.rfind('/');
+      if (slash == std::string::npos) continue;
+      add_file_route("/" + relative.substr(0, slash),
+        relative.substr(slash + 1), contents);
+    }
+    LogDebug("[MockServer] loaded fixture " << relative << Logger::endl);
+  }
+}
+
+void MockServer::load_recording(const std::string &dir, bool original_timing) {
+  std::vector<RecordedExchange> exchanges = RecordingTransport::read_recording(dir);
+
+  std::lock_guard<std::mutex> guard(mutex);
+  std::set<std::string> replaced;
+  for (auto &exchange : exchanges) {
+    response r;
+    r.status = exchange.info.response_code;
+    r.headers = exchange.headers;
+    r.body = exchange.body;
+    r.result = exchange.result;
+    if (original_timing) {
+      r.latency_ms = static_cast<long>(exchange.info.total_seconds * 1000);
+    }
+
+    std::string key = exchange.method + " " + url_unescape(exchange.path);
+    if (exchange.params.length() > 0) key.append("?" + exchange.params);
+    // the recording replaces any fixture for the same request
+    route &rt = routes[key];
+    if (replaced.insert(key).second) {
+      rt.responses.clear();
+      rt.next = 0;
+    }
+    rt.responses.push_back(r);
+  }
+  LogDebug("[MockServer] loaded " << exchanges.size() << " recorded exchanges"
+    << Logger::endl);
+}
+
+/* serving */
+
+// the value of header in request or response headers, empty if missing
+std::string find_header(const std::vector<std::string> &headers,
+  const std::string &name)
+{
+  for (auto &line : headers) {
+    if (line.length() > name.length() && line[name.length()] == ':' &&
+        strncasecmp(line.c_str(), name.c_str(), name.length()) == 0) {
+      std::string value = line.substr(name.length() + 1);
+      value.erase(0, value.find_first_not_of(" \t"));
+      return value;
+    }
+  }
+  return "";
+}
+
+// picks the response to request and counts it. Must be called with the
+// mutex held.
+MockServer::response MockServer::answer(const HttpRequest &request) {
+  requests++;
+  std::string path = url_unescape(request.path);
+  std::string params = RecordingTransport::request_params(request);
+
+  std::vector<std::string> keys;
+  if (params.length() > 0) keys.push_back(request.method + " " + path + "?" + params);
+  keys.push_back(request.method + " " + path);
+  keys.push_back("* " + path);
+  for (auto &key : keys) {
+    auto it = routes.find(key);
+    if (it == routes.end()) continue;
+    route &rt = it->second;
+    time_point now = std::chrono::steady_clock::now();
+    std::size_t index;
+    if (rt.step.count() > 0) {
+      index = std::min<std::size_t>((now - rt.start) / rt.step,
+        rt.responses.size() - 1);
+    } else {
+      index = std::min(rt.next, rt.responses.size() - 1);
+      if (rt.next < rt.responses.size()) rt.next++;
+    }
+    const response &r = rt.responses[index];
+
+    std::string if_none_match = find_header(request.headers, "If-None-Match");
+    if (request.method == "GET" && !if_none_match.empty() &&
+        if_none_match == find_header(r.headers, "ETag")) {
+      return not_modified(request, rt, index, now);
+    }
+    return r;
+  }
+
+  response not_found;
+  not_found.status = 404;
+  not_found.headers.push_back("Content-Type: application/json; charset=utf-8");
+  not_found.body = "{\"error\":\"Not found\"}";
+  return not_found;
+}
+
+// answers a conditional request for the index-th response of rt, which the
+// client already has. A long poll is held until the route changes, as long
+// as it asks to wait for. Must be called with the mutex held.
+MockServer::response MockServer::not_modified(const HttpRequest &request,
+  const MockServer::route &rt, std::size_t index, time_point now)
+{
+  long wait_seconds = 0;
+  std::sscanf(find_header(request.headers, "Prefer").c_str(), "wait=%ld",
+    &wait_seconds);
+  std::chrono::milliseconds wait = std::chrono::seconds(std::max(0L, wait_seconds));
+
+  if (rt.step.count() > 0 && index + 1 < rt.responses.size()) {
+    auto until_change = std::chrono::duration_cast<std::chrono::milliseconds>(
+      rt.start + rt.step * (index + 1) - now);
+    if (until_change <= wait) {
+      response changed = rt.responses[index + 1];
+      changed.latency_ms = (until_change + response_latency(changed)).count();
+      return changed;
+    }
+  }
+
+  const response &current = rt.responses[index];
+  response r;
+  r.status = 304;
+  r.headers.push_back("ETag: " + find_header(current.headers, "ETag"));
+  r.latency_ms = (wait + response_latency(current)).count();
+  return r;
+}
+
+// must be called with the mutex held
+std::chrono::milliseconds MockServer::response_latency(const response &r) {
+  if (r.latency_ms >= 0) return std::chrono::milliseconds(r.latency_ms);
+  return latency;
+}
+
+void MockServer::set_latency(std::chrono::milliseconds l) {
+  std::lock_guard<std::mutex> guard(mutex);
+  latency = l;
+}
+
+std::size_t MockServer::request_count() {
+  std::lock_guard<std::mutex> guard(mutex);
+  return requests;
+}
+
+void MockServer::set_max_in_flight(std::size_t limit) {
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    max_in_flight = (limit > 0) ? limit : 1;
+  }
+  changed.notify_all();
+}
+
+std::string status_reason(long status) {
+  switch (status) {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 206: return "Partial Content";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 416: return "Range Not Satisfiable";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+  }
+  return "Unknown";
+}
+
+// narrows a download to the "bytes=<first>-[<last>]" range request asks for,
+// if it asks for one and the download has not changed since (If-Range)
+MockServer::response MockServer::requested_range(const HttpRequest &request,
+  const MockServer::response &r)
+{
+  std::string range = find_header(request.headers, "Range");
+  long long first = -1, last = -1;
+  if (r.status != 200 || find_header(r.headers, "Accept-Ranges").empty() ||
+      std::sscanf(range.c_str(), "bytes=%lld-%lld", &first, &last) < 1) {
+    return r;
+  }
+  std::string if_range = find_header(request.headers, "If-Range");
+  if (!if_range.empty() && if_range != find_header(r.headers, "ETag")) {
+    return r;
+  }
+
+  response partial = r;
+  std::string total = std::to_string(r.body.size());
+  if (first < 0 || static_cast<std::size_t>(first) >= r.body.size()) {
+    partial.status = 416;
+    partial.headers.assign(1, "Content-Range: bytes */" + total);
+    partial.body.clear();
+  } else {
+    long long size = static_cast<long long>(r.body.size());
+    if (last < first || last >= size) last = size - 1;
+    partial.status = 206;
+    partial.headers.push_back("Content-Range: bytes " + std::to_string(first) +
+      "-" + std::to_string(last) + "/" + total);
+    partial.body = r.body.substr(first, last - first + 1);
+  }
+  return partial;
+}
+
+// hands r to sink, as if it had just arrived in answer to request
+CURLcode MockServer::serve(const HttpRequest &request,
+  const MockServer::response &answer, ResponseSink &sink, TransferInfo &info)
+{
+  const response r = requested_range(request, answer);
+  std::chrono::milliseconds wait;
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    wait = response_latency(r);
+  }
+  LogDebug("[MockServer] " << request.method << " " << request.path
+    << " -> " << r.status << Logger::endl);
+
+  info.bytes_sent = request.body.size();
+  if (request.upload_stream) {
+    // drained like a server would, failing the same way curl does
+    if (!request.upload_stream->rewind()) return CURLE_READ_ERROR;
+    char buffer[16384];
+    std::size_t length;
+    info.bytes_sent = 0;
+    do {
+      length = sizeof(buffer);
+      if (!request.upload_stream->read(buffer, length)) {
+        return CURLE_ABORTED_BY_CALLBACK;
+      }
+      info.bytes_sent += length;
+    } while (length > 0);
+  } else if (request.upload_data) {
+    info.bytes_sent = request.upload_length;
+  } else if (request.upload_filename.length() > 0) {
+    std::ifstream upload(request.upload_filename, std::ifstream::binary |
+      std::ifstream::ate);
+    if (!upload) return CURLE_READ_ERROR;
+    info.bytes_sent = upload.tellg();
+  }
+  // the whole upload arrives at once
+  if (request.upload_filename.length() > 0 && request.upload_progress) {
+    request.upload_progress(info.bytes_sent, info.bytes_sent);
+  }
+  info.ttfb_seconds = info.total_seconds = wait.count() / 1000.0;
+  if (r.result != CURLE_OK) return r.result;
+  info.response_code = r.status;
+  info.http_version = CURL_HTTP_VERSION_1_1;
+
+  std::vector<std::string> lines;
+  lines.push_back("HTTP/1.1 " + std::to_string(r.status) + " " +
+    status_reason(r.status));
+  lines.insert(lines.end(), r.headers.begin(), r.headers.end());
+  lines.push_back("Content-Length: " + std::to_string(r.body.size()));
+  lines.push_back("");
+  for (auto &line : lines) {
+    std::string header = line + "\r\n";
+    if (!sink.on_header(header.c_str(), header.size())) return CURLE_WRITE_ERROR;
+  }
+
+  for (std::size_t offset = 0; offset < r.body.size(); offset += mock_chunk_size) {
+    std::size_t length = std::min(mock_chunk_size, r.body.size() - offset);
+    if (!sink.on_body(r.body.data() + offset, length)) return CURLE_WRITE_ERROR;
+    info.bytes_received += length;
+  }
+  return CURLE_OK;
+}
+
+CURLcode MockServer::perform(const HttpRequest &request, ResponseSink &sink,
+  TransferInfo &info)
+{
+  response r;
+  std::chrono::milliseconds wait;
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    r = answer(request);
+    wait = response_latency(r);
+  }
+  std::this_thread::sleep_for(wait);
+  return serve(request, r, sink, info);
+}
+
+void MockServer::perform_async(const HttpRequest &request, ResponseSink &sink,
+  TransferInfo &info, Transport::DoneCallback done,
+  std::chrono::milliseconds delay)
+{
+  job j = {&request, &sink, &info, done, response()};
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    if (stopping) {
+      throw HttpException("Request submitted after the server was shut down");
+    }
+    if (delay.count() > 0) {
+      delayed.emplace(std::chrono::steady_clock::now() + delay, j);
+    } else {
+      pending.push_back(j);
+    }
+    if (!worker_started) {
+      worker_started = true;
+      worker = std::thread(&MockServer::run, this);
+    }
+  }
+  changed.notify_all();
+}
+
+// answers asynchronous requests once their delay and latency have passed
+void MockServer::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stopping) {
+    time_point now = std::chrono::steady_clock::now();
+    while (!delayed.empty() && delayed.begin()->first <= now) {
+      pending.push_back(delayed.begin()->second);
+      delayed.erase(delayed.begin());
+    }
+    while (!pending.empty() && running.size() < max_in_flight) {
+      job j = pending.front();
+      pending.pop_front();
+      j.answer = answer(*j.request);
+      running.emplace(now + response_latency(j.answer), j);
+    }
+
+    if (!running.empty() && running.begin()->first <= now) {
+      job j = running.begin()->second;
+      running.erase(running.begin());
+      // the callback may submit follow-up requests
+      lock.unlock();
+      CURLcode res = serve(*j.request, j.answer, *j.sink, *j.info);
+      j.done(res);
+      lock.lock();
+      continue;
+    }
+
+    time_point next = time_point::max();
+    if (!delayed.empty()) next = delayed.begin()->first;
+    if (!running.empty()) next = std::min(next, running.begin()->first);
+    if (next == time_point::max()) {
+      changed.wait(lock);
+    } else {
+      changed.wait_until(lock, next);
+    }
+  }
+}
+
+} /* namespace Autolab */
@@ -0,0 +1,182 @@
+#include "multi_engine.h"
+
+#include <vector>
+
+#include "autolab/autolab.h"
+#include "logger.h"
+#include "rate_limiter.h"
+
+namespace Autolab {
+
+// upper bound on how long the worker sleeps without being woken up
+const int multi_poll_timeout_ms = 1000;
+
+MultiEngine::MultiEngine(std::size_t max_in_flight, RateLimiter *limiter)
+  : limiter(limiter), worker_started(false), stopping(false),
+    max_in_flight(max_in_flight)
+{
+  multi = curl_multi_init();
+  if (!multi) {
+    throw HttpException("Error initializing libcurl multi interface");
+  }
+  // run concurrent requests to the same host as streams of one HTTP/2
+  // connection when the server supports it
+  curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+}
+
+MultiEngine::~MultiEngine() {
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    stopping = true;
+  }
+  curl_multi_wakeup(multi);
+  if (worker.joinable()) worker.join();
+
+  abort_all();
+  curl_multi_cleanup(multi);
+}
+
+void MultiEngine::set_max_in_flight(std::size_t limit) {
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    max_in_flight = (limit > 0) ? limit : 1;
+  }
+  curl_multi_wakeup(multi);
+}
+
+void MultiEngine::wakeup() {
+  curl_multi_wakeup(multi);
+}
+
+void MultiEngine::submit(CURL *curl, MultiEngine::DoneCallback done,
+  std::chrono::milliseconds delay)
+{
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    if (stopping) {
+      throw HttpException("Request submitted after the client was shut down");
+    }
+    if (delay.count() > 0) {
+      delayed.emplace(std::chrono::steady_clock::now() + delay,
+        std::make_pair(curl, done));
+    } else {
+      pending.emplace_back(curl, done);
+    }
+    if (!worker_started) {
+      worker_started = true;
+      worker = std::thread(&MultiEngine::run, this);
+    }
+  }
+  curl_multi_wakeup(multi);
+}
+
+// moves queued transfers into the multi handle until the in-flight limit is
+// reached. Must be called with the mutex held.
+void MultiEngine::start_pending_transfers() {
+  auto now = std::chrono::steady_clock::now();
+  while (!delayed.empty() && delayed.begin()->first <= now) {
+    pending.push_back(delayed.begin()->second);
+    delayed.erase(delayed.begin());
+  }
+
+  while (!pending.empty() && active.size() < max_in_flight) {
+    if (limiter && !limiter->try_acquire_slot()) break;
+    CURL *curl = pending.front().first;
+    active[curl] = pending.front().second;
+    pending.pop_front();
+    curl_multi_add_handle(multi, curl);
+  }
+}
+
+// how long the worker may wait for activity before a delayed transfer is
+// due. Must be called with the mutex held.
+int MultiEngine::poll_timeout_ms() {
+  if (delayed.empty()) return multi_poll_timeout_ms;
+  auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+    delayed.begin()->first - std::chrono::steady_clock::now());
+  if (wait.count() <= 0) return 0;
+  if (wait.count() >= multi_poll_timeout_ms) return multi_poll_timeout_ms;
+  // round up so the transfer is due when the worker wakes up
+  return static_cast<int>(wait.count()) + 1;
+}
+
+void MultiEngine::run() {
+  int still_running = 0;
+
+  while (true) {
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      if (stopping) break;
+      start_pending_transfers();
+    }
+
+    CURLMcode mc = curl_multi_perform(multi, &still_running);
+    if (mc != CURLM_OK) {
+      LogDebug("[MultiEngine] curl_multi_perform failed: "
+        << curl_multi_strerror(mc) << Logger::endl);
+    }
+
+    // collect finished transfers, then run their callbacks without holding
+    // the lock so that callbacks may submit follow-up requests.
+    std::vector<std::pair<DoneCallback, CURLcode>> finished;
+    CURLMsg *msg;
+    int msgs_left = 0;
+    while ((msg = curl_multi_info_read(multi, &msgs_left))) {
+      if (msg->msg != CURLMSG_DONE) continue;
+      CURL *curl = msg->easy_handle;
+      CURLcode result = msg->data.result;
+      curl_multi_remove_handle(multi, curl);
+
+      std::lock_guard<std::mutex> guard(mutex);
+      auto it = active.find(curl);
+      if (it != active.end()) {
+        finished.emplace_back(it->second, result);
+        active.erase(it);
+      }
+    }
+    for (auto &done : finished) {
+      if (limiter) limiter->release_slot();
+      done.first(done.second);
+    }
+    if (!finished.empty()) continue;
+
+    int timeout_ms;
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      timeout_ms = poll_timeout_ms();
+    }
+    curl_multi_poll(multi, nullptr, 0, timeout_ms, nullptr);
+  }
+}
+
+// fails every queued and running transfer. Only called once the worker has
+// stopped.
+void MultiEngine::abort_all() {
+  std::vector<DoneCallback> aborted;
+  std::size_t running;
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    for (auto &entry : active) {
+      curl_multi_remove_handle(multi, entry.first);
+      aborted.push_back(entry.second);
+    }
+    running = active.size();
+    active.clear();
+    for (auto &entry : pending) {
+      aborted.push_back(entry.second);
+    }
+    pending.clear();
+    for (auto &entry : delayed) {
+      aborted.push_back(entry.second.second);
+    }
+    delayed.clear();
+  }
+  if (limiter) {
+    for (std::size_t i = 0; i < running; i++) limiter->release_slot();
+  }
+  for (auto &done : aborted) {
+    done(CURLE_ABORTED_BY_CALLBACK);
+  }
+}
+
+} /* namespace Autolab */
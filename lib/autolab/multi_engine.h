@@ -0,0 +1,76 @@
+/*
+ * Asynchronous transfer engine built on the curl multi interface.
+ *
+ * Prepared easy handles are submitted to the engine together with a
+ * completion callback. A background thread drives all transfers on a single
+ * multi handle and invokes the callback (on that thread) once a transfer is
+ * done. At most max_in_flight transfers run at the same time, the rest wait
+ * in a queue, and transfers submitted with a delay wait until it has passed
+ * (without holding up the others). A transfer also needs a concurrency slot
+ * of the client's rate limiter, if one is given, before it starts.
+ * Transfers to the same host are multiplexed over a single HTTP/2 connection
+ * if the server negotiates it.
+ */
+
+#ifndef LIBAUTOLAB_MULTI_ENGINE_H_
+#define LIBAUTOLAB_MULTI_ENGINE_H_
+
+#include <cstddef>
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include <curl/curl.h>
+
+namespace Autolab {
+
+class RateLimiter;
+
+class MultiEngine {
+public:
+  typedef std::function<void(CURLcode)> DoneCallback;
+
+  MultiEngine(std::size_t max_in_flight, RateLimiter *limiter);
+  ~MultiEngine();
+
+  MultiEngine(const MultiEngine &) = delete;
+  MultiEngine &operator=(const MultiEngine &) = delete;
+
+  void set_max_in_flight(std::size_t limit);
+  // make the worker look for transfers that can be started
+  void wakeup();
+
+  // queue a prepared easy handle, to be started once delay has passed. The
+  // engine does not take ownership of the handle; it is handed back through
+  // the callback once finished.
+  void submit(CURL *curl, DoneCallback done,
+    std::chrono::milliseconds delay = std::chrono::milliseconds(0));
+
+private:
+  CURLM *multi;
+  RateLimiter *limiter;
+  std::thread worker;
+  bool worker_started;
+  bool stopping;
+
+  std::mutex mutex;
+  std::size_t max_in_flight;
+  std::deque<std::pair<CURL *, DoneCallback>> pending;
+  std::multimap<std::chrono::steady_clock::time_point,
+                std::pair<CURL *, DoneCallback>> delayed;
+  std::map<CURL *, DoneCallback> active;
+
+  void run();
+  void start_pending_transfers();
+  int poll_timeout_ms();
+  void abort_all();
+};
+
+}
+
+#endif /* LIBAUTOLAB_MULTI_ENGINE_H_ */
@@ -0,0 +1,513 @@
+#include "partial_download.h"
+
+#include <fcntl.h>
+#include <strings.h> // strncasecmp
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <fstream>
+#include <utility>
+
+#include <openssl/err.h>
+
+#include "autolab/autolab.h"
+#include "logger.h"
+
+namespace Autolab {
+
+static void raise_digest_error() {
+  throw CryptoException(ERR_error_string(ERR_get_error(), nullptr));
+}
+
+// if line is the header name, sets value to its trimmed value
+static bool header_value(const char *data, std::size_t length,
+  const char *name, std::string &value)
+{
+  std::size_t name_length = std::strlen(name);
+  if (length <= name_length || strncasecmp(data, name, name_length) != 0 ||
+      data[name_length] != ':') {
+    return false;
+  }
+  value.assign(data + name_length + 1, length - name_length - 1);
+  value.erase(0, value.find_first_not_of(" \t"));
+  value.erase(value.find_last_not_of(" \t\r\n") + 1);
+  return true;
+}
+
+static std::string to_hex(const unsigned char *data, std::size_t length) {
+  static const char hex[] = "0123456789abcdef";
+  std::string result;
+  for (std::size_t i = 0; i < length; i++) {
+    result.push_back(hex[data[i] >> 4]);
+    result.push_back(hex[data[i] & 0xf]);
+  }
+  return result;
+}
+
+// decodes standard base64, empty if it is malformed
+static std::string base64_to_hex(const std::string &encoded) {
+  static const std::string alphabet =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string bytes;
+  unsigned int bits = 0;
+  int bit_count = 0;
+  for (char c : encoded) {
+    if (c == '=') break;
+    std::string::size_type index = alphabet.find(c);
+    if (index == std::string::npos) return "";
+    bits = (bits << 6) | static_cast<unsigned int>(index);
+    bit_count += 6;
+    if (bit_count >= 8) {
+      bit_count -= 8;
+      bytes.push_back(static_cast<char>((bits >> bit_count) & 0xff));
+    }
+  }
+  return to_hex(reinterpret_cast<const unsigned char *>(bytes.data()),
+    bytes.size());
+}
+
+// the SHA-256 of a Repr-Digest ("sha-256=:<base64>:") or Digest
+// ("SHA-256=<base64>") header in hex, empty if it has none
+static std::string sha256_from_digest_header(const std::string &value) {
+  std::string::size_type start = 0;
+  while (start < value.length()) {
+    std::string::size_type end = value.find(',', start);
+    if (end == std::string::npos) end = value.length();
+    std::string item = value.substr(start, end - start);
+    item.erase(0, item.find_first_not_of(" \t"));
+    start = end + 1;
+
+    std::string::size_type equals = item.find('=');
+    if (equals == std::string::npos ||
+        strncasecmp(item.c_str(), "sha-256", equals) != 0 || equals != 7) {
+      continue;
+    }
+    std::string encoded = item.substr(equals + 1);
+    encoded.erase(encoded.find_last_not_of(" \t") + 1);
+    if (encoded.length() > 1 && encoded.front() == ':' && encoded.back() == ':') {
+      encoded = encoded.substr(1, encoded.length() - 2);
+    }
+    return base64_to_hex(encoded);
+  }
+  return "";
+}
+
+/* DownloadResponse */
+
+void DownloadResponse::on_header(const char *data, std::size_t length) {
+  std::string value;
+  if (length > 5 && std::strncmp(data, "HTTP/", 5) == 0) {
+    // a new response, e.g. after an interim one
+    *this = DownloadResponse();
+  } else if (header_value(data, length, "ETag", value)) {
+    etag = value;
+  } else if (header_value(data, length, "Last-Modified", value)) {
+    last_modified = value;
+  } else if (header_value(data, length, "Content-Range", value)) {
+    content_range = value;
+  } else if (header_value(data, length, "Content-Length", value)) {
+    content_length = std::atoll(value.c_str());
+  } else if (header_value(data, length, "Repr-Digest", value) ||
+             (sha256.empty() && header_value(data, length, "Digest", value))) {
+    sha256 = sha256_from_digest_header(value);
+  }
+}
+
+std::string DownloadResponse::validator() const {
+  // If-Range only works with strong validators
+  if (etag.length() > 0 && etag.compare(0, 2, "W/") != 0) return etag;
+  return last_modified;
+}
+
+/* PartialDownload */
+
+// the first request of a download that may be split asks for this much, and
+// the rest is split into segments of at least min_segment_size
+const long long first_segment_size = 8 * 1024 * 1024;
+const long long min_segment_size = 4 * 1024 * 1024;
+// progress is saved at least this often, so that a download that is killed
+// resumes about where it stopped
+const long long info_save_interval = 4 * 1024 * 1024;
+
+PartialDownload::PartialDownload(const std::string &d, const std::string &name_hint) :
+  dir(d), part_path(d + "/." + name_hint + ".part"),
+  info_path(d + "/." + name_hint + ".part.info"), max_streams(1), fd(-1),
+  total_length(-1), unsaved_length(0), hash(nullptr), hashed_length(0)
+{
+  hash = EVP_MD_CTX_new();
+  if (!hash) raise_digest_error();
+  if (1 != EVP_DigestInit_ex(hash, EVP_sha256(), nullptr)) {
+    EVP_MD_CTX_free(hash);
+    raise_digest_error();
+  }
+  load_info();
+}
+
+PartialDownload::~PartialDownload() {
+  // whatever arrived is kept for the next run
+  if (fd >= 0) {
+    save_info();
+    close_file();
+  }
+  EVP_MD_CTX_free(hash);
+}
+
+void PartialDownload::set_max_streams(std::size_t streams) {
+  std::lock_guard<std::mutex> guard(mutex);
+  max_streams = std::max<std::size_t>(1, streams);
+}
+
+std::size_t PartialDownload::get_max_streams() {
+  std::lock_guard<std::mutex> guard(mutex);
+  return max_streams;
+}
+
+/* resuming */
+
+// picks up a part file left behind by an earlier run. One without a
+// validator is of no use, since it cannot be told apart from a newer file.
+void PartialDownload::load_info() {
+  std::ifstream info(info_path);
+  std::string total;
+  if (!std::getline(info, validator) || !std::getline(info, total) ||
+      !std::getline(info, filename) || validator.empty()) {
+    validator.clear();
+    filename.clear();
+    return;
+  }
+  struct stat st;
+  if (stat(part_path.c_str(), &st) != 0) {
+    validator.clear();
+    filename.clear();
+    return;
+  }
+  total_length = std::atoll(total.c_str());
+
+  long long start, end, written;
+  while (info >> start >> end >> written) {
+    segments.emplace_back(start, end, written);
+  }
+  if (segments.empty()) {
+    // written by a single stream, as far as the file goes
+    segments.emplace_back(0, total_length, st.st_size);
+  }
+
+  long long received = 0;
+  for (auto &s : segments) received += s.written;
+  LogDebug("Found " << received << " bytes of " << filename
+    << " from an earlier download" << Logger::endl);
+}
+
+void PartialDownload::save_info() {
+  if (validator.empty()) {
+    std::remove(info_path.c_str());
+    return;
+  }
+  // replaced in one go, so that a process killed meanwhile leaves the
+  // previous info behind rather than half of the new one
+  std::string temp_path = info_path + ".tmp";
+  {
+    std::ofstream info(temp_path, std::ofstream::trunc);
+    info << validator << "\n" << total_length << "\n" << filename << "\n";
+    for (auto &s : segments) {
+      info << s.start << " " << s.end << " " << s.written << "\n";
+    }
+  }
+  std::rename(temp_path.c_str(), info_path.c_str());
+  unsaved_length = 0;
+}
+
+int PartialDownload::claim_segment() {
+  std::lock_guard<std::mutex> guard(mutex);
+  if (segments.empty()) {
+    // a fresh download; if it may be split, only its beginning is asked
+    // for until the size is known
+    segments.emplace_back(0, max_streams > 1 ? first_segment_size : -1);
+  }
+  for (std::size_t i = 0; i < segments.size(); i++) {
+    if (!segments[i].claimed && !segments[i].complete()) {
+      segments[i].claimed = true;
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+bool PartialDownload::release_segment(int segment) {
+  std::lock_guard<std::mutex> guard(mutex);
+  if (segment < 0 || segment >= static_cast<int>(segments.size())) return false;
+  segments[segment].claimed = false;
+  if (fd >= 0) save_info();
+  return segments[segment].complete();
+}
+
+void PartialDownload::add_range_headers(int segment,
+  std::vector<std::string> &headers)
+{
+  std::lock_guard<std::mutex> guard(mutex);
+  if (segment < 0 || segment >= static_cast<int>(segments.size())) return;
+  segment_state &s = segments[segment];
+  long long from = s.start + s.written;
+  if (from == 0 && s.end < 0) return; // the whole file
+  // a continuation is only checked against the size, which must be known
+  if (from > 0 && validator.empty() && total_length < 0) return;
+
+  std::string range = "Range: bytes=" + std::to_string(from) + "-";
+  if (s.end >= 0) range += std::to_string(s.end - 1);
+  headers.push_back(range);
+  // the server sends the whole file instead if it changed
+  if (!validator.empty()) headers.push_back("If-Range: " + validator);
+}
+
+/* writing */
+
+bool PartialDownload::begin(int &segment, long status_code,
+  const std::string &name, const DownloadResponse &response)
+{
+  std::lock_guard<std::mutex> guard(mutex);
+  bool others_claimed = false;
+  for (std::size_t i = 0; i < segments.size(); i++) {
+    if (segments[i].claimed && static_cast<int>(i) != segment) {
+      others_claimed = true;
+    }
+  }
+
+  if (status_code == 200) {
+    // the whole file, since the server ignores ranges or the file changed
+    if (others_claimed) {
+      LogDebug(name << " changed while it was downloaded" << Logger::endl);
+      return false;
+    }
+    segments.assign(1, segment_state(0, response.content_length));
+    segments[0].claimed = true;
+    segment = 0;
+    filename = name;
+    total_length = response.content_length;
+    validator = response.validator();
+    expected_sha256 = response.sha256;
+    restart_hash();
+    if (!open_file(true)) return false;
+    if (total_length > 0 && posix_fallocate(fd, 0, total_length) != 0) {
+      LogDebug("Could not preallocate " << part_path << Logger::endl);
+    }
+    save_info();
+    return true;
+  }
+
+  // "bytes <first>-<last>/<total>"
+  long long first = -1, last = -1, total = -1;
+  bool fits = segment >= 0 && segment < static_cast<int>(segments.size()) &&
+    std::sscanf(response.content_range.c_str(), "bytes %lld-%lld/%lld",
+      &first, &last, &total) == 3;
+  if (fits) {
+    segment_state &s = segments[segment];
+    fits = first == s.start + s.written && first <= last && last < total &&
+      (total_length < 0 || total == total_length) &&
+      (filename.empty() || name == filename);
+  }
+  if (!fits) {
+    LogDebug("Cannot resume " << name << " with range "
+      << response.content_range << Logger::endl);
+    if (!others_claimed) reset();
+    return false;
+  }
+
+  segment_state &s = segments[segment];
+  bool size_known = total_length >= 0;
+  filename = name;
+  total_length = total;
+  if (!response.validator().empty()) validator = response.validator();
+  if (!response.sha256.empty()) expected_sha256 = response.sha256;
+  // the server may send less than asked for, the rest goes to new segments
+  if (s.end < 0 || s.end > last + 1) s.end = last + 1;
+
+  if (!open_file(!size_known && first == 0)) return false;
+  if (!size_known && posix_fallocate(fd, 0, total_length) != 0) {
+    // not every file system supports it, the writes still work
+    LogDebug("Could not preallocate " << part_path << Logger::endl);
+  }
+  cover_file();
+  save_info();
+  return true;
+}
+
+bool PartialDownload::write(int segment, const char *data, std::size_t length) {
+  long long offset;
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    if (fd < 0 || segment < 0 || segment >= static_cast<int>(segments.size())) {
+      return false;
+    }
+    segment_state &s = segments[segment];
+    offset = s.start + s.written;
+    // more than was asked for
+    if (s.end >= 0 && offset + static_cast<long long>(length) > s.end) {
+      return false;
+    }
+  }
+
+  // segments do not overlap, so they are written without holding the lock
+  std::size_t done = 0;
+  while (done < length) {
+    ssize_t n = pwrite(fd, data + done, length - done, offset + done);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    done += n;
+  }
+
+  std::lock_guard<std::mutex> guard(mutex);
+  segments[segment].written += length;
+  if (offset == hashed_length) {
+    if (1 != EVP_DigestUpdate(hash, data, length)) return false;
+    hashed_length += length;
+  }
+  unsaved_length += length;
+  if (unsaved_length >= info_save_interval) save_info();
+  return true;
+}
+
+bool PartialDownload::restart(int segment) {
+  std::lock_guard<std::mutex> guard(mutex);
+  for (std::size_t i = 0; i < segments.size(); i++) {
+    if (segments[i].claimed && static_cast<int>(i) != segment) return false;
+  }
+  struct stat st;
+  bool had_contents = fd >= 0 || stat(part_path.c_str(), &st) == 0;
+  reset();
+  return had_contents;
+}
+
+std::string PartialDownload::commit() {
+  std::lock_guard<std::mutex> guard(mutex);
+  long long received = 0;
+  bool complete = fd >= 0 && !segments.empty();
+  for (auto &s : segments) {
+    received += s.written;
+    // one of unknown size is over once its response is
+    if (s.end >= 0 && !s.complete()) complete = false;
+  }
+  if (!complete) {
+    throw HttpException("Download of " + filename + " is incomplete (" +
+      std::to_string(received) + " of " + std::to_string(total_length) +
+      " bytes)");
+  }
+  if (total_length < 0) total_length = received;
+
+  hash_rest_of_file();
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_length = 0;
+  if (1 != EVP_DigestFinal_ex(hash, digest, &digest_length)) raise_digest_error();
+  sha256 = to_hex(digest, digest_length);
+  close_file();
+  if (expected_sha256.length() > 0 && expected_sha256 != sha256) {
+    std::string name = filename;
+    reset();
+    throw InvalidResponseException("Download of " + name +
+      " does not match its checksum");
+  }
+
+  std::string path = dir + "/" + filename;
+  if (std::rename(part_path.c_str(), path.c_str()) != 0) {
+    throw HttpException("Failed to move download to " + path + ": " +
+      std::strerror(errno));
+  }
+  std::remove(info_path.c_str());
+  segments.clear();
+  LogDebug("Downloaded " << path << " (sha256 " << sha256 << ")"
+    << Logger::endl);
+  return path;
+}
+
+std::string PartialDownload::digest() {
+  std::lock_guard<std::mutex> guard(mutex);
+  return sha256;
+}
+
+/* the part file, with the lock held */
+
+bool PartialDownload::open_file(bool truncate) {
+  if (fd >= 0) return !truncate || ftruncate(fd, 0) == 0;
+  int flags = O_RDWR | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0);
+  fd = ::open(part_path.c_str(), flags, 0644);
+  if (fd < 0) return false;
+  LogDebug("Opened file " << part_path << Logger::endl);
+  return true;
+}
+
+void PartialDownload::close_file() {
+  if (fd >= 0) ::close(fd);
+  fd = -1;
+}
+
+// splits [from, to) into segments, about one for each stream
+void PartialDownload::add_segments(long long from, long long to) {
+  long long streams = static_cast<long long>(max_streams);
+  long long size = std::max(min_segment_size, (to - from + streams - 1) / streams);
+  for (long long start = from; start < to; start += size) {
+    segments.emplace_back(start, std::min(to, start + size));
+  }
+}
+
+// adds segments for the parts of the file no segment covers
+void PartialDownload::cover_file() {
+  std::vector<std::pair<long long, long long>> covered;
+  for (auto &s : segments) {
+    covered.emplace_back(s.start, s.end < 0 ? total_length : s.end);
+  }
+  std::sort(covered.begin(), covered.end());
+  long long position = 0;
+  for (auto &range : covered) {
+    if (range.first > position) add_segments(position, range.first);
+    position = std::max(position, range.second);
+  }
+  if (position < total_length) add_segments(position, total_length);
+}
+
+// forgets the download and removes its part file
+void PartialDownload::reset() {
+  close_file();
+  std::remove(part_path.c_str());
+  std::remove(info_path.c_str());
+  segments.clear();
+  filename.clear();
+  total_length = -1;
+  unsaved_length = 0;
+  validator.clear();
+  expected_sha256.clear();
+  restart_hash();
+}
+
+/* hashing */
+
+void PartialDownload::restart_hash() {
+  if (1 != EVP_DigestInit_ex(hash, EVP_sha256(), nullptr)) raise_digest_error();
+  hashed_length = 0;
+}
+
+// hashes what was written out of order, read back from the part file
+void PartialDownload::hash_rest_of_file() {
+  char buffer[65536];
+  while (hashed_length < total_length) {
+    std::size_t wanted = static_cast<std::size_t>(
+      std::min<long long>(sizeof(buffer), total_length - hashed_length));
+    ssize_t n = pread(fd, buffer, wanted, hashed_length);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      throw HttpException("Failed to read back " + part_path + ": " +
+        std::strerror(n < 0 ? errno : EIO));
+    }
+    if (1 != EVP_DigestUpdate(hash, buffer, n)) raise_digest_error();
+    hashed_length += n;
+  }
+}
+
+}
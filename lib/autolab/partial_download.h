@@ -0,0 +1,134 @@
+/*
+ * Downloads that survive interruptions.
+ *
+ * A file is downloaded into a hidden part file next to its destination and
+ * renamed into place only once it is complete, so a file under the expected
+ * name is never a truncated one. If the transfer breaks off, the part file is
+ * kept along with what is needed to resume it, and the next attempt (or the
+ * next run) asks the server for the rest with a Range request. The contents
+ * are hashed while they are written, and checked against the digest the
+ * server sends, if any.
+ *
+ * Large files are fetched in segments, several at once: the first request
+ * only asks for the beginning of the file, and once the response tells its
+ * size, the rest is split up among further ranged requests that write into
+ * the preallocated part file with pwrite.
+ */
+
+#ifndef LIBAUTOLAB_PARTIAL_DOWNLOAD_H_
+#define LIBAUTOLAB_PARTIAL_DOWNLOAD_H_
+
+#include <cstddef>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <openssl/evp.h>
+
+namespace Autolab {
+
+// what the headers of one response say about the download
+struct DownloadResponse {
+  std::string etag;
+  std::string last_modified;
+  std::string content_range;
+  long long content_length; // -1 if not sent
+  std::string sha256;       // from Repr-Digest or Digest, in hex
+
+  DownloadResponse() : content_length(-1) {}
+
+  // sees every response header line, status lines included
+  void on_header(const char *data, std::size_t length);
+  // strong ETag or Last-Modified, empty if there is neither
+  std::string validator() const;
+};
+
+class PartialDownload {
+public:
+  // a download into dir. The name of the file is only known from the
+  // response, so name_hint (e.g. "handout") names the part file until then.
+  PartialDownload(const std::string &dir, const std::string &name_hint);
+  ~PartialDownload();
+
+  PartialDownload(const PartialDownload &) = delete;
+  PartialDownload &operator=(const PartialDownload &) = delete;
+
+  // how many segments of a large file are fetched at once, 1 to fetch it
+  // with a single request
+  void set_max_streams(std::size_t streams);
+  std::size_t get_max_streams();
+
+  // picks a segment that is missing and not being fetched, returns -1 if
+  // there is none
+  int claim_segment();
+  // the request that claimed segment is over. Returns whether it got all
+  // of the segment.
+  bool release_segment(int segment);
+  // adds the header lines that ask for the missing part of segment
+  void add_range_headers(int segment, std::vector<std::string> &headers);
+
+  // starts writing the body of a 200 or 206 response to the request for
+  // segment, a file named filename once complete. A 200 response replaces
+  // all segments with a single one, which segment is set to. Returns false
+  // if the response does not fit the part file.
+  bool begin(int &segment, long status_code, const std::string &filename,
+    const DownloadResponse &response);
+  bool write(int segment, const char *data, std::size_t length);
+  // starts over with an empty part file, unless another request than the
+  // one for segment is still writing. Returns false if nothing was discarded.
+  bool restart(int segment);
+
+  // moves the finished download into place and returns its path. Throws
+  // HttpException if it is incomplete, or InvalidResponseException if it
+  // does not match the server's digest.
+  std::string commit();
+  // lowercase hex SHA-256 of the committed file
+  std::string digest();
+
+private:
+  struct segment_state {
+    long long start;
+    long long end; // exclusive, -1 until the size of the file is known
+    long long written;
+    bool claimed;
+
+    segment_state(long long s, long long e, long long w = 0) :
+      start(s), end(e), written(w), claimed(false) {}
+    bool complete() const { return end >= 0 && start + written >= end; }
+  };
+
+  std::string dir;
+  std::string part_path;
+  std::string info_path; // validator, size, filename and segments
+  std::size_t max_streams;
+
+  std::mutex mutex;
+  std::string filename;
+  int fd;
+  std::vector<segment_state> segments;
+  long long total_length; // -1 until known
+  long long unsaved_length; // written since the info was last saved
+  std::string validator;
+  std::string expected_sha256;
+
+  // the part file is hashed as far as it is contiguous while it is written,
+  // and whatever arrived out of order is read back once it is complete
+  EVP_MD_CTX *hash;
+  long long hashed_length;
+  std::string sha256;
+
+  void load_info();
+  void save_info();
+  bool open_file(bool truncate);
+  void close_file();
+  void add_segments(long long from, long long to);
+  void cover_file();
+  void reset();
+  void restart_hash();
+  void hash_rest_of_file();
+};
+
+}
+
+#endif /* LIBAUTOLAB_PARTIAL_DOWNLOAD_H_ */
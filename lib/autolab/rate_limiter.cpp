@@ -0,0 +1,82 @@
+#include "rate_limiter.h"
+
+#include <cmath>
+
+#include <algorithm>
+
+namespace Autolab {
+
+RateLimiter::RateLimiter()
+  : rate(0), burst(0), tokens(0), last_refill(std::chrono::steady_clock::now()),
+    max_concurrent(0), running(0) {}
+
+void RateLimiter::set_rate(double requests_per_second, std::size_t max_burst) {
+  std::lock_guard<std::mutex> guard(mutex);
+  rate = std::max(0.0, requests_per_second);
+  burst = (max_burst > 0) ? max_burst : std::max(1.0, std::floor(rate));
+  // start full, so that a short run of requests is not slowed down
+  tokens = burst;
+  last_refill = std::chrono::steady_clock::now();
+}
+
+void RateLimiter::set_max_concurrent(std::size_t limit) {
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    max_concurrent = limit;
+  }
+  slot_freed.notify_all();
+}
+
+void RateLimiter::set_slot_released_callback(std::function<void()> callback) {
+  std::lock_guard<std::mutex> guard(mutex);
+  slot_released = callback;
+}
+
+// adds the tokens accumulated since the last refill. Must be called with the
+// mutex held.
+void RateLimiter::refill() {
+  auto now = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed = now - last_refill;
+  tokens = std::min(burst, tokens + elapsed.count() * rate);
+  last_refill = now;
+}
+
+std::chrono::milliseconds RateLimiter::reserve() {
+  std::lock_guard<std::mutex> guard(mutex);
+  if (rate <= 0) return std::chrono::milliseconds(0);
+
+  refill();
+  tokens -= 1;
+  if (tokens >= 0) return std::chrono::milliseconds(0);
+  // wait until the bucket has refilled up to this reservation
+  return std::chrono::milliseconds(
+    static_cast<long long>(std::ceil(-tokens / rate * 1000)));
+}
+
+void RateLimiter::acquire_slot() {
+  std::unique_lock<std::mutex> lock(mutex);
+  slot_freed.wait(lock, [this] {
+    return max_concurrent == 0 || running < max_concurrent;
+  });
+  running++;
+}
+
+bool RateLimiter::try_acquire_slot() {
+  std::lock_guard<std::mutex> guard(mutex);
+  if (max_concurrent > 0 && running >= max_concurrent) return false;
+  running++;
+  return true;
+}
+
+void RateLimiter::release_slot() {
+  std::function<void()> callback;
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    if (running > 0) running--;
+    callback = slot_released;
+  }
+  slot_freed.notify_one();
+  if (callback) callback();
+}
+
+} /* namespace Autolab */
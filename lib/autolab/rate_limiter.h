@@ -0,0 +1,64 @@
+/*
+ * Client-side rate limiting shared by all requests of a RawClient.
+ *
+ * Request starts are paced by a token bucket that refills at `rate` tokens
+ * per second and holds at most `burst` tokens; each start takes one. A start
+ * that finds the bucket empty reserves a future token instead of being
+ * refused, and is told how long to wait for it. This lets the asynchronous
+ * engine hold a transfer back without blocking its thread, while synchronous
+ * requests simply sleep.
+ *
+ * Independently, at most max_concurrent requests may be running at once.
+ */
+
+#ifndef LIBAUTOLAB_RATE_LIMITER_H_
+#define LIBAUTOLAB_RATE_LIMITER_H_
+
+#include <cstddef>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+
+namespace Autolab {
+
+class RateLimiter {
+public:
+  RateLimiter();
+
+  // a rate of zero (the default) disables the token bucket. A burst of zero
+  // allows one second worth of requests.
+  void set_rate(double requests_per_second, std::size_t burst = 0);
+  // zero (the default) allows any number of concurrent requests
+  void set_max_concurrent(std::size_t limit);
+  // called whenever a slot is given back, e.g. to wake up the engine
+  void set_slot_released_callback(std::function<void()> callback);
+
+  // reserves the next request start, returns how long to wait until then
+  std::chrono::milliseconds reserve();
+
+  // concurrency slots, each acquired one must be released
+  void acquire_slot();
+  bool try_acquire_slot();
+  void release_slot();
+
+private:
+  std::mutex mutex;
+  std::condition_variable slot_freed;
+
+  double rate;
+  double burst;
+  double tokens; // may go negative, by the number of reserved starts
+  std::chrono::steady_clock::time_point last_refill;
+
+  std::size_t max_concurrent;
+  std::size_t running;
+  std::function<void()> slot_released;
+
+  void refill();
+};
+
+}
+
+#endif /* LIBAUTOLAB_RATE_LIMITER_H_ */
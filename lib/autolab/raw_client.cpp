@@ -1,28 +1,67 @@
 #include "autolab/raw_client.h"
 
+#include <strings.h> // strncasecmp
+
+#include <cctype>
+#include <cstdlib>
+#include <ctime>
+
+#include <algorithm>
 #include <chrono>
 #include <fstream>
+#include <future>
 #include <ostream>
 #include <string>
 #include <thread> // sleep_for
 
 #include "autolab/autolab.h"
+#include "curl_transport.h"
 #include "json_helpers.h"
 #include "logger.h"
+#include "partial_download.h"
+#include "rate_limiter.h"
+#include "recording_transport.h"
+#include "response_stream.h"
 
 namespace Autolab {
 
 const std::chrono::seconds device_flow_authorize_wait_duration(5);
+// how long before the access token expires it is refreshed
+const std::chrono::seconds token_refresh_margin(60);
+// segments of a large attachment fetched at once
+const std::size_t default_download_streams = 4;
 
 /* initialization */
 int RawClient::curl_ready = false;
 
 RawClient::RawClient(const std::string &domain, const std::string &id,
-  const std::string &st, const std::string &ru, void (*tk_cb)(std::string, std::string))
-  : base_uri(domain), new_tokens_callback(tk_cb), api_version(1),
+  const std::string &st, const std::string &ru, RawClient::NewTokensCallback tk_cb)
+  : base_uri(domain), last_http_version(CURL_HTTP_VERSION_NONE),
+    max_in_flight(0), max_upload_speed(0),
+    max_download_streams(default_download_streams),
+    new_tokens_callback(tk_cb), token_lock_callback(nullptr),
+    token_unlock_callback(nullptr), refresh_in_progress(false),
+    token_generation(0), token_expires_at(0), refresh_thread_stopping(false),
+    api_version(1),
     client_id(id), client_secret(st), redirect_uri(ru)
 {
   RawClient::init_curl();
+
+  retry_rng.seed(std::random_device()());
+
+  rate_limiter.reset(new RateLimiter());
+  transport.reset(new CurlTransport(rate_limiter.get()));
+}
+
+RawClient::~RawClient() {
+  set_background_token_refresh(false);
+  // workers may still hand requests to the transport
+  join_workers();
+  // the curl transport aborts its running requests and uses the rate limiter
+  // while doing so
+  transport.reset();
+  // and reports them to their callbacks, possibly through new workers
+  join_workers();
 }
 
 int RawClient::init_curl() {
@@ -36,30 +75,270 @@ int RawClient::init_curl() {
 }
 
 // set access_token and refresh_token
-void RawClient::set_tokens(std::string at, std::string rt) {
-  access_token = at;
-  refresh_token = rt;
+void RawClient::set_tokens(std::string at, std::string rt,
+  std::time_t expires_at)
+{
+  {
+    std::lock_guard<std::mutex> guard(token_mutex);
+    access_token = at;
+    refresh_token = rt;
+    token_expires_at = expires_at;
+    token_generation++;
+  }
+  tokens_changed.notify_all();
+}
+
+const std::string RawClient::get_access_token() {
+  std::lock_guard<std::mutex> guard(token_mutex);
+  return access_token;
+}
+
+const std::string RawClient::get_refresh_token() {
+  std::lock_guard<std::mutex> guard(token_mutex);
+  return refresh_token;
+}
+
+std::time_t RawClient::get_token_expiry() {
+  std::lock_guard<std::mutex> guard(token_mutex);
+  return token_expires_at;
 }
 
 // set the function that should be called when tokens are refreshed
 
+/* transport */
+
+void RawClient::set_transport(std::shared_ptr<Transport> t) {
+  transport = t;
+  if (max_in_flight > 0) transport->set_max_in_flight(max_in_flight);
+}
+
+void RawClient::start_recording(const std::string &dir) {
+  transport = std::make_shared<RecordingTransport>(transport, dir);
+}
+
+std::string http_version_name(long version) {
+  switch (version) {
+    case CURL_HTTP_VERSION_1_0:
+      return "HTTP/1.0";
+    case CURL_HTTP_VERSION_1_1:
+      return "HTTP/1.1";
+    case CURL_HTTP_VERSION_2_0:
+      return "HTTP/2";
+#if LIBCURL_VERSION_NUM >= 0x074200
+    case CURL_HTTP_VERSION_3:
+      return "HTTP/3";
+#endif
+  }
+  return "";
+}
+
+std::string RawClient::get_http_protocol() {
+  return http_version_name(last_http_version.load());
+}
+
+/* retries */
+
+void RawClient::set_retry_policy(const RawClient::RetryPolicy &policy) {
+  std::lock_guard<std::mutex> guard(retry_mutex);
+  retry_policy = policy;
+}
+
+void RawClient::set_rate_limit(double requests_per_second,
+  std::size_t max_concurrent)
+{
+  rate_limiter->set_rate(requests_per_second);
+  rate_limiter->set_max_concurrent(max_concurrent);
+}
+
+/* timing */
+
+void RawClient::set_timing_callback(RawClient::TimingCallback callback) {
+  std::lock_guard<std::mutex> guard(timing_mutex);
+  timing_callback = callback;
+}
+
+void RawClient::set_upload_progress_callback(UploadProgressCallback callback) {
+  std::lock_guard<std::mutex> guard(upload_mutex);
+  upload_progress_callback = callback;
+}
+
+void RawClient::set_max_upload_speed(long long bytes_per_second) {
+  std::lock_guard<std::mutex> guard(upload_mutex);
+  max_upload_speed = std::max(0LL, bytes_per_second);
+}
+
+void RawClient::set_max_download_streams(std::size_t streams) {
+  max_download_streams = std::max<std::size_t>(1, streams);
+}
+
+// reports the timings of a transfer that just ended to the timing callback
+void RawClient::report_timing(const TransferInfo &info,
+  RawClient::path_segments &path)
+{
+  TimingCallback callback;
+  {
+    std::lock_guard<std::mutex> guard(timing_mutex);
+    callback = timing_callback;
+  }
+  if (!callback) return;
+
+  RequestTiming timing;
+  // the query holds the access token, so only the path is reported
+  for (auto &segment : path) {
+    timing.path.append("/" + segment.value);
+  }
+  timing.response_code = info.response_code;
+  timing.http_version = http_version_name(info.http_version);
+  timing.dns_seconds = info.dns_seconds;
+  timing.connect_seconds = info.connect_seconds;
+  timing.tls_seconds = info.tls_seconds;
+  timing.ttfb_seconds = info.ttfb_seconds;
+  timing.total_seconds = info.total_seconds;
+  timing.bytes_sent = info.bytes_sent;
+  timing.bytes_received = info.bytes_received;
+
+  callback(timing);
+}
+
+bool is_transient_error(CURLcode res) {
+  switch (res) {
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/* decides whether a request that was retried attempt times should be
+ * repeated, and if so how long to wait before doing so. Counts the retry in
+ * attempt. Called once the transfer is over but before finish_request.
+ */
+bool RawClient::should_retry(RawClient::request_state *rstate,
+  RawClient::HttpMethod method, CURLcode res, int &attempt,
+  std::chrono::milliseconds &delay)
+{
+  // the response was already handed to a stream handler
+  if (rstate->parser) return false;
+
+  bool idempotent = (method != POST);
+  // the part file the request tried to resume is gone or changed; start
+  // over right away, which does not count as a retry
+  if (res == CURLE_OK && rstate->status_code == 416 && rstate->download &&
+      rstate->download->restart(rstate->download_segment)) {
+    rstate->download_segment = -1;
+    delay = std::chrono::milliseconds(0);
+    return true;
+  }
+
+  bool transient;
+  if (res != CURLE_OK) {
+    transient = (res == CURLE_COULDNT_CONNECT) ||
+                (idempotent && is_transient_error(res));
+  } else {
+    long rc = rstate->status_code;
+    transient = (rc == 429 || rc == 503) ||
+                (idempotent && (rc == 502 || rc == 504));
+  }
+  if (!transient) return false;
+
+  std::lock_guard<std::mutex> guard(retry_mutex);
+  if (attempt >= retry_policy.max_retries) return false;
+
+  // full jitter, so that clients failing together do not retry together
+  std::chrono::milliseconds cap = retry_policy.initial_delay;
+  for (int i = 0; i < attempt && cap < retry_policy.max_delay; i++) {
+    cap *= 2;
+  }
+  cap = std::min(cap, retry_policy.max_delay);
+  std::uniform_int_distribution<long long> jitter(0, cap.count());
+  delay = std::chrono::milliseconds(jitter(retry_rng));
+
+  if (rstate->retry_after >= 0) {
+    std::chrono::seconds requested(rstate->retry_after);
+    if (requested > retry_policy.max_retry_after) return false;
+    delay = std::max<std::chrono::milliseconds>(delay, requested);
+  }
+
+  LogDebug("Request failed (" << (res != CURLE_OK ?
+      std::string(curl_easy_strerror(res)) :
+      "HTTP " + std::to_string(rstate->status_code))
+    << "), retrying in " << delay.count() << "ms" << Logger::endl);
+  attempt++;
+  return true;
+}
+
 /* Basic request helper */
 
+RawClient::request_state::request_state(std::string dir, std::string name_hint,
+  std::shared_ptr<PartialDownload> dl, int segment) :
+  file_upload(false), upload_data(nullptr), upload_length(0),
+  upload_stream(nullptr), is_download(false), suggested_filename(name_hint),
+  download_dir(dir), download(dl), download_segment(segment), response_code(0),
+  http_version(CURL_HTTP_VERSION_NONE), token_generation(0),
+  stream_handler(nullptr),
+  status_code(0), retry_after(-1), needs_slot(true),
+  has_error_response(false)
+{
+  if (!download && consider_download()) {
+    download = std::make_shared<PartialDownload>(dir, name_hint);
+  }
+  if (download) download_response = std::make_shared<DownloadResponse>();
+}
+
+// receives the response headers from the transport
+bool RawClient::request_state::on_header(const char *data, std::size_t length) {
+  // remember the status of the final response (there may be interim ones)
+  if (length > 5 && std::string(data, 5) == "HTTP/") {
+    std::string status_line(data, length);
+    std::string::size_type code_start = status_line.find(' ');
+    if (code_start != std::string::npos) {
+      status_code = std::atol(status_line.c_str() + code_start + 1);
+    }
+  }
+
+  // either a number of seconds or an HTTP date
+  const std::size_t retry_after_length = 12;
+  if (length > retry_after_length &&
+      strncasecmp(data, "Retry-After:", retry_after_length) == 0) {
+    std::string value(data + retry_after_length, length - retry_after_length);
+    value.erase(0, value.find_first_not_of(" \t"));
+    value.erase(value.find_last_not_of(" \t\r\n") + 1);
+    if (!value.empty() &&
+        value.find_first_not_of("0123456789") == std::string::npos) {
+      retry_after = std::atol(value.c_str());
+    } else {
+      std::time_t date = curl_getdate(value.c_str(), nullptr);
+      if (date != -1) {
+        retry_after = std::max<long>(0, date - std::time(nullptr));
+      }
+    }
+  }
 
-// libcurl header callback function
-size_t header_callback(char *data, size_t size, size_t nmemb,
-                  RawClient::request_state *rstate) {
-  if (!data) return 0;
+  const std::size_t etag_length = 5;
+  if (length > etag_length && strncasecmp(data, "ETag:", etag_length) == 0) {
+    etag.assign(data + etag_length, length - etag_length);
+    etag.erase(0, etag.find_first_not_of(" \t"));
+    etag.erase(etag.find_last_not_of(" \t\r\n") + 1);
+  }
 
-  if (rstate->consider_download()) {
+  if (download) {
+    download_response->on_header(data, length);
     // find out if this is supposed to be a download
     // and if so, find out the filename
-    std::string header_str(data, size*nmemb);
+    std::string header_str(data, length);
     std::string::size_type name_start, name_end;
 
     if (header_str.find("Content-Disposition:") != std::string::npos ||
         header_str.find("content-disposition:") != std::string::npos) {
-      rstate->is_download = true;
+      is_download = true;
       LogDebug(header_str << Logger::endl);
       // look for filename
       name_start = header_str.find("filename=");
@@ -68,155 +347,204 @@ size_t header_callback(char *data, size_t size, size_t nmemb,
         name_end = header_str.find('"', name_start);
         LogDebug("  name_start: " << name_start << ", name_end: " << name_end << Logger::endl);
         if (name_end != std::string::npos) {
-          rstate->suggested_filename = header_str.substr(name_start, name_end - name_start);
-          LogDebug("  suggested filename: " << rstate->suggested_filename << Logger::endl);
+          suggested_filename = header_str.substr(name_start, name_end - name_start);
+          LogDebug("  suggested filename: " << suggested_filename << Logger::endl);
         }
       }
-      // open ofstream for writing output
-      std::string full_filename = rstate->download_dir + "/" + rstate->suggested_filename;
-      rstate->file_output.open(full_filename.c_str(), std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
-      LogDebug("Opened file " << full_filename << Logger::endl);
+    }
+
+    // the headers are complete, start writing unless this is an error
+    if (is_download && length == 2 && data[0] == '\r' &&
+        status_code >= 200) {
+      if (status_code != 200 && status_code != 206) {
+        is_download = false;
+      } else {
+        return download->begin(download_segment, status_code,
+          suggested_filename, *download_response);
+      }
     }
   }
 
-  return size*nmemb;
+  return true;
 }
 
-// libcurl write callback function
-static size_t write_callback(char *data, size_t size, size_t nmemb,
-                  RawClient::request_state *rstate) {
-  if (!data) return 0;
-
-  if (rstate->is_download) {
-    rstate->file_output.write(data, size*nmemb);
+// receives the response body from the transport
+bool RawClient::request_state::on_body(const char *data, std::size_t length) {
+  if (is_download) {
+    return download->write(download_segment, data, length);
+  } else if (consider_streaming()) {
+    if (!parser) {
+      parser = std::make_shared<StreamingParser>(*stream_handler);
+    }
+    parser->feed(data, length);
   } else {
-    rstate->string_output.append(data, size*nmemb);
+    string_output.append(data, length);
   }
 
-  return size*nmemb;
+  return true;
 }
 
-std::string RawClient::construct_path(CURL *curl, std::string base, RawClient::path_segments &path) {
-  std::string result(base + "/");
-  size_t length = path.size();
-  for (size_t i = 0; i < length; i++) {
-    path[i].escaped_value = curl_easy_escape(curl, path[i].value.c_str(), path[i].value.length());
-    result.append(path[i].escaped_value);
-    if (i < length - 1) result.append("/");
+// percent-encodes everything but unreserved characters, like curl_easy_escape
+std::string url_escape(const std::string &value) {
+  static const char hex[] = "0123456789ABCDEF";
+  std::string result;
+  for (unsigned char c : value) {
+    if (std::isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') {
+      result.push_back(c);
+    } else {
+      result.push_back('%');
+      result.push_back(hex[c >> 4]);
+      result.push_back(hex[c & 0xf]);
+    }
   }
   return result;
 }
 
-void RawClient::free_path(RawClient::path_segments &path) {
-  for (auto segment : path) {
-    curl_free(segment.escaped_value);
+std::string RawClient::construct_path(const RawClient::path_segments &path) {
+  std::string result;
+  for (auto &segment : path) {
+    result.append("/" + url_escape(segment.value));
   }
+  return result;
 }
 
-std::string RawClient::construct_params(CURL *curl, RawClient::param_list &params) {
+std::string RawClient::construct_params(const RawClient::param_list &params) {
   std::string result;
   size_t length = params.size();
   for (size_t i = 0; i < length; i++) {
-    result.append(params[i].key + "=");
-    params[i].escaped_value = curl_easy_escape(curl, params[i].value.c_str(), params[i].value.length());
-    result.append(params[i].escaped_value);
+    result.append(params[i].key + "=" + url_escape(params[i].value));
     if (i < length - 1) result.append("&");
   }
   return result;
 }
 
-void RawClient::free_params(RawClient::param_list &params) {
-  for (auto item : params) {
-    curl_free(item.escaped_value);
+/* describe the HTTP request for the transport. Done again for every attempt,
+ * since a token refresh changes the params.
+ */
+void RawClient::prepare_request(HttpRequest &request,
+  RawClient::request_state *rstate, RawClient::path_segments &path,
+  RawClient::param_list &params, RawClient::HttpMethod method)
+{
+  update_access_token_in_params(params, rstate->token_generation);
+
+  request = HttpRequest();
+  request.base_uri = base_uri;
+  request.path = construct_path(path);
+  request.headers = rstate->request_headers;
+  std::string param_str = construct_params(params);
+
+  LogDebug("Requesting " << base_uri << request.path << " with params "
+    << param_str << Logger::endl << Logger::endl);
+
+  switch (method) {
+    case POST:
+      request.method = "POST";
+      if (rstate->file_upload) {
+        request.upload_filename = rstate->upload_filename;
+        request.upload_data = rstate->upload_data;
+        request.upload_length = rstate->upload_length;
+        request.upload_stream = rstate->upload_stream;
+        {
+          std::lock_guard<std::mutex> guard(upload_mutex);
+          request.upload_progress = upload_progress_callback;
+          request.max_upload_speed = max_upload_speed;
+        }
+        request.query = param_str;
+      } else {
+        request.body = param_str;
+      }
+      break;
+    case PUT:
+      request.method = "PUT";
+      request.query = param_str;
+      break;
+    case DELETE:
+      request.method = "DELETE";
+      request.query = param_str;
+      break;
+    default:
+      request.method = "GET";
+      request.query = param_str;
+      if (rstate->download) {
+        if (rstate->download_segment < 0) {
+          rstate->download->set_max_streams(max_download_streams);
+          rstate->download_segment = rstate->download->claim_segment();
+        }
+        rstate->download->add_range_headers(rstate->download_segment,
+          request.headers);
+      }
   }
 }
 
-/* actually perform the HTTP request using libcurl.
+/* collect the result of a transfer. Throws HttpException if the transfer
+ * failed.
  */
-long RawClient::raw_request(RawClient::request_state *rstate,
-  RawClient::path_segments &path, RawClient::param_list &params,
-  RawClient::HttpMethod method = GET)
+long RawClient::finish_request(RawClient::request_state *rstate,
+  const TransferInfo &info, CURLcode res)
 {
-  CURL *curl;
-  CURLcode res;
-  struct curl_httppost *formpost = nullptr;
-  struct curl_httppost *lastptr = nullptr;
-
-  curl = curl_easy_init();
-  if (!curl) {
-    throw HttpException("Error initializing libcurl easy interface");
-  }
-
-  std::string full_path = construct_path(curl, base_uri, path);
-  std::string param_str = construct_params(curl, params);
-
-  LogDebug("Requesting " << full_path << " with params " << param_str << Logger::endl
-    << Logger::endl);
-
-  if (method == POST) {
-    if (rstate->file_upload) {
-      // setup form
-      curl_formadd(&formpost,
-                   &lastptr,
-                   CURLFORM_COPYNAME, "submission[file]",
-                   CURLFORM_FILE, rstate->upload_filename.c_str(),
-                   CURLFORM_END);
-      // insert form
-      curl_easy_setopt(curl, CURLOPT_HTTPPOST, formpost);
-      // add params
-      full_path.append("?" + param_str);
-    } else {
-      curl_easy_setopt(curl, CURLOPT_POSTFIELDS, param_str.c_str());
-    }
-  } else {
-    full_path.append("?" + param_str);
-    if (method == PUT) {
-      curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
-    } else if (method == DELETE) {
-      curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
-    } else {
-      // assume GET
-      curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
-    }
+  long response_code = 0;
+  if (res == CURLE_OK) {
+    response_code = info.response_code;
+    rstate->http_version = info.http_version;
+    last_http_version = rstate->http_version;
   }
+  rstate->response_code = response_code;
 
-  curl_easy_setopt(curl, CURLOPT_URL, full_path.c_str());
-
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, rstate);
-  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
-  curl_easy_setopt(curl, CURLOPT_HEADERDATA, rstate);
-
-  res = curl_easy_perform(curl);
   if (res != CURLE_OK) {
     throw HttpException(curl_easy_strerror(res));
   }
 
-  long response_code;
-  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-  rstate->response_code = response_code;
-
-  // free resources
-  free_params(params);
-  free_path(path);
-  if (formpost) curl_formfree(formpost);
+  parse_body(rstate);
+  return response_code;
+}
 
-  curl_easy_cleanup(curl);
+/* actually perform the HTTP request through the transport, retrying
+ * transient failures according to the retry policy.
+ */
+long RawClient::raw_request(RawClient::request_state *rstate,
+  RawClient::path_segments &path, RawClient::param_list &params,
+  RawClient::HttpMethod method = GET)
+{
+  int attempt = 0;
+  while (true) {
+    std::this_thread::sleep_for(rate_limiter->reserve());
+    HttpRequest request;
+    prepare_request(request, rstate, path, params, method);
+    TransferInfo info;
+    if (rstate->needs_slot) rate_limiter->acquire_slot();
+    CURLcode res = transport->perform(request, *rstate, info);
+    if (rstate->needs_slot) rate_limiter->release_slot();
+    report_timing(info, path);
+
+    std::chrono::milliseconds delay;
+    if (!should_retry(rstate, method, res, attempt, delay)) {
+      return finish_request(rstate, info, res);
+    }
+    rstate->reset();
+    std::this_thread::sleep_for(delay);
+  }
+}
 
-  return response_code;
+/* parse a buffered response body and record whether it is an error response.
+ * This is the only time the body is parsed; the document is later handed to
+ * the caller by parse_response.
+ */
+void RawClient::parse_body(RawClient::request_state *rstate) {
+  if (rstate->is_download || rstate->parser) return;
+
+  LogDebug(rstate->string_output << Logger::endl);
+  rapidjson::Document &body = rstate->body;
+  body.Parse(rstate->string_output.c_str());
+  if (body.IsObject() && body.HasMember("error")) {
+    rstate->has_error_response = true;
+    rstate->error_response = get_string(body, "error");
+  }
 }
 
-bool RawClient::document_has_error(RawClient::request_state *rstate,
+bool RawClient::response_has_error(RawClient::request_state *rstate,
   const std::string &error_msg)
 {
-  if (rstate->is_download) return false;
-  rapidjson::Document response;
-  response.Parse(rstate->string_output.c_str());
-  return response.IsObject() &&
-         response.HasMember("error") &&
-         response["error"].IsString() &&
-         response["error"].GetString() == error_msg;
-  return false;
+  return rstate->has_error_response && rstate->error_response == error_msg;
 }
 
 /* performs raw_request, and if error is authorization_failed, refresh tokens
@@ -231,15 +559,15 @@ long RawClient::raw_request_optional_refresh(
   long rc = raw_request(rstate, path, params, method);
   if (!refresh) return rc;
 
-  if (rc == 200 || !document_has_error(rstate, oauth_auth_failed_response)) {
+  if (rc == 200 || !response_has_error(rstate, oauth_auth_failed_response)) {
     return rc;
   }
 
-  if (perform_token_refresh()) {
+  if (refresh_tokens(rstate->token_generation)) {
+    // sent with the new access token
     rstate->reset();
-    update_access_token_in_params(params);
     rc = raw_request(rstate, path, params, method);
-    if (rc == 200 || !document_has_error(rstate, oauth_auth_failed_response)) {
+    if (rc == 200 || !response_has_error(rstate, oauth_auth_failed_response)) {
       // all good now
       LogDebug("Successfully refreshed token" << Logger::endl);
       return rc;
@@ -253,55 +581,340 @@ long RawClient::raw_request_optional_refresh(
  *
  * params:
  *   - response: stores the JSON response
- *   - path:     HTTP request path
- *   - params:   HTTP request params
- *   - method:   HTTP request method
- *   - refresh:  if true, automatically calls perform_token_refresh when the
- *               request fails the first time, and retries the request.
- *   - download_dir: the directory to download the file if the response is a
- *                   file download. (full path)
- *   - suggested_filename: the default filename if the server didn't provide
- *                         the filename for the downloaded file. (name only)
- *   - upload_filename: the name of the file to upload. (relative path)
+ *   - spec:     describes the request
+ *     - path:     HTTP request path
+ *     - params:   HTTP request params
+ *     - method:   HTTP request method
+ *     - refresh:  if true, automatically calls perform_token_refresh when the
+ *                 request fails the first time, and retries the request.
+ *     - download_dir: the directory to download the file if the response is a
+ *                     file download. (full path)
+ *     - suggested_filename: the default filename if the server didn't provide
+ *                           the filename for the downloaded file. (name only)
+ *     - upload_filename: the name of the file to upload. (relative path)
+ *     - handler:  if set, the response is parsed into it instead of response.
  */
 long RawClient::make_request(rapidjson::Document &response,
-  RawClient::path_segments &path, RawClient::param_list &params,
-  RawClient::HttpMethod method = GET, bool refresh = true,
-  const std::string &download_dir = "",
-  const std::string &suggested_filename = "",
-  const std::string &upload_filename = "")
+  RawClient::request_spec &spec)
 {
-  RawClient::request_state rstate(download_dir, suggested_filename);
-  if (upload_filename.length() > 0) {
-    rstate.upload_filename = upload_filename;
+  RawClient::request_state rstate(spec.download_dir, spec.suggested_filename,
+    spec.download, spec.download_segment);
+  if (spec.upload_filename.length() > 0) {
+    rstate.upload_filename = spec.upload_filename;
+    rstate.upload_data = spec.upload_data;
+    rstate.upload_length = spec.upload_length;
+    rstate.upload_stream = spec.upload_stream;
     rstate.file_upload = true;
   }
+  rstate.stream_handler = spec.handler;
+  rstate.request_headers = spec.headers;
+  // only OAuth requests are made without refreshing
+  rstate.needs_slot = spec.refresh;
+  if (spec.refresh) refresh_if_expiring();
 
-  long rc = raw_request_optional_refresh(&rstate, path, params, method, refresh);
+  long rc = raw_request_optional_refresh(&rstate, spec.path, spec.params,
+    spec.method, spec.refresh);
 
   LogDebug("Completed make request" << Logger::endl);
 
-  rstate.close_file_output();
-  if (!rstate.is_download) {
-    LogDebug(rstate.string_output << Logger::endl);
-    response.Parse(rstate.string_output.c_str());
-  }
+  parse_response(response, spec, rstate);
+  spec.etag = rstate.etag;
+  if (rstate.is_download) finish_download(spec, rstate.download);
 
   return rc;
 }
 
+/* hand the body of a completed request to response or to the handler of the
+ * spec. Streamed bodies have been parsed as they arrived, so this only waits
+ * for the parser to finish; any other body was parsed by parse_body.
+ */
+void RawClient::parse_response(rapidjson::Document &response,
+  RawClient::request_spec &spec, RawClient::request_state &rstate)
+{
+  // nothing to parse in a 304 Not Modified
+  if (rstate.is_download || rstate.status_code == 304) return;
+
+  if (spec.handler) {
+    bool parsed;
+    if (rstate.parser) {
+      parsed = rstate.parser->finish();
+    } else {
+      parsed = !rstate.body.HasParseError();
+      if (parsed) rstate.body.Accept(*spec.handler);
+    }
+    spec.handler->Finish(parsed);
+  } else {
+    response.Swap(rstate.body);
+  }
+}
+
+/* Asynchronous requests */
+
+// state of one asynchronous request, kept alive until its callback has run.
+// The callback may own the stream handler, so it is declared before (and
+// destroyed after) the request state that might still be feeding it.
+struct RawClient::async_request {
+  request_spec spec;
+  ResponseCallback callback;
+  request_state rstate;
+  rapidjson::Document response;
+  bool refreshed;
+  int attempt; // retries so far
+  // the current attempt, handed to the transport
+  HttpRequest http_request;
+  TransferInfo info;
+
+  async_request(request_spec &s, ResponseCallback cb) :
+    spec(s), callback(cb),
+    rstate(s.download_dir, s.suggested_filename, s.download, s.download_segment),
+    refreshed(false), attempt(0) {
+    if (spec.upload_filename.length() > 0) {
+      rstate.upload_filename = spec.upload_filename;
+      rstate.upload_data = spec.upload_data;
+      rstate.upload_length = spec.upload_length;
+      rstate.upload_stream = spec.upload_stream;
+      rstate.file_upload = true;
+    }
+    rstate.stream_handler = spec.handler;
+    rstate.request_headers = spec.headers;
+  }
+};
+
+void RawClient::set_max_in_flight(std::size_t limit) {
+  max_in_flight = (limit > 0) ? limit : 1;
+  transport->set_max_in_flight(max_in_flight);
+}
+
+/* asynchronous counterpart of make_request. The callback receives the parsed
+ * response, or the exception make_request would have thrown.
+ */
+void RawClient::make_request_async(RawClient::request_spec &spec,
+  RawClient::ResponseCallback callback)
+{
+  // blocks for the refresh itself, which is rare, rather than sending a
+  // request the server is going to reject
+  if (spec.refresh) refresh_if_expiring();
+  std::shared_ptr<async_request> request(new async_request(spec, callback));
+  perform_async(request);
+}
+
+void RawClient::perform_async(std::shared_ptr<RawClient::async_request> request,
+  std::chrono::milliseconds delay)
+{
+  try {
+    delay = std::max(delay, rate_limiter->reserve());
+    prepare_request(request->http_request, &request->rstate,
+      request->spec.path, request->spec.params, request->spec.method);
+    request->info = TransferInfo();
+    transport->perform_async(request->http_request, request->rstate,
+      request->info, [this, request](CURLcode res) {
+        complete_async(request, res);
+      }, delay);
+  } catch (...) {
+    request->callback(request->response, std::current_exception());
+  }
+}
+
+// runs on the transport's thread once the transfer of request is done
+void RawClient::complete_async(std::shared_ptr<RawClient::async_request> request,
+  CURLcode res)
+{
+  request_state &rstate = request->rstate;
+  request_spec &spec = request->spec;
+  if (res != CURLE_ABORTED_BY_CALLBACK) report_timing(request->info, spec.path);
+  try {
+    std::chrono::milliseconds delay;
+    if (should_retry(&rstate, spec.method, res, request->attempt, delay)) {
+      // the transport holds the repeated transfer back until delay has passed
+      rstate.reset();
+      perform_async(request, delay);
+      return;
+    }
+
+    long rc = finish_request(&rstate, request->info, res);
+
+    if (spec.refresh && rc != 200 &&
+        response_has_error(&rstate, oauth_auth_failed_response)) {
+      if (request->refreshed) throw InvalidTokenException();
+      // the refresh may wait for the token lock and then for the server,
+      // which would hold up every other transfer of this thread
+      unsigned long generation = rstate.token_generation;
+      run_off_engine([this, request, generation]() {
+        try {
+          if (!refresh_tokens(generation)) throw InvalidTokenException();
+        } catch (...) {
+          request->callback(request->response, std::current_exception());
+          return;
+        }
+        // replay the request, prepare_request puts in the new access token
+        request->refreshed = true;
+        request->rstate.reset();
+        perform_async(request);
+      });
+      return;
+    }
+
+    parse_response(request->response, spec, rstate);
+  } catch (...) {
+    request->callback(request->response, std::current_exception());
+    return;
+  }
+
+  if (rstate.is_download && spec.download_segment < 0) {
+    // the rest of the download is fetched before the callback learns of it
+    std::shared_ptr<PartialDownload> download = rstate.download;
+    fetch_segments(spec, download,
+      [this, request, download](std::exception_ptr error) {
+        // committing reads back and hashes whatever arrived out of order,
+        // which for a large file would hold up every other transfer of the
+        // engine thread this runs on
+        run_off_engine([request, download, error]() mutable {
+          if (!error) {
+            try {
+              download->commit();
+            } catch (...) {
+              error = std::current_exception();
+            }
+          }
+          request->callback(request->response, error);
+        });
+      });
+    return;
+  }
+  request->callback(request->response, nullptr);
+}
+
+/* runs work on a thread of its own, for what would otherwise block the
+ * transport's thread and with it every other transfer.
+ */
+void RawClient::run_off_engine(std::function<void()> work) {
+  std::lock_guard<std::mutex> guard(worker_mutex);
+  // the threads that are done by now only need joining
+  for (auto it = workers.begin(); it != workers.end(); ) {
+    if (it->done) {
+      it->thread.join();
+      it = workers.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  workers.emplace_back();
+  worker *w = &workers.back();
+  w->done = false;
+  w->thread = std::thread([this, w, work]() {
+    work();
+    std::lock_guard<std::mutex> guard(worker_mutex);
+    w->done = true;
+  });
+}
+
+// waits for every worker, including those started meanwhile
+void RawClient::join_workers() {
+  while (true) {
+    std::list<worker> running;
+    {
+      std::lock_guard<std::mutex> guard(worker_mutex);
+      if (workers.empty()) return;
+      running.swap(workers);
+    }
+    for (auto &w : running) w.thread.join();
+  }
+}
+
+/* Segmented downloads */
+
+// the remaining segments of a download, fetched by a few requests at a time
+struct RawClient::segment_fetch {
+  request_spec spec;
+  std::shared_ptr<PartialDownload> download;
+  std::function<void(std::exception_ptr error)> done;
+
+  std::mutex mutex;
+  std::size_t running; // requests fetching a segment, or about to
+  std::exception_ptr error;
+};
+
+/* fetches whatever segments of the download are still missing once the
+ * first request in spec got its response, then moves the file into place.
+ */
+void RawClient::finish_download(RawClient::request_spec &spec,
+  std::shared_ptr<PartialDownload> download)
+{
+  std::promise<void> fetched;
+  fetch_segments(spec, download, [&fetched](std::exception_ptr error) {
+    if (error) {
+      fetched.set_exception(error);
+    } else {
+      fetched.set_value();
+    }
+  });
+  fetched.get_future().get();
+  download->commit();
+}
+
+/* fetches the missing segments of download with asynchronous requests like
+ * the one in spec, at most max_streams at once, and calls done when they are
+ * over, with the first failure if any. Right away if nothing is missing.
+ */
+void RawClient::fetch_segments(const RawClient::request_spec &spec,
+  std::shared_ptr<PartialDownload> download,
+  std::function<void(std::exception_ptr error)> done)
+{
+  std::shared_ptr<segment_fetch> fetch(new segment_fetch());
+  fetch->spec = spec;
+  fetch->spec.download = download;
+  fetch->download = download;
+  fetch->done = done;
+  std::size_t streams = download->get_max_streams();
+  fetch->running = streams;
+  for (std::size_t i = 0; i < streams; i++) {
+    fetch_next_segment(fetch);
+  }
+}
+
+// one of the streams of fetch: fetches segments until none is left to fetch
+void RawClient::fetch_next_segment(std::shared_ptr<RawClient::segment_fetch> fetch) {
+  int segment = -1;
+  {
+    std::lock_guard<std::mutex> guard(fetch->mutex);
+    if (!fetch->error) segment = fetch->download->claim_segment();
+    if (segment < 0 && --fetch->running > 0) return;
+  }
+  if (segment < 0) {
+    fetch->done(fetch->error);
+    return;
+  }
+
+  request_spec spec = fetch->spec;
+  spec.download_segment = segment;
+  std::shared_ptr<async_request> request(new async_request(spec,
+    [this, fetch, segment](rapidjson::Document &, std::exception_ptr error) {
+      // e.g. an error response instead of the range
+      if (!fetch->download->release_segment(segment) && !error) {
+        error = std::make_exception_ptr(
+          InvalidResponseException("Range request ended early"));
+      }
+      if (error) {
+        std::lock_guard<std::mutex> guard(fetch->mutex);
+        if (!fetch->error) fetch->error = error;
+      }
+      fetch_next_segment(fetch);
+    }));
+  perform_async(request);
+}
+
 /* Authorization (device-flow) & Authentication */
 
 void RawClient::device_flow_init(std::string &user_code, std::string &verification_uri) {
-  RawClient::path_segments path;
-  init_device_flow_init_path(path);
+  RawClient::request_spec spec;
+  init_device_flow_init_path(spec.path);
+  spec.refresh = false;
 
   // make a local copy and start building params
-  RawClient::param_list params;
-  params.emplace_back("client_id", client_id);
+  spec.params.emplace_back("client_id", client_id);
 
   rapidjson::Document response;
-  make_request(response, path, params, GET, false);
+  make_request(response, spec);
 
   device_flow_device_code = get_string_force(response, "device_code");
   user_code = get_string_force(response, "user_code");
@@ -326,12 +939,12 @@ int RawClient::device_flow_authorize(size_t timeout) {
     return -1;
   }
 
-  RawClient::path_segments path;
-  init_device_flow_authorize_path(path);
+  RawClient::request_spec spec;
+  init_device_flow_authorize_path(spec.path);
+  spec.refresh = false;
 
-  RawClient::param_list params;
-  params.emplace_back("client_id", client_id);
-  params.emplace_back("device_code", device_flow_device_code);
+  spec.params.emplace_back("client_id", client_id);
+  spec.params.emplace_back("device_code", device_flow_device_code);
 
   rapidjson::Document response;
 
@@ -341,7 +954,7 @@ int RawClient::device_flow_authorize(size_t timeout) {
   // find out end time
 
   while (t_now < t_end) {
-    make_request(response, path, params, GET, false);
+    make_request(response, spec);
     if (response.HasMember("code")) {
       // success!
       std::string code = response["code"].GetString();
@@ -371,10 +984,14 @@ int RawClient::device_flow_authorize(size_t timeout) {
 bool RawClient::save_tokens_from_response(rapidjson::Document &response) {
   if (response.HasMember("access_token") && response.HasMember("refresh_token")) {
     // looks good
-    access_token = response["access_token"].GetString();
-    refresh_token = response["refresh_token"].GetString();
+    std::string at = response["access_token"].GetString();
+    std::string rt = response["refresh_token"].GetString();
+    // counted from now rather than created_at, which is the server's clock
+    int expires_in = get_int(response, "expires_in", 0);
+    std::time_t expires_at = (expires_in > 0) ? std::time(nullptr) + expires_in : 0;
+    set_tokens(at, rt, expires_at);
     if (new_tokens_callback) {
-      new_tokens_callback(access_token, refresh_token);
+      new_tokens_callback(at, rt, expires_at);
     }
     return true;
   }
@@ -382,38 +999,187 @@ bool RawClient::save_tokens_from_response(rapidjson::Document &response) {
 }
 
 bool RawClient::get_token_from_authorization_code(std::string authorization_code) {
-  RawClient::path_segments path;
-  init_oauth_token_path(path);
+  RawClient::request_spec spec;
+  init_oauth_token_path(spec.path);
+  spec.method = POST;
+  spec.refresh = false;
 
-  RawClient::param_list params;
-  params.emplace_back("grant_type", "authorization_code");
-  params.emplace_back("client_id", client_id);
-  params.emplace_back("client_secret", client_secret);
-  params.emplace_back("redirect_uri", redirect_uri);
-  params.emplace_back("code", authorization_code);
+  spec.params.emplace_back("grant_type", "authorization_code");
+  spec.params.emplace_back("client_id", client_id);
+  spec.params.emplace_back("client_secret", client_secret);
+  spec.params.emplace_back("redirect_uri", redirect_uri);
+  spec.params.emplace_back("code", authorization_code);
 
   rapidjson::Document response;
-  make_request(response, path, params, POST, false);
+  make_request(response, spec);
 
   return save_tokens_from_response(response);
 }
 
 bool RawClient::perform_token_refresh() {
-  RawClient::path_segments path;
-  init_oauth_token_path(path);
+  RawClient::request_spec spec;
+  init_oauth_token_path(spec.path);
+  spec.method = POST;
+  spec.refresh = false;
 
-  RawClient::param_list params;
-  params.emplace_back("grant_type", "refresh_token");
-  params.emplace_back("client_id", client_id);
-  params.emplace_back("client_secret", client_secret);
-  params.emplace_back("refresh_token", refresh_token);
+  spec.params.emplace_back("grant_type", "refresh_token");
+  spec.params.emplace_back("client_id", client_id);
+  spec.params.emplace_back("client_secret", client_secret);
+  spec.params.emplace_back("refresh_token", get_refresh_token());
 
   rapidjson::Document response;
-  make_request(response, path, params, POST, false);
+  make_request(response, spec);
 
   return save_tokens_from_response(response);
 }
 
+/* called by a request that was rejected with the access token of
+ * failed_generation. Refreshes the tokens, unless that already happened
+ * since or another request is doing it, in which case it waits for the
+ * outcome. Returns whether there are newer tokens to retry with.
+ */
+bool RawClient::refresh_tokens(unsigned long failed_generation) {
+  std::unique_lock<std::mutex> lock(token_mutex);
+  if (token_generation != failed_generation) return true;
+  if (refresh_in_progress) {
+    tokens_changed.wait(lock, [this] { return !refresh_in_progress; });
+    if (token_generation != failed_generation) return true;
+    // the waiters fail the way the refresh did
+    if (refresh_error) std::rethrow_exception(refresh_error);
+    return false;
+  }
+
+  refresh_in_progress = true;
+  refresh_error = nullptr;
+  lock.unlock();
+  bool refreshed = false;
+  try {
+    refreshed = perform_shared_token_refresh();
+  } catch (...) {
+    lock.lock();
+    refresh_in_progress = false;
+    refresh_error = std::current_exception();
+    lock.unlock();
+    tokens_changed.notify_all();
+    throw;
+  }
+  lock.lock();
+  refresh_in_progress = false;
+  lock.unlock();
+  tokens_changed.notify_all();
+  return refreshed;
+}
+
+// refreshes the tokens while holding the token lock of other processes, if
+// any. Takes the stored tokens instead if another process refreshed them.
+// Without the lock, another process is most likely refreshing with the same
+// refresh token right now, so refreshing as well would get one of them
+// revoked; its stored tokens are the only way out then.
+bool RawClient::perform_shared_token_refresh() {
+  if (!token_lock_callback) return perform_token_refresh();
+
+  std::string at, rt;
+  std::time_t expires_at = 0;
+  bool locked = token_lock_callback(at, rt, expires_at);
+  bool replaced = false;
+  {
+    std::lock_guard<std::mutex> guard(token_mutex);
+    if (!at.empty() && at != access_token) {
+      access_token = at;
+      refresh_token = rt;
+      token_expires_at = expires_at;
+      token_generation++;
+      replaced = true;
+    }
+  }
+  if (replaced) {
+    LogDebug("Using tokens refreshed by another process" << Logger::endl);
+    if (locked) token_unlock_callback();
+    return true;
+  }
+  if (!locked) {
+    LogDebug("Could not take the token lock, not refreshing" << Logger::endl);
+    throw TokenLockException();
+  }
+
+  bool refreshed;
+  try {
+    refreshed = perform_token_refresh();
+  } catch (...) {
+    token_unlock_callback();
+    throw;
+  }
+  token_unlock_callback();
+  return refreshed;
+}
+
+// whether the access token expires soon. Must be called with the token
+// mutex held.
+bool RawClient::token_expiring() {
+  if (token_expires_at == 0 || refresh_token.empty()) return false;
+  auto expiry = std::chrono::system_clock::from_time_t(token_expires_at);
+  return std::chrono::system_clock::now() + token_refresh_margin >= expiry;
+}
+
+// refreshes the tokens ahead of time if the access token expires soon, so
+// that requests are not rejected and sent again
+void RawClient::refresh_if_expiring() {
+  unsigned long generation;
+  {
+    std::lock_guard<std::mutex> guard(token_mutex);
+    if (!token_expiring()) return;
+    generation = token_generation;
+  }
+
+  bool refreshed = false;
+  try {
+    refreshed = refresh_tokens(generation);
+  } catch (...) {
+    LogDebug("Proactive token refresh failed" << Logger::endl);
+  }
+  if (!refreshed) {
+    // leave it to the requests to find out, rather than trying every time
+    std::lock_guard<std::mutex> guard(token_mutex);
+    if (token_generation == generation) token_expires_at = 0;
+  }
+}
+
+void RawClient::set_background_token_refresh(bool enabled) {
+  if (enabled) {
+    if (refresh_thread.joinable()) return;
+    refresh_thread_stopping = false;
+    refresh_thread = std::thread(&RawClient::run_background_refresh, this);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(token_mutex);
+    refresh_thread_stopping = true;
+  }
+  tokens_changed.notify_all();
+  if (refresh_thread.joinable()) refresh_thread.join();
+}
+
+// sleeps until the access token is about to expire, then refreshes it
+void RawClient::run_background_refresh() {
+  std::unique_lock<std::mutex> lock(token_mutex);
+  while (!refresh_thread_stopping) {
+    if (token_expires_at == 0 || refresh_token.empty()) {
+      tokens_changed.wait(lock);
+      continue;
+    }
+    auto due = std::chrono::system_clock::from_time_t(token_expires_at) -
+      token_refresh_margin;
+    if (std::chrono::system_clock::now() < due) {
+      tokens_changed.wait_until(lock, due);
+      continue;
+    }
+    lock.unlock();
+    refresh_if_expiring();
+    lock.lock();
+  }
+}
+
 /* REST Interface wrappers */
 void RawClient::init_regular_path(RawClient::path_segments &path) {
   path.clear();
@@ -423,7 +1189,7 @@ void RawClient::init_regular_path(RawClient::path_segments &path) {
 
 void RawClient::init_regular_params(RawClient::param_list &params) {
   params.clear();
-  params.emplace_back("access_token", access_token);
+  params.emplace_back("access_token", get_access_token());
 }
 
 // common paths
@@ -445,7 +1211,13 @@ void RawClient::init_device_flow_authorize_path(RawClient::path_segments &path)
   path.emplace_back("device_flow_authorize");
 }
 
-void RawClient::update_access_token_in_params(RawClient::param_list &params) {
+// puts the current access token into params (if they carry one), and tells
+// which generation of the tokens it is
+void RawClient::update_access_token_in_params(RawClient::param_list &params,
+  unsigned long &generation)
+{
+  std::lock_guard<std::mutex> guard(token_mutex);
+  generation = token_generation;
   for (auto &param : params) {
     if (param.key == "access_token") {
       param.value = access_token;
@@ -473,180 +1245,314 @@ RawClient::HttpMethod RawClient::crud_to_http(CrudAction action) {
   return method;
 }
 
-void RawClient::get_user_info(rapidjson::Document &result) {
-  RawClient::path_segments path;
-  init_regular_path(path);
-  path.emplace_back("user");
+/* request builders */
+void RawClient::init_user_info_request(RawClient::request_spec &spec) {
+  init_regular_path(spec.path);
+  spec.path.emplace_back("user");
 
-  RawClient::param_list params;
-  init_regular_params(params);
+  init_regular_params(spec.params);
+}
+
+void RawClient::init_courses_request(RawClient::request_spec &spec) {
+  init_regular_path(spec.path);
+  spec.path.emplace_back("courses");
 
-  make_request(result, path, params);
+  init_regular_params(spec.params);
+  spec.params.emplace_back("state", "current");
 }
 
-void RawClient::get_courses(rapidjson::Document &result) {
-  RawClient::path_segments path;
-  init_regular_path(path);
-  path.emplace_back("courses");
+void RawClient::init_assessments_request(RawClient::request_spec &spec, const std::string &course_name) {
+  init_regular_path(spec.path);
+  spec.path.emplace_back("courses");
+  spec.path.emplace_back(course_name);
+  spec.path.emplace_back("assessments");
+
+  init_regular_params(spec.params);
+}
 
-  RawClient::param_list params;
-  init_regular_params(params);
-  params.emplace_back("state", "current");
+void RawClient::init_assessment_details_request(RawClient::request_spec &spec, const std::string &course_name, const std::string &asmt_name) {
+  init_regular_path(spec.path);
+  spec.path.emplace_back("courses");
+  spec.path.emplace_back(course_name);
+  spec.path.emplace_back("assessments");
+  spec.path.emplace_back(asmt_name);
 
-  make_request(result, path, params);
+  init_regular_params(spec.params);
 }
 
-void RawClient::get_assessments(rapidjson::Document &result, const std::string &course_name) {
-  RawClient::path_segments path;
-  init_regular_path(path);
-  path.emplace_back("courses");
-  path.emplace_back(course_name);
-  path.emplace_back("assessments");
+void RawClient::init_problems_request(RawClient::request_spec &spec, const std::string &course_name, const std::string &asmt_name) {
+  init_assessment_details_request(spec, course_name, asmt_name);
+  spec.path.emplace_back("problems");
+}
 
-  RawClient::param_list params;
-  init_regular_params(params);
+// attachment is either "handout" or "writeup"
+void RawClient::init_attachment_request(RawClient::request_spec &spec, const std::string &attachment, std::string download_dir, const std::string &course_name, const std::string &asmt_name) {
+  init_assessment_details_request(spec, course_name, asmt_name);
+  spec.path.emplace_back(attachment);
 
-  make_request(result, path, params);
+  spec.download_dir = download_dir;
+  spec.suggested_filename = attachment;
 }
 
-void RawClient::get_assessment_details(rapidjson::Document &result, const std::string &course_name, const std::string &asmt_name) {
-  RawClient::path_segments path;
-  init_regular_path(path);
-  path.emplace_back("courses");
-  path.emplace_back(course_name);
-  path.emplace_back("assessments");
-  path.emplace_back(asmt_name);
+void RawClient::init_submissions_request(RawClient::request_spec &spec, const std::string &course_name, const std::string &asmt_name) {
+  init_assessment_details_request(spec, course_name, asmt_name);
+  spec.path.emplace_back("submissions");
+}
 
-  RawClient::param_list params;
-  init_regular_params(params);
+void RawClient::init_feedback_request(RawClient::request_spec &spec, const std::string &course_name, const std::string &asmt_name, int sub_version, const std::string &problem_name) {
+  init_submissions_request(spec, course_name, asmt_name);
+  spec.path.emplace_back(std::to_string(sub_version));
+  spec.path.emplace_back("feedback");
 
-  make_request(result, path, params);
+  spec.params.emplace_back("problem", problem_name);
 }
 
-void RawClient::get_problems(rapidjson::Document &result, const std::string &course_name, const std::string &asmt_name) {
-  RawClient::path_segments path;
-  init_regular_path(path);
-  path.emplace_back("courses");
-  path.emplace_back(course_name);
-  path.emplace_back("assessments");
-  path.emplace_back(asmt_name);
-  path.emplace_back("problems");
+void RawClient::init_enrollments_request(RawClient::request_spec &spec, const std::string &course_name) {
+  init_regular_path(spec.path);
+  spec.path.emplace_back("courses");
+  spec.path.emplace_back(course_name);
+  spec.path.emplace_back("course_user_data");
 
-  RawClient::param_list params;
-  init_regular_params(params);
+  init_regular_params(spec.params);
+}
+
+void RawClient::init_crud_enrollment_request(RawClient::request_spec &spec, const std::string &course_name, std::string email, RawClient::Params &in_params, CrudAction action) {
+  init_enrollments_request(spec, course_name);
+  if (action != Create) spec.path.emplace_back(email);
 
-  make_request(result, path, params);
+  for (auto &kv : in_params) {
+    spec.params.emplace_back(kv.first, kv.second);
+  }
+  if (action == Create) spec.params.emplace_back("email", email);
+
+  spec.method = crud_to_http(action);
 }
 
-void RawClient::download_handout(rapidjson::Document &result, std::string download_dir, const std::string &course_name, const std::string &asmt_name) {
-  RawClient::path_segments path;
-  init_regular_path(path);
-  path.emplace_back("courses");
-  path.emplace_back(course_name);
-  path.emplace_back("assessments");
-  path.emplace_back(asmt_name);
-  path.emplace_back("handout");
+/* synchronous interface */
+void RawClient::get_user_info(rapidjson::Document &result) {
+  RawClient::request_spec spec;
+  init_user_info_request(spec);
+  make_request(result, spec);
+}
 
-  RawClient::param_list params;
-  init_regular_params(params);
+void RawClient::get_courses(rapidjson::Document &result) {
+  RawClient::request_spec spec;
+  init_courses_request(spec);
+  make_request(result, spec);
+}
 
-  make_request(result, path, params, GET, true, download_dir, "handout");
+void RawClient::get_assessments(rapidjson::Document &result, const std::string &course_name) {
+  RawClient::request_spec spec;
+  init_assessments_request(spec, course_name);
+  make_request(result, spec);
 }
 
-void RawClient::download_writeup(rapidjson::Document &result, std::string download_dir, const std::string &course_name, const std::string &asmt_name) {
-  RawClient::path_segments path;
-  init_regular_path(path);
-  path.emplace_back("courses");
-  path.emplace_back(course_name);
-  path.emplace_back("assessments");
-  path.emplace_back(asmt_name);
-  path.emplace_back("writeup");
+void RawClient::get_assessment_details(rapidjson::Document &result, const std::string &course_name, const std::string &asmt_name) {
+  RawClient::request_spec spec;
+  init_assessment_details_request(spec, course_name, asmt_name);
+  make_request(result, spec);
+}
 
-  RawClient::param_list params;
-  init_regular_params(params);
+void RawClient::get_problems(rapidjson::Document &result, const std::string &course_name, const std::string &asmt_name) {
+  RawClient::request_spec spec;
+  init_problems_request(spec, course_name, asmt_name);
+  make_request(result, spec);
+}
 
-  make_request(result, path, params, GET, true, download_dir, "writeup");
+void RawClient::download_handout(rapidjson::Document &result, std::string download_dir, const std::string &course_name, const std::string &asmt_name) {
+  RawClient::request_spec spec;
+  init_attachment_request(spec, "handout", download_dir, course_name, asmt_name);
+  make_request(result, spec);
+}
+
+void RawClient::download_writeup(rapidjson::Document &result, std::string download_dir, const std::string &course_name, const std::string &asmt_name) {
+  RawClient::request_spec spec;
+  init_attachment_request(spec, "writeup", download_dir, course_name, asmt_name);
+  make_request(result, spec);
 }
 
 void RawClient::submit_assessment(rapidjson::Document &result, const std::string &course_name, const std::string &asmt_name, std::string filename) {
-  RawClient::path_segments path;
-  init_regular_path(path);
-  path.emplace_back("courses");
-  path.emplace_back(course_name);
-  path.emplace_back("assessments");
-  path.emplace_back(asmt_name);
-  path.emplace_back("submit");
+  RawClient::request_spec spec;
+  init_assessment_details_request(spec, course_name, asmt_name);
+  spec.path.emplace_back("submit");
+  spec.method = POST;
+  spec.upload_filename = filename;
+
+  make_request(result, spec);
+}
 
-  RawClient::param_list params;
-  init_regular_params(params);
+void RawClient::submit_assessment(rapidjson::Document &result, const std::string &course_name, const std::string &asmt_name, std::string filename, const char *data, std::size_t length) {
+  RawClient::request_spec spec;
+  init_assessment_details_request(spec, course_name, asmt_name);
+  spec.path.emplace_back("submit");
+  spec.method = POST;
+  spec.upload_filename = filename;
+  spec.upload_data = data;
+  spec.upload_length = length;
 
-  make_request(result, path, params, POST, true, "", "", filename);
+  make_request(result, spec);
 }
 
-void RawClient::get_submissions(rapidjson::Document &result, const std::string &course_name, const std::string &asmt_name) {
-  RawClient::path_segments path;
-  init_regular_path(path);
-  path.emplace_back("courses");
-  path.emplace_back(course_name);
-  path.emplace_back("assessments");
-  path.emplace_back(asmt_name);
-  path.emplace_back("submissions");
+void RawClient::submit_assessment(rapidjson::Document &result, const std::string &course_name, const std::string &asmt_name, std::string filename, UploadStream &stream) {
+  RawClient::request_spec spec;
+  init_assessment_details_request(spec, course_name, asmt_name);
+  spec.path.emplace_back("submit");
+  spec.method = POST;
+  spec.upload_filename = filename;
+  spec.upload_stream = &stream;
 
-  RawClient::param_list params;
-  init_regular_params(params);
+  make_request(result, spec);
+}
 
-  make_request(result, path, params);
+void RawClient::get_submissions(rapidjson::Document &result, const std::string &course_name, const std::string &asmt_name) {
+  RawClient::request_spec spec;
+  init_submissions_request(spec, course_name, asmt_name);
+  make_request(result, spec);
 }
 
 void RawClient::get_feedback(rapidjson::Document &result, const std::string &course_name, const std::string &asmt_name, int sub_version, const std::string &problem_name) {
-  RawClient::path_segments path;
-  init_regular_path(path);
-  path.emplace_back("courses");
-  path.emplace_back(course_name);
-  path.emplace_back("assessments");
-  path.emplace_back(asmt_name);
-  path.emplace_back("submissions");
-  path.emplace_back(std::to_string(sub_version));
-  path.emplace_back("feedback");
+  RawClient::request_spec spec;
+  init_feedback_request(spec, course_name, asmt_name, sub_version, problem_name);
+  make_request(result, spec);
+}
 
-  RawClient::param_list params;
-  init_regular_params(params);
-  params.emplace_back("problem", problem_name);
+void RawClient::get_enrollments(rapidjson::Document &result, const std::string &course_name) {
+  RawClient::request_spec spec;
+  init_enrollments_request(spec, course_name);
+  make_request(result, spec);
+}
 
-  make_request(result, path, params);
+void RawClient::crud_enrollment(rapidjson::Document &result, const std::string &course_name, std::string email, RawClient::Params &in_params, CrudAction action) {
+  RawClient::request_spec spec;
+  init_crud_enrollment_request(spec, course_name, email, in_params, action);
+  make_request(result, spec);
 }
 
-void RawClient::get_enrollments(rapidjson::Document &result, const std::string &course_name) {
-  RawClient::path_segments path;
-  init_regular_path(path);
-  path.emplace_back("courses");
-  path.emplace_back(course_name);
-  path.emplace_back("course_user_data");
+/* streaming interface */
+void RawClient::get_courses(RawClient::ResponseHandler &handler) {
+  RawClient::request_spec spec;
+  init_courses_request(spec);
+  spec.handler = &handler;
+  rapidjson::Document unused;
+  make_request(unused, spec);
+}
 
-  RawClient::param_list params;
-  init_regular_params(params);
+void RawClient::get_assessments(RawClient::ResponseHandler &handler, const std::string &course_name) {
+  RawClient::request_spec spec;
+  init_assessments_request(spec, course_name);
+  spec.handler = &handler;
+  rapidjson::Document unused;
+  make_request(unused, spec);
+}
 
-  make_request(result, path, params);
+void RawClient::get_problems(RawClient::ResponseHandler &handler, const std::string &course_name, const std::string &asmt_name) {
+  RawClient::request_spec spec;
+  init_problems_request(spec, course_name, asmt_name);
+  spec.handler = &handler;
+  rapidjson::Document unused;
+  make_request(unused, spec);
 }
 
-void RawClient::crud_enrollment(rapidjson::Document &result, const std::string &course_name, std::string email, RawClient::Params &in_params, CrudAction action) {
-  RawClient::path_segments path;
-  init_regular_path(path);
-  path.emplace_back("courses");
-  path.emplace_back(course_name);
-  path.emplace_back("course_user_data");
-  if (action != Create) path.emplace_back(email);
-
-  RawClient::param_list params;
-  init_regular_params(params);
-  for (auto &kv : in_params) {
-    params.emplace_back(kv.first, kv.second);
+void RawClient::get_submissions(RawClient::ResponseHandler &handler, const std::string &course_name, const std::string &asmt_name) {
+  RawClient::request_spec spec;
+  init_submissions_request(spec, course_name, asmt_name);
+  spec.handler = &handler;
+  rapidjson::Document unused;
+  make_request(unused, spec);
+}
+
+void RawClient::get_enrollments(RawClient::ResponseHandler &handler, const std::string &course_name) {
+  RawClient::request_spec spec;
+  init_enrollments_request(spec, course_name);
+  spec.handler = &handler;
+  rapidjson::Document unused;
+  make_request(unused, spec);
+}
+
+bool RawClient::poll_submissions(RawClient::ResponseHandler &handler, const std::string &course_name, const std::string &asmt_name, std::string &etag, std::chrono::seconds wait) {
+  RawClient::request_spec spec;
+  init_submissions_request(spec, course_name, asmt_name);
+  spec.handler = &handler;
+  if (etag.length() > 0) spec.headers.push_back("If-None-Match: " + etag);
+  if (wait.count() > 0) {
+    spec.headers.push_back("Prefer: wait=" + std::to_string(wait.count()));
   }
-  if (action == Create) params.emplace_back("email", email);
+  rapidjson::Document unused;
+  if (make_request(unused, spec) == 304) return false;
+  etag = spec.etag;
+  return true;
+}
+
+/* asynchronous interface */
+void RawClient::get_user_info_async(RawClient::ResponseCallback callback) {
+  RawClient::request_spec spec;
+  init_user_info_request(spec);
+  make_request_async(spec, callback);
+}
+
+void RawClient::get_courses_async(RawClient::ResponseCallback callback, RawClient::ResponseHandler *handler) {
+  RawClient::request_spec spec;
+  init_courses_request(spec);
+  spec.handler = handler;
+  make_request_async(spec, callback);
+}
+
+void RawClient::get_assessments_async(RawClient::ResponseCallback callback, const std::string &course_name, RawClient::ResponseHandler *handler) {
+  RawClient::request_spec spec;
+  init_assessments_request(spec, course_name);
+  spec.handler = handler;
+  make_request_async(spec, callback);
+}
+
+void RawClient::get_assessment_details_async(RawClient::ResponseCallback callback, const std::string &course_name, const std::string &asmt_name) {
+  RawClient::request_spec spec;
+  init_assessment_details_request(spec, course_name, asmt_name);
+  make_request_async(spec, callback);
+}
+
+void RawClient::get_problems_async(RawClient::ResponseCallback callback, const std::string &course_name, const std::string &asmt_name, RawClient::ResponseHandler *handler) {
+  RawClient::request_spec spec;
+  init_problems_request(spec, course_name, asmt_name);
+  spec.handler = handler;
+  make_request_async(spec, callback);
+}
 
-  HttpMethod method = crud_to_http(action);
+void RawClient::download_handout_async(RawClient::ResponseCallback callback, std::string download_dir, const std::string &course_name, const std::string &asmt_name) {
+  RawClient::request_spec spec;
+  init_attachment_request(spec, "handout", download_dir, course_name, asmt_name);
+  make_request_async(spec, callback);
+}
+
+void RawClient::download_writeup_async(RawClient::ResponseCallback callback, std::string download_dir, const std::string &course_name, const std::string &asmt_name) {
+  RawClient::request_spec spec;
+  init_attachment_request(spec, "writeup", download_dir, course_name, asmt_name);
+  make_request_async(spec, callback);
+}
+
+void RawClient::get_submissions_async(RawClient::ResponseCallback callback, const std::string &course_name, const std::string &asmt_name, RawClient::ResponseHandler *handler) {
+  RawClient::request_spec spec;
+  init_submissions_request(spec, course_name, asmt_name);
+  spec.handler = handler;
+  make_request_async(spec, callback);
+}
+
+void RawClient::get_feedback_async(RawClient::ResponseCallback callback, const std::string &course_name, const std::string &asmt_name, int sub_version, const std::string &problem_name) {
+  RawClient::request_spec spec;
+  init_feedback_request(spec, course_name, asmt_name, sub_version, problem_name);
+  make_request_async(spec, callback);
+}
+
+void RawClient::get_enrollments_async(RawClient::ResponseCallback callback, const std::string &course_name, RawClient::ResponseHandler *handler) {
+  RawClient::request_spec spec;
+  init_enrollments_request(spec, course_name);
+  spec.handler = handler;
+  make_request_async(spec, callback);
+}
 
-  make_request(result, path, params, method);
+void RawClient::crud_enrollment_async(RawClient::ResponseCallback callback, const std::string &course_name, std::string email, RawClient::Params &in_params, CrudAction action) {
+  RawClient::request_spec spec;
+  init_crud_enrollment_request(spec, course_name, email, in_params, action);
+  make_request_async(spec, callback);
 }
 
 } /* namespace Autolab */
\ No newline at end of file
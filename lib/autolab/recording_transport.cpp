@@ -0,0 +1,245 @@
+#include "recording_transport.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <strings.h> // strncasecmp
+#include <sys/stat.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <fstream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "autolab/autolab.h"
+#include "logger.h"
+
+namespace Autolab {
+
+const std::string exchange_extension = ".exchange";
+
+// headers that are not recorded, either because replay adds its own or
+// because they carry credentials
+const char *const unrecorded_headers[] = {
+  "Content-Length:", "Transfer-Encoding:",
+  "Set-Cookie:", "Set-Cookie2:", "Cookie:",
+  "Authorization:", "Proxy-Authorization:"
+};
+
+bool is_recorded_header(const std::string &line) {
+  for (const char *name : unrecorded_headers) {
+    if (strncasecmp(line.c_str(), name, std::strlen(name)) == 0) return false;
+  }
+  return true;
+}
+
+// tees the response into an exchange on its way to the real sink
+class RecordingTransport::recording : public ResponseSink {
+public:
+  ResponseSink *sink;
+  RecordedExchange exchange;
+
+  explicit recording(ResponseSink &s) : sink(&s) {}
+
+  bool on_header(const char *data, std::size_t length) override {
+    std::string line(data, length);
+    line.erase(line.find_last_not_of("\r\n") + 1);
+    if (line.compare(0, 5, "HTTP/") == 0) {
+      // only the headers of the final response are kept
+      exchange.headers.clear();
+    } else if (!line.empty() && is_recorded_header(line)) {
+      exchange.headers.push_back(line);
+    }
+    return sink->on_header(data, length);
+  }
+
+  bool on_body(const char *data, std::size_t length) override {
+    exchange.body.append(data, length);
+    return sink->on_body(data, length);
+  }
+};
+
+// names of the exchange files in dir, sorted
+bool list_exchanges(const std::string &dir, std::vector<std::string> &names) {
+  DIR *handle = opendir(dir.c_str());
+  if (!handle) return false;
+
+  struct dirent *entry;
+  while ((entry = readdir(handle))) {
+    std::string name(entry->d_name);
+    if (name.size() > exchange_extension.size() &&
+        name.compare(name.size() - exchange_extension.size(),
+          exchange_extension.size(), exchange_extension) == 0) {
+      names.push_back(name);
+    }
+  }
+  closedir(handle);
+  std::sort(names.begin(), names.end());
+  return true;
+}
+
+RecordingTransport::RecordingTransport(std::shared_ptr<Transport> inner,
+  const std::string &dir) : inner(inner), dir(dir), next_number(1)
+{
+  if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    throw HttpException("Cannot create recording directory " + dir);
+  }
+  std::vector<std::string> names;
+  list_exchanges(dir, names);
+  if (!names.empty()) {
+    next_number = std::strtoul(names.back().c_str(), nullptr, 10) + 1;
+  }
+}
+
+RecordingTransport::~RecordingTransport() {
+  // the inner transport may still report aborted transfers to save
+  inner.reset();
+}
+
+std::string RecordingTransport::request_params(const HttpRequest &request) {
+  static const std::set<std::string> credentials = {"access_token",
+    "refresh_token", "client_id", "client_secret", "code", "device_code"};
+
+  std::string all = request.query;
+  if (request.body.length() > 0) {
+    all.append((all.empty() ? "" : "&") + request.body);
+  }
+
+  std::string result;
+  std::string::size_type start = 0;
+  while (start < all.size()) {
+    std::string::size_type end = all.find('&', start);
+    if (end == std::string::npos) end = all.size();
+    std::string param = all.substr(start, end - start);
+    if (credentials.count(param.substr(0, param.find('='))) == 0) {
+      if (!result.empty()) result.append("&");
+      result.append(param);
+    }
+    start = end + 1;
+  }
+  return result;
+}
+
+void RecordingTransport::save(RecordingTransport::recording &rec,
+  const HttpRequest &request, const TransferInfo &info, CURLcode res)
+{
+  // the client is shutting down, or the exchange carries credentials
+  if (res == CURLE_ABORTED_BY_CALLBACK) return;
+  if (request.path.compare(0, 7, "/oauth/") == 0) return;
+
+  std::size_t number;
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    number = next_number++;
+  }
+  char name[32];
+  std::snprintf(name, sizeof(name), "%06zu", number);
+  std::string filename = dir + "/" + name + exchange_extension;
+
+  std::ofstream out(filename, std::ofstream::binary | std::ofstream::trunc);
+  out << "method " << request.method << "\n"
+    << "path " << request.path << "\n"
+    << "params " << request_params(request) << "\n"
+    << "result " << static_cast<int>(res) << "\n"
+    << "status " << info.response_code << "\n"
+    << "version " << info.http_version << "\n"
+    << "ttfb " << info.ttfb_seconds << "\n"
+    << "total " << info.total_seconds << "\n";
+  for (auto &header : rec.exchange.headers) {
+    out << "header " << header << "\n";
+  }
+  out << "body " << rec.exchange.body.size() << "\n";
+  out.write(rec.exchange.body.data(), rec.exchange.body.size());
+
+  if (!out) {
+    LogDebug("[Recording] failed to write " << filename << Logger::endl);
+  }
+}
+
+CURLcode RecordingTransport::perform(const HttpRequest &request,
+  ResponseSink &sink, TransferInfo &info)
+{
+  recording rec(sink);
+  CURLcode res = inner->perform(request, rec, info);
+  save(rec, request, info, res);
+  return res;
+}
+
+void RecordingTransport::perform_async(const HttpRequest &request,
+  ResponseSink &sink, TransferInfo &info, Transport::DoneCallback done,
+  std::chrono::milliseconds delay)
+{
+  std::shared_ptr<recording> rec(new recording(sink));
+  const HttpRequest *req = &request;
+  TransferInfo *inf = &info;
+  inner->perform_async(request, *rec, info,
+    [this, rec, req, inf, done](CURLcode res) {
+      save(*rec, *req, *inf, res);
+      done(res);
+    }, delay);
+}
+
+void RecordingTransport::set_max_in_flight(std::size_t limit) {
+  inner->set_max_in_flight(limit);
+}
+
+bool read_exchange(std::istream &in, RecordedExchange &exchange) {
+  std::string line;
+  while (std::getline(in, line)) {
+    std::string::size_type space = line.find(' ');
+    std::string key = line.substr(0, space);
+    std::string value = (space == std::string::npos) ? "" : line.substr(space + 1);
+
+    if (key == "method") {
+      exchange.method = value;
+    } else if (key == "path") {
+      exchange.path = value;
+    } else if (key == "params") {
+      exchange.params = value;
+    } else if (key == "result") {
+      exchange.result = static_cast<CURLcode>(std::atoi(value.c_str()));
+    } else if (key == "status") {
+      exchange.info.response_code = std::atol(value.c_str());
+    } else if (key == "version") {
+      exchange.info.http_version = std::atol(value.c_str());
+    } else if (key == "ttfb") {
+      exchange.info.ttfb_seconds = std::atof(value.c_str());
+    } else if (key == "total") {
+      exchange.info.total_seconds = std::atof(value.c_str());
+    } else if (key == "header") {
+      exchange.headers.push_back(value);
+    } else if (key == "body") {
+      exchange.body.resize(std::strtoul(value.c_str(), nullptr, 10));
+      in.read(&exchange.body[0], exchange.body.size());
+      return static_cast<std::size_t>(in.gcount()) == exchange.body.size();
+    }
+  }
+  return false;
+}
+
+std::vector<RecordedExchange> RecordingTransport::read_recording(
+  const std::string &dir)
+{
+  std::vector<std::string> names;
+  if (!list_exchanges(dir, names)) {
+    throw HttpException("Cannot read recording from " + dir);
+  }
+
+  std::vector<RecordedExchange> exchanges;
+  for (auto &name : names) {
+    std::ifstream in(dir + "/" + name, std::ifstream::binary);
+    RecordedExchange exchange;
+    if (!read_exchange(in, exchange)) {
+      LogDebug("[Recording] skipping incomplete " << name << Logger::endl);
+      continue;
+    }
+    exchanges.push_back(exchange);
+  }
+  return exchanges;
+}
+
+} /* namespace Autolab */
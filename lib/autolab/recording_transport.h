@@ -0,0 +1,82 @@
+/*
+ * Recording of real traffic, to be replayed offline by MockServer.
+ *
+ * A RecordingTransport wraps another transport and writes every exchange it
+ * performs to a corpus directory, one file per exchange, numbered in the
+ * order the transfers ended. Credentials are never recorded: the
+ * access_token, client and code parameters are left out, cookie and
+ * authorization headers are dropped, and OAuth exchanges are skipped
+ * entirely. The body of an exchange is held in memory until it is written,
+ * downloads included, so recording is meant for test sessions.
+ *
+ * An exchange file starts with "key value" lines (method, path, params,
+ * result, status, version, ttfb, total and any number of header lines),
+ * ends them with "body <length>", and is followed by the raw body.
+ */
+
+#ifndef LIBAUTOLAB_RECORDING_TRANSPORT_H_
+#define LIBAUTOLAB_RECORDING_TRANSPORT_H_
+
+#include <cstddef>
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "autolab/transport.h"
+
+namespace Autolab {
+
+// one recorded request and its response
+struct RecordedExchange {
+  std::string method;
+  std::string path;
+  std::string params; // without credentials, see request_params
+  CURLcode result;
+  TransferInfo info;
+  std::vector<std::string> headers; // of the final response, without "\r\n"
+  std::string body;
+
+  RecordedExchange() : result(CURLE_OK) {}
+};
+
+class RecordingTransport : public Transport {
+public:
+  // records the exchanges performed by inner into dir, which is created if
+  // needed. Numbering continues after the exchanges already in dir.
+  RecordingTransport(std::shared_ptr<Transport> inner, const std::string &dir);
+  ~RecordingTransport();
+
+  RecordingTransport(const RecordingTransport &) = delete;
+  RecordingTransport &operator=(const RecordingTransport &) = delete;
+
+  CURLcode perform(const HttpRequest &request, ResponseSink &sink,
+    TransferInfo &info) override;
+  void perform_async(const HttpRequest &request, ResponseSink &sink,
+    TransferInfo &info, DoneCallback done,
+    std::chrono::milliseconds delay) override;
+  void set_max_in_flight(std::size_t limit) override;
+
+  // the query and form parameters of request, without credentials
+  static std::string request_params(const HttpRequest &request);
+  // every exchange recorded in dir, in recording order. Throws HttpException
+  // if dir cannot be read.
+  static std::vector<RecordedExchange> read_recording(const std::string &dir);
+
+private:
+  class recording;
+
+  std::shared_ptr<Transport> inner;
+  std::string dir;
+  std::mutex mutex;
+  std::size_t next_number;
+
+  void save(recording &rec, const HttpRequest &request,
+    const TransferInfo &info, CURLcode res);
+};
+
+}
+
+#endif /* LIBAUTOLAB_RECORDING_TRANSPORT_H_ */
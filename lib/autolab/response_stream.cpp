@@ -0,0 +1,76 @@
+#include "response_stream.h"
+
+#include <rapidjson/reader.h>
+
+#include "logger.h"
+
+namespace Autolab {
+
+/* ChunkStream */
+
+void ChunkStream::push(const char *data, std::size_t length) {
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    chunks.emplace_back(data, length);
+  }
+  data_ready.notify_one();
+}
+
+void ChunkStream::close() {
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    closed = true;
+  }
+  data_ready.notify_one();
+}
+
+// called by the parser once the current chunk is used up
+ChunkStream::Ch ChunkStream::peek_next_chunk() {
+  std::unique_lock<std::mutex> lock(mutex);
+  data_ready.wait(lock, [this] { return !chunks.empty() || closed; });
+  if (chunks.empty()) return '\0';
+
+  consumed += current.length();
+  current.swap(chunks.front());
+  chunks.pop_front();
+  pos = 0;
+  return current.empty() ? '\0' : current[0];
+}
+
+/* StreamingParser */
+
+StreamingParser::StreamingParser(RawClient::ResponseHandler &handler)
+  : handler(handler), parse_ok(false)
+{
+  worker = std::thread(&StreamingParser::run, this);
+}
+
+StreamingParser::~StreamingParser() {
+  // an unfinished body is reported to the handler as a parse error
+  stream.close();
+  if (worker.joinable()) worker.join();
+}
+
+void StreamingParser::feed(const char *data, std::size_t length) {
+  stream.push(data, length);
+}
+
+bool StreamingParser::finish() {
+  stream.close();
+  if (worker.joinable()) worker.join();
+  return parse_ok;
+}
+
+void StreamingParser::run() {
+  try {
+    rapidjson::Reader reader;
+    parse_ok = !reader.Parse(stream, handler).IsError();
+  } catch (...) {
+    LogDebug("[StreamingParser] handler threw while parsing" << Logger::endl);
+    parse_ok = false;
+  }
+  // keep draining so that the producer never waits on a stopped parser
+  while (stream.Take() != '\0') {}
+}
+
+} /* namespace Autolab */
@@ -0,0 +1,93 @@
+/*
+ * Incremental parsing of response bodies.
+ *
+ * rapidjson's Reader pulls its input from a stream, while libcurl pushes the
+ * body to us in chunks. StreamingParser bridges the two: the write callback
+ * feeds chunks into a ChunkStream, and a parser thread runs the Reader over
+ * that stream, blocking whenever it catches up with the download. The
+ * response is therefore parsed while it is still arriving and never has to be
+ * held in memory as a whole.
+ */
+
+#ifndef LIBAUTOLAB_RESPONSE_STREAM_H_
+#define LIBAUTOLAB_RESPONSE_STREAM_H_
+
+#include <cstddef>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "autolab/raw_client.h"
+
+namespace Autolab {
+
+// rapidjson input stream over chunks handed in by another thread.
+class ChunkStream {
+public:
+  typedef char Ch;
+
+  ChunkStream() : pos(0), consumed(0), closed(false) {}
+
+  // producer side
+  void push(const char *data, std::size_t length);
+  void close();
+
+  // rapidjson stream concept. Returns '\0' at the end of input.
+  Ch Peek() {
+    if (pos < current.length()) return current[pos];
+    return peek_next_chunk();
+  }
+  Ch Take() {
+    Ch c = Peek();
+    if (pos < current.length()) pos++;
+    return c;
+  }
+  std::size_t Tell() const { return consumed + pos; }
+
+  // only needed for in-situ parsing, which is not supported
+  Ch *PutBegin() { return nullptr; }
+  void Put(Ch) {}
+  void Flush() {}
+  std::size_t PutEnd(Ch *) { return 0; }
+
+private:
+  std::mutex mutex;
+  std::condition_variable data_ready;
+  std::deque<std::string> chunks;
+  std::string current;
+  std::size_t pos;
+  std::size_t consumed;
+  bool closed;
+
+  Ch peek_next_chunk();
+};
+
+class StreamingParser {
+public:
+  explicit StreamingParser(RawClient::ResponseHandler &handler);
+  ~StreamingParser();
+
+  StreamingParser(const StreamingParser &) = delete;
+  StreamingParser &operator=(const StreamingParser &) = delete;
+
+  // hand the next chunk of the body to the parser thread
+  void feed(const char *data, std::size_t length);
+  // signal the end of the body and wait for the parser. Returns whether the
+  // body was a complete, well-formed json document.
+  bool finish();
+
+private:
+  ChunkStream stream;
+  RawClient::ResponseHandler &handler;
+  std::thread worker;
+  bool parse_ok;
+
+  void run();
+};
+
+}
+
+#endif /* LIBAUTOLAB_RESPONSE_STREAM_H_ */
@@ -0,0 +1,415 @@
+#include "sax_handlers.h"
+
+#include <climits>
+#include <cmath>
+
+#include "json_helpers.h"
+#include "logger.h"
+
+namespace Autolab {
+
+/* field readers, mirroring get_* and get_*_force in json_helpers.h */
+
+// keep the current (fallback) value of the field on a type mismatch
+void read_string(const json_scalar &value, std::string &field) {
+  if (value.kind == json_scalar::string_value) field.assign(value.str, value.length);
+}
+void read_int(const json_scalar &value, int &field) {
+  if (value.kind == json_scalar::int_value) field = value.int_val;
+}
+void read_double(const json_scalar &value, double &field) {
+  if (value.kind == json_scalar::double_value) field = value.double_val;
+}
+void read_bool(const json_scalar &value, bool &field) {
+  if (value.kind == json_scalar::bool_value) field = value.bool_val;
+}
+
+// throw on a type mismatch, and record that the field was present
+std::string read_string_force(const json_scalar &value, const std::string &key,
+    bool &present) {
+  if (value.kind != json_scalar::string_value) {
+    throw_unexpected_null_error(key, "string");
+  }
+  present = true;
+  return std::string(value.str, value.length);
+}
+int read_int_force(const json_scalar &value, const std::string &key,
+    bool &present) {
+  if (value.kind != json_scalar::int_value) {
+    throw_unexpected_null_error(key, "int");
+  }
+  present = true;
+  return value.int_val;
+}
+
+void require_present(bool present, const std::string &key) {
+  if (!present) throw_missing_key_error(key);
+}
+
+/* ObjectArrayHandler */
+
+ObjectArrayHandler::ObjectArrayHandler()
+  : top_level(top_none), depth(0), skip_depth(-1), has_error_response(false) {}
+
+void ObjectArrayHandler::check() {
+  if (error) std::rethrow_exception(error);
+}
+
+// handles a scalar value at the current position
+bool ObjectArrayHandler::value(const json_scalar &v) {
+  if (skipping() || error) return !error;
+  try {
+    switch (depth) {
+      case 0:
+        top_level = top_scalar;
+        break;
+      case 1:
+        if (top_level == top_array) {
+          throw InvalidResponseException("Expected json object not found");
+        }
+        if (key == "error") {
+          has_error_response = true;
+          read_string(v, error_response);
+        }
+        break;
+      case 2:
+        set_field(key, v);
+        break;
+      default:
+        set_nested_field(key, nested_key, v);
+        break;
+    }
+  } catch (...) {
+    error = std::current_exception();
+    return false;
+  }
+  return true;
+}
+
+bool ObjectArrayHandler::start_container(bool is_object) {
+  if (error) return false;
+  if (skipping()) {
+    depth++;
+    return true;
+  }
+  try {
+    json_scalar nested(json_scalar::other_value);
+    switch (depth) {
+      case 0:
+        top_level = is_object ? top_object : top_array;
+        break;
+      case 1:
+        if (top_level == top_array) {
+          if (!is_object) {
+            throw InvalidResponseException("Expected json object not found");
+          }
+          begin_object();
+        } else {
+          if (key == "error") has_error_response = true;
+          skip_container();
+        }
+        break;
+      case 2:
+        if (!is_object || !accepts_nested_object(key)) {
+          set_field(key, nested);
+          skip_container();
+        }
+        break;
+      default:
+        set_nested_field(key, nested_key, nested);
+        skip_container();
+        break;
+    }
+  } catch (...) {
+    error = std::current_exception();
+    return false;
+  }
+  depth++;
+  return true;
+}
+
+bool ObjectArrayHandler::end_container(bool is_object) {
+  if (error) return false;
+  depth--;
+  if (skipping()) {
+    if (skip_depth == depth) skip_depth = -1;
+    return true;
+  }
+  if (depth == 1 && is_object && top_level == top_array) {
+    try {
+      end_object();
+    } catch (...) {
+      error = std::current_exception();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ObjectArrayHandler::Null() {
+  return value(json_scalar(json_scalar::null_value));
+}
+
+bool ObjectArrayHandler::Bool(bool b) {
+  json_scalar v(json_scalar::bool_value);
+  v.bool_val = b;
+  return value(v);
+}
+
+bool ObjectArrayHandler::Int(int i) {
+  json_scalar v(json_scalar::int_value);
+  v.int_val = i;
+  return value(v);
+}
+
+bool ObjectArrayHandler::Uint(unsigned u) {
+  if (u > INT_MAX) return value(json_scalar(json_scalar::other_value));
+  json_scalar v(json_scalar::int_value);
+  v.int_val = static_cast<int>(u);
+  return value(v);
+}
+
+bool ObjectArrayHandler::Int64(int64_t) {
+  return value(json_scalar(json_scalar::other_value));
+}
+
+bool ObjectArrayHandler::Uint64(uint64_t) {
+  return value(json_scalar(json_scalar::other_value));
+}
+
+bool ObjectArrayHandler::Double(double d) {
+  json_scalar v(json_scalar::double_value);
+  v.double_val = d;
+  return value(v);
+}
+
+bool ObjectArrayHandler::RawNumber(const char *, rapidjson::SizeType, bool) {
+  return value(json_scalar(json_scalar::other_value));
+}
+
+bool ObjectArrayHandler::String(const char *str, rapidjson::SizeType length, bool) {
+  json_scalar v(json_scalar::string_value);
+  v.str = str;
+  v.length = length;
+  return value(v);
+}
+
+bool ObjectArrayHandler::StartObject() {
+  return start_container(true);
+}
+
+bool ObjectArrayHandler::Key(const char *str, rapidjson::SizeType length, bool) {
+  if (skipping()) return true;
+  if (depth <= 2) {
+    key.assign(str, length);
+  } else {
+    nested_key.assign(str, length);
+  }
+  return true;
+}
+
+bool ObjectArrayHandler::EndObject(rapidjson::SizeType) {
+  return end_container(true);
+}
+
+bool ObjectArrayHandler::StartArray() {
+  return start_container(false);
+}
+
+bool ObjectArrayHandler::EndArray(rapidjson::SizeType) {
+  return end_container(false);
+}
+
+// same checks, in the same order, as check_for_error_response followed by
+// require_is_array on a parsed document
+void ObjectArrayHandler::Finish(bool parsed) {
+  if (error) return;
+  if (parsed && top_level == top_object && has_error_response) {
+    LogDebug("API returned error: " << error_response << Logger::endl);
+    error = std::make_exception_ptr(ErrorResponseException(error_response));
+  } else if (!parsed || top_level != top_array) {
+    error = std::make_exception_ptr(
+      InvalidResponseException("Expected json array not found"));
+  }
+}
+
+/* CourseListHandler */
+
+void CourseListHandler::begin_object() {
+  course = Course();
+  course.late_slack = 0;
+  course.grace_days = 0;
+  course.auth_level = AuthorizationLevel::student;
+  has_name = has_auth_level = false;
+}
+
+void CourseListHandler::set_field(const std::string &key, const json_scalar &value) {
+  if (key == "name") {
+    course.name = read_string_force(value, key, has_name);
+  } else if (key == "display_name") {
+    read_string(value, course.display_name);
+  } else if (key == "semester") {
+    read_string(value, course.semester);
+  } else if (key == "late_slack") {
+    read_int(value, course.late_slack);
+  } else if (key == "grace_days") {
+    read_int(value, course.grace_days);
+  } else if (key == "auth_level") {
+    course.auth_level = Utility::string_to_authorization_level(
+      read_string_force(value, key, has_auth_level));
+  }
+}
+
+void CourseListHandler::end_object() {
+  require_present(has_name, "name");
+  require_present(has_auth_level, "auth_level");
+  courses.push_back(course);
+}
+
+/* AssessmentListHandler */
+
+void AssessmentListHandler::begin_object() {
+  asmt = Assessment();
+  has_name = has_start_at = has_due_at = has_end_at = false;
+}
+
+void AssessmentListHandler::set_field(const std::string &key, const json_scalar &value) {
+  if (key == "name") {
+    asmt.name = read_string_force(value, key, has_name);
+  } else if (key == "display_name") {
+    read_string(value, asmt.display_name);
+  } else if (key == "category_name") {
+    read_string(value, asmt.category_name);
+  } else if (key == "start_at") {
+    asmt.start_at = Utility::string_to_time(read_string_force(value, key, has_start_at));
+  } else if (key == "due_at") {
+    asmt.due_at = Utility::string_to_time(read_string_force(value, key, has_due_at));
+  } else if (key == "end_at") {
+    asmt.end_at = Utility::string_to_time(read_string_force(value, key, has_end_at));
+  }
+}
+
+void AssessmentListHandler::end_object() {
+  require_present(has_name, "name");
+  require_present(has_start_at, "start_at");
+  require_present(has_due_at, "due_at");
+  require_present(has_end_at, "end_at");
+  asmts.push_back(asmt);
+}
+
+/* ProblemListHandler */
+
+void ProblemListHandler::begin_object() {
+  prob = Problem();
+  prob.max_score = std::nan("");
+  prob.optional = false;
+  has_name = false;
+}
+
+void ProblemListHandler::set_field(const std::string &key, const json_scalar &value) {
+  if (key == "name") {
+    prob.name = read_string_force(value, key, has_name);
+  } else if (key == "description") {
+    read_string(value, prob.description);
+  } else if (key == "max_score") {
+    read_double(value, prob.max_score);
+  } else if (key == "optional") {
+    read_bool(value, prob.optional);
+  }
+}
+
+void ProblemListHandler::end_object() {
+  require_present(has_name, "name");
+  probs.push_back(prob);
+}
+
+/* SubmissionListHandler */
+
+void SubmissionListHandler::begin_object() {
+  sub = Submission();
+  has_version = has_created_at = has_scores = false;
+}
+
+void SubmissionListHandler::set_field(const std::string &key, const json_scalar &value) {
+  if (key == "version") {
+    sub.version = read_int_force(value, key, has_version);
+  } else if (key == "created_at") {
+    sub.created_at = Utility::string_to_time(read_string_force(value, key, has_created_at));
+  } else if (key == "filename") {
+    read_string(value, sub.filename);
+  } else if (key == "scores") {
+    // scores must be an object, handled by set_nested_field
+    throw InvalidResponseException("Expected json object not found");
+  }
+}
+
+bool SubmissionListHandler::accepts_nested_object(const std::string &key) {
+  if (key != "scores") return false;
+  has_scores = true;
+  return true;
+}
+
+void SubmissionListHandler::set_nested_field(const std::string &,
+    const std::string &member, const json_scalar &value) {
+  double score = std::nan(""); // unreleased
+  read_double(value, score);
+  sub.scores[member] = score;
+}
+
+void SubmissionListHandler::end_object() {
+  require_present(has_version, "version");
+  require_present(has_created_at, "created_at");
+  if (!has_scores) {
+    throw InvalidResponseException("Expected json object not found");
+  }
+  subs.push_back(sub);
+}
+
+/* EnrollmentListHandler */
+
+void EnrollmentListHandler::begin_object() {
+  enrollment = Enrollment();
+  enrollment.dropped = false;
+  enrollment.auth_level = AuthorizationLevel::student;
+  has_first_name = has_last_name = has_email = has_auth_level = false;
+}
+
+void EnrollmentListHandler::set_field(const std::string &key, const json_scalar &value) {
+  User &user = enrollment.user;
+  if (key == "lecture") {
+    read_string(value, enrollment.lecture);
+  } else if (key == "section") {
+    read_string(value, enrollment.section);
+  } else if (key == "grade_policy") {
+    read_string(value, enrollment.grade_policy);
+  } else if (key == "nickname") {
+    read_string(value, enrollment.nickname);
+  } else if (key == "dropped") {
+    read_bool(value, enrollment.dropped);
+  } else if (key == "auth_level") {
+    enrollment.auth_level = Utility::string_to_authorization_level(
+      read_string_force(value, key, has_auth_level));
+  } else if (key == "first_name") {
+    user.first_name = read_string_force(value, key, has_first_name);
+  } else if (key == "last_name") {
+    user.last_name = read_string_force(value, key, has_last_name);
+  } else if (key == "email") {
+    user.email = read_string_force(value, key, has_email);
+  } else if (key == "school") {
+    read_string(value, user.school);
+  } else if (key == "major") {
+    read_string(value, user.major);
+  } else if (key == "year") {
+    read_string(value, user.year);
+  }
+}
+
+void EnrollmentListHandler::end_object() {
+  require_present(has_auth_level, "auth_level");
+  require_present(has_first_name, "first_name");
+  require_present(has_last_name, "last_name");
+  require_present(has_email, "email");
+  enrollments.push_back(enrollment);
+}
+
+} /* namespace Autolab */
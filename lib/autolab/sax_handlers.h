@@ -0,0 +1,173 @@
+/*
+ * SAX handlers that build autolab structs directly from a streamed response.
+ *
+ * Each handler expects a json array of objects and appends one struct to its
+ * output vector as soon as the corresponding object has been parsed, so
+ * neither the body nor a document of it is ever built. Fields are read with
+ * the same fallbacks and required-field checks as the document-based
+ * packagers in client.cpp, and the same exceptions are raised by check().
+ */
+
+#ifndef LIBAUTOLAB_SAX_HANDLERS_H_
+#define LIBAUTOLAB_SAX_HANDLERS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <exception>
+#include <string>
+#include <vector>
+
+#include "autolab/autolab.h"
+#include "autolab/raw_client.h"
+
+namespace Autolab {
+
+// A json value as seen by a handler. Objects, arrays and numbers that do not
+// fit in an int are all 'other_value', which no field accepts.
+struct json_scalar {
+  enum Kind {null_value, bool_value, int_value, double_value, string_value,
+             other_value};
+  Kind kind;
+  bool bool_val;
+  int int_val;
+  double double_val;
+  const char *str;
+  std::size_t length;
+
+  json_scalar(Kind k) : kind(k), bool_val(false), int_val(0),
+    double_val(0), str(nullptr), length(0) {}
+};
+
+class ObjectArrayHandler : public RawClient::ResponseHandler {
+public:
+  // rethrows the first problem found in the response: ErrorResponseException
+  // if the api returned an error, InvalidResponseException if the json did
+  // not have the expected shape.
+  void check();
+
+  bool Null() override;
+  bool Bool(bool b) override;
+  bool Int(int i) override;
+  bool Uint(unsigned u) override;
+  bool Int64(int64_t i) override;
+  bool Uint64(uint64_t u) override;
+  bool Double(double d) override;
+  bool RawNumber(const char *str, rapidjson::SizeType length, bool copy) override;
+  bool String(const char *str, rapidjson::SizeType length, bool copy) override;
+  bool StartObject() override;
+  bool Key(const char *str, rapidjson::SizeType length, bool copy) override;
+  bool EndObject(rapidjson::SizeType member_count) override;
+  bool StartArray() override;
+  bool EndArray(rapidjson::SizeType element_count) override;
+  void Finish(bool parsed) override;
+
+protected:
+  ObjectArrayHandler();
+
+  // called for each object of the top-level array
+  virtual void begin_object() = 0;
+  virtual void set_field(const std::string &key, const json_scalar &value) = 0;
+  virtual void end_object() = 0;
+
+  // called when a field holds an object. Return true to have its members
+  // passed to set_nested_field, otherwise it is treated like any other
+  // non-scalar value.
+  virtual bool accepts_nested_object(const std::string &) { return false; }
+  virtual void set_nested_field(const std::string &, const std::string &,
+    const json_scalar &) {}
+
+private:
+  enum TopLevel {top_none, top_array, top_object, top_scalar};
+  TopLevel top_level;
+  int depth;
+  int skip_depth; // depth of the container being skipped, or -1
+  std::string key;
+  std::string nested_key;
+  bool has_error_response;
+  std::string error_response;
+  std::exception_ptr error;
+
+  bool value(const json_scalar &v);
+  bool start_container(bool is_object);
+  bool end_container(bool is_object);
+  void skip_container() { skip_depth = depth; }
+  bool skipping() { return skip_depth >= 0; }
+};
+
+class CourseListHandler : public ObjectArrayHandler {
+public:
+  explicit CourseListHandler(std::vector<Course> &courses) :
+    courses(courses) {}
+protected:
+  void begin_object() override;
+  void set_field(const std::string &key, const json_scalar &value) override;
+  void end_object() override;
+private:
+  std::vector<Course> &courses;
+  Course course;
+  bool has_name, has_auth_level;
+};
+
+class AssessmentListHandler : public ObjectArrayHandler {
+public:
+  explicit AssessmentListHandler(std::vector<Assessment> &asmts) :
+    asmts(asmts) {}
+protected:
+  void begin_object() override;
+  void set_field(const std::string &key, const json_scalar &value) override;
+  void end_object() override;
+private:
+  std::vector<Assessment> &asmts;
+  Assessment asmt;
+  bool has_name, has_start_at, has_due_at, has_end_at;
+};
+
+class ProblemListHandler : public ObjectArrayHandler {
+public:
+  explicit ProblemListHandler(std::vector<Problem> &probs) :
+    probs(probs) {}
+protected:
+  void begin_object() override;
+  void set_field(const std::string &key, const json_scalar &value) override;
+  void end_object() override;
+private:
+  std::vector<Problem> &probs;
+  Problem prob;
+  bool has_name;
+};
+
+class SubmissionListHandler : public ObjectArrayHandler {
+public:
+  explicit SubmissionListHandler(std::vector<Submission> &subs) :
+    subs(subs) {}
+protected:
+  void begin_object() override;
+  void set_field(const std::string &key, const json_scalar &value) override;
+  void end_object() override;
+  bool accepts_nested_object(const std::string &key) override;
+  void set_nested_field(const std::string &key, const std::string &member,
+    const json_scalar &value) override;
+private:
+  std::vector<Submission> &subs;
+  Submission sub;
+  bool has_version, has_created_at, has_scores;
+};
+
+class EnrollmentListHandler : public ObjectArrayHandler {
+public:
+  explicit EnrollmentListHandler(std::vector<Enrollment> &enrollments) :
+    enrollments(enrollments) {}
+protected:
+  void begin_object() override;
+  void set_field(const std::string &key, const json_scalar &value) override;
+  void end_object() override;
+private:
+  std::vector<Enrollment> &enrollments;
+  Enrollment enrollment;
+  bool has_first_name, has_last_name, has_email, has_auth_level;
+};
+
+}
+
+#endif /* LIBAUTOLAB_SAX_HANDLERS_H_ */
@@ -0,0 +1,466 @@
+#include "tar_gz_stream.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+
+#include <zlib.h>
+
+#include "logger.h"
+
+#include "../crypto/sha256.h"
+
+// uncompressed bytes per block, each compressed by one thread
+const std::size_t tar_block_size = 128 * 1024;
+// what deflate can refer back to, carried over between blocks
+const std::size_t dictionary_size = 32 * 1024;
+const std::size_t tar_record_size = 512;
+
+TarGzStream::TarGzStream(const std::string &dir,
+  const std::vector<std::string> &exclude)
+  : dir(dir), exclude(exclude), started(false), stopping(false),
+    packing_done(false), hash_only(false), pending_offset(0), crc(0),
+    total_in(0),
+    consumed(false), finished(false)
+{
+  std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+  compressors.resize(threads);
+  // enough for every thread to work on one while the next ones wait
+  max_blocks = 2 * threads + 2;
+}
+
+TarGzStream::~TarGzStream() {
+  stop();
+}
+
+std::string TarGzStream::error() {
+  std::lock_guard<std::mutex> guard(mutex);
+  return failure;
+}
+
+std::string TarGzStream::content_digest() {
+  stop();
+  failure.clear();
+  hash_only = true;
+  tar_hash.reset(new Sha256());
+  bool packed = pack_archive();
+  hash_only = false;
+  return packed ? tar_hash->hex_digest() : "";
+}
+
+std::string TarGzStream::packed_digest() {
+  std::lock_guard<std::mutex> guard(mutex);
+  return last_packed_digest;
+}
+
+void TarGzStream::fail(const std::string &message) {
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    if (failure.empty()) failure = message;
+  }
+  changed.notify_all();
+}
+
+/* reading */
+
+void TarGzStream::start() {
+  // gzip header: deflate, no name, no timestamp, made on unix
+  static const char header[] = {'\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, 3};
+  pending.assign(header, sizeof(header));
+  pending_offset = 0;
+  crc = crc32(0L, Z_NULL, 0);
+  total_in = 0;
+  consumed = false;
+  finished = false;
+
+  stopping = false;
+  packing_done = false;
+  failure.clear();
+  started = true;
+  packer = std::thread(&TarGzStream::run_packer, this);
+  for (auto &compressor : compressors) {
+    compressor = std::thread(&TarGzStream::run_compressor, this);
+  }
+}
+
+void TarGzStream::stop() {
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    if (!started) return;
+    stopping = true;
+  }
+  changed.notify_all();
+  packer.join();
+  for (auto &compressor : compressors) compressor.join();
+  blocks.clear();
+  current.reset();
+  previous_tail.clear();
+  started = false;
+}
+
+bool TarGzStream::rewind() {
+  // nothing was read yet, the archive is already on its way
+  if (started && !consumed) return true;
+  stop();
+  return true;
+}
+
+bool TarGzStream::read(char *buffer, std::size_t &length) {
+  if (!started) start();
+  consumed = true;
+
+  std::size_t capacity = length;
+  length = 0;
+  while (length < capacity) {
+    if (pending_offset < pending.size()) {
+      std::size_t amount = std::min(capacity - length,
+        pending.size() - pending_offset);
+      std::memcpy(buffer + length, pending.data() + pending_offset, amount);
+      pending_offset += amount;
+      length += amount;
+      continue;
+    }
+    if (finished) break;
+
+    std::shared_ptr<block> next;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      auto ready = [this] {
+        return !failure.empty() ||
+          (!blocks.empty() && blocks.front()->compressed);
+      };
+      // hand out what is there rather than waiting for more
+      if (length > 0 && !ready()) break;
+      changed.wait(lock, ready);
+      if (!failure.empty()) return false;
+      next = blocks.front();
+      blocks.pop_front();
+    }
+    // the packer may be waiting for room
+    changed.notify_all();
+
+    crc = crc32_combine(crc, next->crc, next->input.size());
+    total_in += next->input.size();
+    pending.swap(next->output);
+    pending_offset = 0;
+    if (next->last) {
+      // gzip trailer: CRC-32 and size modulo 2^32, little endian
+      for (int i = 0; i < 4; i++) pending.push_back((crc >> (8 * i)) & 0xff);
+      for (int i = 0; i < 4; i++) pending.push_back((total_in >> (8 * i)) & 0xff);
+      finished = true;
+      std::lock_guard<std::mutex> guard(mutex);
+      last_packed_digest = next->tar_digest;
+    }
+  }
+  return true;
+}
+
+/* packing */
+
+void TarGzStream::run_packer() {
+  current.reset(new block());
+  previous_tail.clear();
+  tar_hash.reset(new Sha256());
+  if (pack_archive()) {
+    current->tar_digest = tar_hash->hex_digest();
+    push_block(true);
+  }
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    packing_done = true;
+  }
+  changed.notify_all();
+}
+
+bool TarGzStream::pack_archive() {
+  // the end of the archive is marked by two empty records
+  static const char end_of_archive[2 * tar_record_size] = {0};
+  return pack_directory("") && emit(end_of_archive, sizeof(end_of_archive));
+}
+
+// packs the entries of the directory at relative (empty for the top), in
+// name order so that the archive does not depend on the file system
+bool TarGzStream::pack_directory(const std::string &relative) {
+  std::string path = relative.empty() ? dir : dir + "/" + relative;
+  DIR *handle = opendir(path.c_str());
+  if (!handle) {
+    fail("Cannot read directory " + path + ": " + std::strerror(errno));
+    return false;
+  }
+  std::vector<std::string> names;
+  struct dirent *entry;
+  while ((entry = readdir(handle))) {
+    std::string name(entry->d_name);
+    if (name == "." || name == "..") continue;
+    if (relative.empty() &&
+        std::find(exclude.begin(), exclude.end(), name) != exclude.end()) {
+      continue;
+    }
+    names.push_back(name);
+  }
+  closedir(handle);
+  std::sort(names.begin(), names.end());
+
+  for (auto &name : names) {
+    std::string entry_name = relative.empty() ? name : relative + "/" + name;
+    if (!pack_entry(entry_name, dir + "/" + entry_name)) return false;
+  }
+  return true;
+}
+
+bool TarGzStream::pack_entry(const std::string &name, const std::string &path) {
+  struct stat st;
+  if (lstat(path.c_str(), &st) != 0) {
+    fail("Cannot read " + path + ": " + std::strerror(errno));
+    return false;
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    return emit_header(name + "/", st, '5', "", 0) && pack_directory(name);
+  }
+  if (S_ISLNK(st.st_mode)) {
+    std::vector<char> target(st.st_size + 1);
+    ssize_t target_length = readlink(path.c_str(), target.data(), target.size());
+    if (target_length < 0) {
+      fail("Cannot read link " + path + ": " + std::strerror(errno));
+      return false;
+    }
+    return emit_header(name, st, '2', std::string(target.data(), target_length), 0);
+  }
+  if (!S_ISREG(st.st_mode)) {
+    LogDebug("[TarGzStream] skipping special file " << path << Logger::endl);
+    return true;
+  }
+
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fail("Cannot read " + path + ": " + std::strerror(errno));
+    return false;
+  }
+  unsigned long long size = st.st_size;
+  if (!emit_header(name, st, '0', "", size)) {
+    close(fd);
+    return false;
+  }
+
+  char buffer[64 * 1024];
+  unsigned long long remaining = size;
+  while (remaining > 0) {
+    ssize_t amount = ::read(fd, buffer,
+      std::min<unsigned long long>(sizeof(buffer), remaining));
+    if (amount < 0 && errno == EINTR) continue;
+    if (amount <= 0) {
+      close(fd);
+      fail(amount < 0 ? "Cannot read " + path + ": " + std::strerror(errno) :
+        path + " changed while it was packed");
+      return false;
+    }
+    if (!emit(buffer, amount)) {
+      close(fd);
+      return false;
+    }
+    remaining -= amount;
+  }
+  close(fd);
+  return emit_padding(size);
+}
+
+// writes value into a tar header field of the given width, as zero padded
+// octal. Returns false if it does not fit.
+static bool set_octal(char *field, std::size_t width, unsigned long long value) {
+  char digits[32];
+  int length = std::snprintf(digits, sizeof(digits), "%0*llo",
+    static_cast<int>(width - 1), value);
+  if (length < 0 || static_cast<std::size_t>(length) >= width) return false;
+  std::memcpy(field, digits, length + 1);
+  return true;
+}
+
+// emits a ustar header. Names that do not fit are split into prefix and name
+// if possible, and otherwise preceded by a GNU long name entry.
+bool TarGzStream::emit_header(const std::string &name, const struct stat &st,
+  char type, const std::string &link_target, unsigned long long size)
+{
+  std::string short_name = name, prefix;
+  if (name.size() > 100) {
+    std::string::size_type split = name.rfind('/', name.size() - 2);
+    while (split != std::string::npos && name.size() - split - 1 <= 100) {
+      if (split <= 155) {
+        prefix = name.substr(0, split);
+        short_name = name.substr(split + 1);
+        break;
+      }
+      split = name.rfind('/', split - 1);
+    }
+    if (prefix.empty()) {
+      struct stat none;
+      std::memset(&none, 0, sizeof(none));
+      if (!emit_header("././@LongLink", none, 'L', "", name.size() + 1) ||
+          !emit(name.c_str(), name.size() + 1) ||
+          !emit_padding(name.size() + 1)) {
+        return false;
+      }
+      short_name = name.substr(0, 100);
+    }
+  }
+  if (link_target.size() > 100) {
+    fail("Link target of " + name + " is too long to be packed");
+    return false;
+  }
+
+  char header[tar_record_size];
+  std::memset(header, 0, sizeof(header));
+  std::memcpy(header, short_name.data(), std::min<std::size_t>(short_name.size(), 100));
+  bool fits = set_octal(header + 100, 8, st.st_mode & 07777) &&
+    set_octal(header + 108, 8, 0) &&   // uid
+    set_octal(header + 116, 8, 0) &&   // gid
+    set_octal(header + 124, 12, size) &&
+    set_octal(header + 136, 12, st.st_mtime > 0 ? st.st_mtime : 0);
+  if (!fits) {
+    fail(name + " is too large to be packed");
+    return false;
+  }
+  header[156] = type;
+  std::memcpy(header + 157, link_target.data(), link_target.size());
+  std::memcpy(header + 257, "ustar\0" "00", 8);
+  std::memcpy(header + 345, prefix.data(), prefix.size());
+
+  // the checksum is computed with its own field filled with spaces
+  std::memset(header + 148, ' ', 8);
+  unsigned long checksum = 0;
+  for (unsigned char c : header) checksum += c;
+  std::snprintf(header + 148, 8, "%06lo", checksum);
+
+  return emit(header, sizeof(header));
+}
+
+bool TarGzStream::emit_padding(unsigned long long size) {
+  static const char zeros[tar_record_size] = {0};
+  std::size_t padding = (tar_record_size - size % tar_record_size) % tar_record_size;
+  return emit(zeros, padding);
+}
+
+// appends to the tar stream. Returns false if the stream is stopping.
+bool TarGzStream::emit(const char *data, std::size_t length) {
+  tar_hash->update(data, length);
+  if (hash_only) return true;
+  while (length > 0) {
+    std::size_t amount = std::min(length, tar_block_size - current->input.size());
+    current->input.append(data, amount);
+    data += amount;
+    length -= amount;
+    if (current->input.size() == tar_block_size && !push_block(false)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// hands the current block to the compressors, waiting for room if too many
+// are in memory already
+bool TarGzStream::push_block(bool last) {
+  std::shared_ptr<block> full = current;
+  full->last = last;
+  full->dictionary.swap(previous_tail);
+  std::size_t tail = std::min(dictionary_size, full->input.size());
+  previous_tail.assign(full->input, full->input.size() - tail, tail);
+  current.reset(new block());
+
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this] {
+      return stopping || !failure.empty() || blocks.size() < max_blocks;
+    });
+    if (stopping || !failure.empty()) return false;
+    blocks.push_back(full);
+  }
+  changed.notify_all();
+  return true;
+}
+
+/* compressing */
+
+void TarGzStream::run_compressor() {
+  while (true) {
+    std::shared_ptr<block> work;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      auto next = [this] {
+        return std::find_if(blocks.begin(), blocks.end(),
+          [](const std::shared_ptr<block> &b) { return !b->taken; });
+      };
+      changed.wait(lock, [&] {
+        return stopping || !failure.empty() || next() != blocks.end() ||
+          packing_done;
+      });
+      if (stopping || !failure.empty()) return;
+      auto found = next();
+      if (found == blocks.end()) return; // packing_done
+      work = *found;
+      work->taken = true;
+    }
+
+    if (!compress(*work)) {
+      fail("Cannot compress the archive");
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      work->compressed = true;
+    }
+    changed.notify_all();
+  }
+}
+
+// deflates a block on its own. All but the last end with a sync flush, which
+// aligns them to a byte boundary so that they can simply be concatenated.
+// Returns false if zlib fails, e.g. out of memory.
+bool TarGzStream::compress(TarGzStream::block &b) {
+  b.crc = crc32(crc32(0L, Z_NULL, 0),
+    reinterpret_cast<const Bytef *>(b.input.data()), b.input.size());
+
+  z_stream stream;
+  std::memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+      Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+  if (!b.dictionary.empty() &&
+      deflateSetDictionary(&stream,
+        reinterpret_cast<const Bytef *>(b.dictionary.data()),
+        b.dictionary.size()) != Z_OK) {
+    deflateEnd(&stream);
+    return false;
+  }
+
+  stream.next_in = reinterpret_cast<Bytef *>(&b.input[0]);
+  stream.avail_in = b.input.size();
+  // room for the flush markers on top of the worst case
+  b.output.resize(deflateBound(&stream, b.input.size()) + 16);
+  int flush = b.last ? Z_FINISH : Z_SYNC_FLUSH;
+  std::size_t produced = 0;
+  while (true) {
+    stream.next_out = reinterpret_cast<Bytef *>(&b.output[produced]);
+    stream.avail_out = b.output.size() - produced;
+    int result = deflate(&stream, flush);
+    if (result == Z_STREAM_ERROR) {
+      deflateEnd(&stream);
+      return false;
+    }
+    produced = b.output.size() - stream.avail_out;
+    bool done = b.last ? result == Z_STREAM_END :
+      (stream.avail_in == 0 && stream.avail_out > 0);
+    if (done) break;
+    b.output.resize(b.output.size() * 2);
+  }
+  b.output.resize(produced);
+  deflateEnd(&stream);
+  b.dictionary.clear();
+  return true;
+}
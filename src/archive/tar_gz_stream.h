@@ -0,0 +1,115 @@
+/*
+ * Packs a directory into a tar.gz archive while it is being uploaded.
+ *
+ * The tar stream is cut into blocks that are deflated in parallel, one per
+ * core, and joined into a single gzip member the way pigz does it: each block
+ * is primed with the end of the previous one as its dictionary and ends on a
+ * byte boundary, so the result is a plain .tar.gz. Nothing is written to
+ * disk, and only a few blocks are held in memory at a time.
+ */
+
+#ifndef AUTOLAB_TAR_GZ_STREAM_H_
+#define AUTOLAB_TAR_GZ_STREAM_H_
+
+#include <sys/stat.h>
+
+#include <cstddef>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "autolab/transport.h"
+
+class Sha256;
+
+class TarGzStream : public Autolab::UploadStream {
+public:
+  // packs the contents of dir, named relative to it. Entries directly inside
+  // dir whose names are in exclude are left out.
+  TarGzStream(const std::string &dir, const std::vector<std::string> &exclude);
+  ~TarGzStream();
+
+  TarGzStream(const TarGzStream &) = delete;
+  TarGzStream &operator=(const TarGzStream &) = delete;
+
+  bool read(char *buffer, std::size_t &length) override;
+  bool rewind() override;
+
+  // why the stream failed, empty if it did not
+  std::string error();
+
+  // SHA-256 of the uncompressed tar stream, found by packing the directory
+  // without compressing or sending it. Empty if packing failed.
+  std::string content_digest();
+  // SHA-256 of the uncompressed tar stream last read to the end, empty if
+  // none was
+  std::string packed_digest();
+
+private:
+  // a piece of the tar stream and its compressed form
+  struct block {
+    std::string input;
+    std::string dictionary; // the end of the previous block's input
+    std::string output;
+    std::string tar_digest; // of the whole tar stream, in the last block
+    unsigned long crc;
+    bool last;
+    bool taken;       // by a compressing thread
+    bool compressed;
+
+    block() : crc(0), last(false), taken(false), compressed(false) {}
+  };
+
+  std::string dir;
+  std::vector<std::string> exclude;
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<std::shared_ptr<block>> blocks; // in stream order
+  std::size_t max_blocks;
+  std::thread packer;
+  std::vector<std::thread> compressors;
+  bool started;
+  bool stopping;
+  bool packing_done;
+  std::string failure;
+  std::string last_packed_digest;
+
+  // owned by the packer thread
+  std::shared_ptr<block> current;
+  std::string previous_tail;
+  std::unique_ptr<Sha256> tar_hash;
+  bool hash_only; // while finding the content digest, nothing is compressed
+
+  // owned by the reading thread
+  std::string pending; // gzip header, a compressed block or the trailer
+  std::size_t pending_offset;
+  unsigned long crc;
+  unsigned long long total_in;
+  bool consumed;
+  bool finished;
+
+  void start();
+  void stop();
+  void fail(const std::string &message);
+
+  void run_packer();
+  bool pack_archive();
+  bool pack_directory(const std::string &relative);
+  bool pack_entry(const std::string &name, const std::string &path);
+  bool emit_header(const std::string &name, const struct stat &st, char type,
+    const std::string &link_target, unsigned long long size);
+  bool emit(const char *data, std::size_t length);
+  bool emit_padding(unsigned long long size);
+  bool push_block(bool last);
+
+  void run_compressor();
+  static bool compress(block &b);
+};
+
+#endif /* AUTOLAB_TAR_GZ_STREAM_H_ */
@@ -1,20 +1,28 @@
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h> // getpid, unlink
 
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <ostream>
 #include <sstream>
 
+#include <zlib.h>
+
 #include "logger.h"
 
 #include "../context_manager/context_manager.h"
+#include "../crypto/sha256.h"
 #include "../file/file_utils.h"
 
 #include "cache.h"
 
-const std::string courses_cache_filename = "courses.txt";
+const std::string courses_cache_filename = "courses.bin";
 const std::string cache_dirname = "cache";
+const std::string feedback_cache_dirname = "feedback";
+// the display-line caches of earlier versions
+const std::string legacy_cache_extension = ".txt";
 
 std::string get_cache_dir_full_path() {
   std::string cache_dir_full_path = get_cred_dir_full_path();
@@ -34,10 +42,16 @@ std::string get_asmts_cache_file_full_path(std::string course_id) {
   std::string asmts_cache_file_full_path = get_cache_dir_full_path();
   asmts_cache_file_full_path.append("/");
   asmts_cache_file_full_path.append(course_id);
-  asmts_cache_file_full_path.append(".txt");
+  asmts_cache_file_full_path.append(".bin");
   return asmts_cache_file_full_path;
 }
 
+// removes the display-line cache that the file at path replaces
+void remove_legacy_cache_file(const std::string &path) {
+  std::string legacy = path.substr(0, path.rfind('.')) + legacy_cache_extension;
+  unlink(legacy.c_str());
+}
+
 bool check_and_create_cache_directory() {
   check_and_create_token_directory();
   std::string cred_dir = get_cred_dir_full_path();
@@ -49,60 +63,342 @@ bool check_and_create_cache_directory() {
   return false;
 }
 
-void print_cache_entry(std::string filename) {
-  if (!file_exists(filename.c_str())) {
-    return; // no need to print anything in this case
+bool write_cache_file_atomically(const std::string &path, const std::string &data,
+  bool compress);
+
+/* record cache files
+ *
+ * A 32-byte header: the magic "ALRECS\0\0", then the uint32 format version,
+ * record kind, record count and record size, then the int64 fetch time.
+ * The fixed-size records follow, then the strings they refer to. A string
+ * field is a uint32 offset from the start of the file and a uint32 length.
+ *
+ *   course:     name, display_name, semester, int32 late_slack,
+ *               int32 grace_days, int32 auth_level, int32 reserved (40 bytes)
+ *   assessment: name, display_name, category_name, int64 start_at,
+ *               int64 due_at, int64 end_at (48 bytes)
+ *
+ * Numbers are in host byte order, the cache never leaves the machine. The
+ * format version changes whenever the layout does.
+ */
+const char record_cache_magic[8] = {'A', 'L', 'R', 'E', 'C', 'S', 0, 0};
+const uint32_t record_cache_version = 1;
+const std::size_t record_cache_header_size = 32;
+const std::size_t string_field_size = 8;
+const std::size_t course_record_size = 3 * string_field_size + 4 * 4;
+const std::size_t asmt_record_size = 3 * string_field_size + 3 * 8;
+
+template <typename T>
+T read_field(const char *at) {
+  T value;
+  memcpy(&value, at, sizeof(value));
+  return value;
+}
+
+template <typename T>
+void append_field(std::string &out, T value) {
+  out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+std::size_t record_size_of(RecordCache::Kind kind) {
+  return kind == RecordCache::courses ? course_record_size : asmt_record_size;
+}
+
+RecordCache::RecordCache(const std::string &path, RecordCache::Kind k)
+  : kind(k), data(nullptr), length(0), count(0), fetched(0)
+{
+  if (!file_exists(path.c_str())) return;
+  const char *mapped = map_file(path.c_str(), length);
+  if (length < record_cache_header_size ||
+      memcmp(mapped, record_cache_magic, sizeof(record_cache_magic)) != 0 ||
+      read_field<uint32_t>(mapped + 8) != record_cache_version ||
+      read_field<uint32_t>(mapped + 12) != static_cast<uint32_t>(kind) ||
+      read_field<uint32_t>(mapped + 20) != record_size_of(kind)) {
+    unmap_file(mapped, length);
+    return;
+  }
+  std::size_t records = read_field<uint32_t>(mapped + 16);
+  if (records > (length - record_cache_header_size) / record_size_of(kind)) {
+    unmap_file(mapped, length);
+    return;
   }
+  data = mapped;
+  count = records;
+  fetched = static_cast<std::time_t>(read_field<int64_t>(mapped + 24));
+}
+
+RecordCache::~RecordCache() {
+  if (data) unmap_file(data, length);
+}
 
-  std::ifstream cache_file;
-  cache_file.open(filename.c_str());
+const char *RecordCache::record(std::size_t i) const {
+  return data + record_cache_header_size + i * record_size_of(kind);
+}
+
+// the field-th string of record i, empty if it points outside the file
+std::string RecordCache::string_field(std::size_t i, int field) const {
+  const char *at = record(i) + field * string_field_size;
+  uint32_t offset = read_field<uint32_t>(at);
+  uint32_t size = read_field<uint32_t>(at + 4);
+  if (offset > length || size > length - offset) return "";
+  return std::string(data + offset, size);
+}
+
+std::string RecordCache::name(std::size_t i) const {
+  return string_field(i, 0);
+}
+
+std::string RecordCache::display_name(std::size_t i) const {
+  return string_field(i, 1);
+}
 
-  std::string curr_line;
+Autolab::Course RecordCache::course(std::size_t i) const {
+  const char *numbers = record(i) + 3 * string_field_size;
+  Autolab::Course c;
+  c.name = string_field(i, 0);
+  c.display_name = string_field(i, 1);
+  c.semester = string_field(i, 2);
+  c.late_slack = read_field<int32_t>(numbers);
+  c.grace_days = read_field<int32_t>(numbers + 4);
+  c.auth_level = static_cast<Autolab::AuthorizationLevel>(
+    read_field<int32_t>(numbers + 8));
+  return c;
+}
 
-  // Read through the cache file line by line, cat to Logger::info
-  while (std::getline(cache_file, curr_line)) {
-    Logger::info << curr_line << Logger::endl;
+Autolab::Assessment RecordCache::assessment(std::size_t i) const {
+  const char *numbers = record(i) + 3 * string_field_size;
+  Autolab::Assessment a;
+  a.name = string_field(i, 0);
+  a.display_name = string_field(i, 1);
+  a.category_name = string_field(i, 2);
+  a.start_at = static_cast<std::time_t>(read_field<int64_t>(numbers));
+  a.due_at = static_cast<std::time_t>(read_field<int64_t>(numbers + 8));
+  a.end_at = static_cast<std::time_t>(read_field<int64_t>(numbers + 16));
+  return a;
+}
+
+// lays out the header, and the records as filled in by add_record, which
+// is given each index, the string table so far and the record to append to
+std::string build_record_cache(RecordCache::Kind kind, std::size_t count,
+  std::function<void(std::size_t, std::string &, std::string &)> add_record)
+{
+  std::string records, strings;
+  for (std::size_t i = 0; i < count; i++) add_record(i, strings, records);
+
+  std::string out(record_cache_magic, sizeof(record_cache_magic));
+  append_field<uint32_t>(out, record_cache_version);
+  append_field<uint32_t>(out, kind);
+  append_field<uint32_t>(out, count);
+  append_field<uint32_t>(out, record_size_of(kind));
+  append_field<int64_t>(out, std::time(nullptr));
+  // the string offsets were relative to the string table
+  std::size_t strings_start = out.length() + records.length();
+  for (std::size_t i = 0; i < count; i++) {
+    for (int field = 0; field < 3; field++) {
+      char *at = &records[i * record_size_of(kind) + field * string_field_size];
+      uint32_t offset = read_field<uint32_t>(at) + strings_start;
+      memcpy(at, &offset, sizeof(offset));
+    }
   }
+  return out + records + strings;
+}
 
-  cache_file.close();
+void append_string_field(std::string &record, std::string &strings,
+  const std::string &value)
+{
+  append_field<uint32_t>(record, strings.length());
+  append_field<uint32_t>(record, value.length());
+  strings.append(value);
+}
+
+bool RecordCache::write(const std::string &path,
+  const std::vector<Autolab::Course> &courses)
+{
+  return write_cache_file_atomically(path, build_record_cache(
+    RecordCache::courses, courses.size(),
+    [&courses](std::size_t i, std::string &strings, std::string &record) {
+      const Autolab::Course &c = courses[i];
+      append_string_field(record, strings, c.name);
+      append_string_field(record, strings, c.display_name);
+      append_string_field(record, strings, c.semester);
+      append_field<int32_t>(record, c.late_slack);
+      append_field<int32_t>(record, c.grace_days);
+      append_field<int32_t>(record, c.auth_level);
+      append_field<int32_t>(record, 0);
+    }), false);
+}
+
+bool RecordCache::write(const std::string &path,
+  const std::vector<Autolab::Assessment> &asmts)
+{
+  return write_cache_file_atomically(path, build_record_cache(
+    RecordCache::assessments, asmts.size(),
+    [&asmts](std::size_t i, std::string &strings, std::string &record) {
+      const Autolab::Assessment &a = asmts[i];
+      append_string_field(record, strings, a.name);
+      append_string_field(record, strings, a.display_name);
+      append_string_field(record, strings, a.category_name);
+      append_field<int64_t>(record, a.start_at);
+      append_field<int64_t>(record, a.due_at);
+      append_field<int64_t>(record, a.end_at);
+    }), false);
 }
 
 /* courses cache file */
 void update_course_cache_entry(std::vector<Autolab::Course> &courses) {
   check_and_create_cache_directory();
 
-  std::ostringstream out;
-  for (auto &c : courses) {
-    out << "  " << c.name << " (" << c.display_name << ")\n";
+  std::string path = get_courses_cache_file_full_path();
+  if (!RecordCache::write(path, courses)) {
+    LogDebug("[Cache] cannot write " << path << Logger::endl);
+    return;
   }
-  std::string cache_contents = out.str();
-
-  write_file(get_courses_cache_file_full_path().c_str(),
-             cache_contents.c_str(), cache_contents.length());
+  remove_legacy_cache_file(path);
 
   LogDebug("[Cache] courses cache saved" << Logger::endl);
 }
 
-void print_course_cache_entry() {
-  print_cache_entry(get_courses_cache_file_full_path());
+bool find_course_cache_entry(std::vector<Autolab::Course> &courses,
+  std::time_t &fetched_at)
+{
+  RecordCache cache(get_courses_cache_file_full_path(), RecordCache::courses);
+  if (!cache.valid()) return false;
+  courses.clear();
+  for (std::size_t i = 0; i < cache.size(); i++) {
+    courses.push_back(cache.course(i));
+  }
+  fetched_at = cache.fetched_at();
+  return true;
 }
 
 /* asmts cache file */
 void update_asmt_cache_entry(std::string course_id, std::vector<Autolab::Assessment> &asmts) {
   check_and_create_cache_directory();
 
-  std::ostringstream out;
-  for (auto &a : asmts) {
-    out << "  " << a.name << " (" << a.display_name << ")\n";
+  std::string path = get_asmts_cache_file_full_path(course_id);
+  if (!RecordCache::write(path, asmts)) {
+    LogDebug("[Cache] cannot write " << path << Logger::endl);
+    return;
   }
-  std::string cache_contents = out.str();
-
-  write_file(get_asmts_cache_file_full_path(course_id).c_str(),
-             cache_contents.c_str(), cache_contents.length());
+  remove_legacy_cache_file(path);
 
   LogDebug("[Cache] asmts cache saved for course: " << course_id << Logger::endl);
 }
 
-void print_asmt_cache_entry(std::string course_id) {
-  print_cache_entry(get_asmts_cache_file_full_path(course_id));
+bool find_asmt_cache_entry(std::string course_id,
+  std::vector<Autolab::Assessment> &asmts, std::time_t &fetched_at)
+{
+  RecordCache cache(get_asmts_cache_file_full_path(course_id),
+    RecordCache::assessments);
+  if (!cache.valid()) return false;
+  asmts.clear();
+  for (std::size_t i = 0; i < cache.size(); i++) {
+    asmts.push_back(cache.assessment(i));
+  }
+  fetched_at = cache.fetched_at();
+  return true;
+}
+
+/* feedback cache
+ * cache/feedback/<key hash> holds the SHA-256 of the feedback of a course,
+ * assessment, version and problem, which is in cache/feedback/<SHA-256>.gz.
+ * Files are written under a temporary name and renamed into place, so a
+ * concurrent reader never sees half of one. Failing to cache is not an error.
+ */
+std::string get_feedback_cache_dir_full_path() {
+  return get_cache_dir_full_path() + "/" + feedback_cache_dirname;
+}
+
+std::string sha256_hex(const std::string &data) {
+  Sha256 hash;
+  hash.update(data.data(), data.length());
+  return hash.hex_digest();
+}
+
+std::string get_feedback_key_full_path(const std::string &course_id,
+  const std::string &asmt_id, int version, const std::string &problem)
+{
+  // NUL cannot appear in any of the names
+  std::string key = course_id + '\0' + asmt_id + '\0' +
+    std::to_string(version) + '\0' + problem;
+  return get_feedback_cache_dir_full_path() + "/" + sha256_hex(key);
+}
+
+std::string get_feedback_object_full_path(const std::string &digest) {
+  return get_feedback_cache_dir_full_path() + "/" + digest + ".gz";
+}
+
+bool write_cache_file_atomically(const std::string &path, const std::string &data,
+  bool compress)
+{
+  std::string temp_path = path + ".tmp." + std::to_string(getpid());
+  bool written;
+  if (compress) {
+    gzFile out = gzopen(temp_path.c_str(), "wb");
+    written = out &&
+      gzwrite(out, data.data(), data.length()) == (int)data.length();
+    if (out && gzclose(out) != Z_OK) written = false;
+  } else {
+    FILE *out = fopen(temp_path.c_str(), "wb");
+    written = out && fwrite(data.data(), 1, data.length(), out) == data.length();
+    if (out && fclose(out) != 0) written = false;
+  }
+  if (written && rename(temp_path.c_str(), path.c_str()) == 0) return true;
+  unlink(temp_path.c_str());
+  return false;
+}
+
+bool find_feedback_cache_entry(const std::string &course_id,
+  const std::string &asmt_id, int version, const std::string &problem,
+  std::string &feedback)
+{
+  std::ifstream key_file(get_feedback_key_full_path(course_id, asmt_id,
+    version, problem));
+  std::string digest;
+  if (!std::getline(key_file, digest) || digest.empty()) return false;
+
+  std::string object_path = get_feedback_object_full_path(digest);
+  gzFile in = gzopen(object_path.c_str(), "rb");
+  if (!in) return false;
+  std::string contents;
+  char buffer[65536];
+  int length;
+  while ((length = gzread(in, buffer, sizeof(buffer))) > 0) {
+    contents.append(buffer, length);
+  }
+  gzclose(in);
+  // a damaged object is removed, so that the feedback fetched instead can
+  // take its place
+  if (length < 0 || sha256_hex(contents) != digest) {
+    LogDebug("[Cache] removing damaged " << object_path << Logger::endl);
+    unlink(object_path.c_str());
+    return false;
+  }
+
+  feedback.swap(contents);
+  LogDebug("[Cache] feedback found for " << asmt_id << " version " << version
+    << ", " << problem << Logger::endl);
+  return true;
+}
+
+void update_feedback_cache_entry(const std::string &course_id,
+  const std::string &asmt_id, int version, const std::string &problem,
+  const std::string &feedback)
+{
+  check_and_create_cache_directory();
+  create_dir(get_feedback_cache_dir_full_path().c_str());
+
+  std::string digest = sha256_hex(feedback);
+  std::string object_path = get_feedback_object_full_path(digest);
+  // the same feedback is already stored for some other key
+  if (!file_exists(object_path.c_str()) &&
+      !write_cache_file_atomically(object_path, feedback, true)) {
+    LogDebug("[Cache] cannot write " << object_path << Logger::endl);
+    return;
+  }
+  write_cache_file_atomically(get_feedback_key_full_path(course_id, asmt_id,
+    version, problem), digest + "\n", false);
+
+  LogDebug("[Cache] feedback saved for " << asmt_id << " version " << version
+    << ", " << problem << Logger::endl);
 }
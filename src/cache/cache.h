@@ -1,16 +1,77 @@
 #ifndef AUTOLAB_CACHE_H_
 #define AUTOLAB_CACHE_H_
 
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+
 #include <string>
+#include <vector>
 
 #include "autolab/autolab.h"
 
+/* A cache file of Course or Assessment records, as last fetched. The file is
+ * mapped into memory and the records are read in place, without parsing.
+ * A missing or damaged file, or one in another format version, is not
+ * valid().
+ */
+class RecordCache {
+public:
+  enum Kind { courses = 1, assessments = 2 };
+
+  RecordCache(const std::string &path, Kind kind);
+  ~RecordCache();
+
+  RecordCache(const RecordCache &) = delete;
+  RecordCache &operator=(const RecordCache &) = delete;
+
+  bool valid() const { return data != nullptr; }
+  std::size_t size() const { return count; }
+  // when the records were fetched
+  std::time_t fetched_at() const { return fetched; }
+
+  std::string name(std::size_t i) const;
+  std::string display_name(std::size_t i) const;
+  Autolab::Course course(std::size_t i) const;
+  Autolab::Assessment assessment(std::size_t i) const;
+
+  static bool write(const std::string &path,
+    const std::vector<Autolab::Course> &courses);
+  static bool write(const std::string &path,
+    const std::vector<Autolab::Assessment> &asmts);
+
+private:
+  Kind kind;
+  const char *data;
+  std::size_t length;
+  std::size_t count;
+  std::time_t fetched;
+
+  const char *record(std::size_t i) const;
+  std::string string_field(std::size_t i, int field) const;
+};
+
 /* courses cache file */
 void update_course_cache_entry(std::vector<Autolab::Course> &courses);
-void print_course_cache_entry();
+// the courses as last fetched and when, false if there are none cached
+bool find_course_cache_entry(std::vector<Autolab::Course> &courses,
+  std::time_t &fetched_at);
 
 /* asmts cache file */
 void update_asmt_cache_entry(std::string course_id, std::vector<Autolab::Assessment> &asmts);
-void print_asmt_cache_entry(std::string course_id);
+bool find_asmt_cache_entry(std::string course_id,
+  std::vector<Autolab::Assessment> &asmts, std::time_t &fetched_at);
+
+/* feedback cache
+ * Feedback of a graded version never changes, so it is kept for good. The
+ * texts are stored gzip-compressed and named by their SHA-256, so the same
+ * log is stored once however many problems or versions it belongs to.
+ */
+bool find_feedback_cache_entry(const std::string &course_id,
+  const std::string &asmt_id, int version, const std::string &problem,
+  std::string &feedback);
+void update_feedback_cache_entry(const std::string &course_id,
+  const std::string &asmt_id, int version, const std::string &problem,
+  const std::string &feedback);
 
 #endif /* AUTOLAB_CACHE_H_ */
@@ -1,6 +1,9 @@
 #include "cmdargs.h"
 
-#include <cstdlib> // exit
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdlib> // exit, strtol, strtod
 
 #include <iomanip>
 #include <map>
@@ -197,3 +200,30 @@ bool parse_cmdargs(cmdargs &cmd, int argc, char *argv[]) {
 
   return true;
 }
+
+bool parse_positive_int(const std::string &text, int &value) {
+  if (text.empty() || !std::isdigit(static_cast<unsigned char>(text[0]))) {
+    return false;
+  }
+  char *end;
+  errno = 0;
+  long parsed = std::strtol(text.c_str(), &end, 10);
+  if (*end != '\0' || errno == ERANGE || parsed <= 0 || parsed > INT_MAX) {
+    return false;
+  }
+  value = parsed;
+  return true;
+}
+
+bool parse_positive_number(const std::string &text, double &value) {
+  if (text.empty() ||
+      !(std::isdigit(static_cast<unsigned char>(text[0])) || text[0] == '.')) {
+    return false;
+  }
+  char *end;
+  errno = 0;
+  double parsed = std::strtod(text.c_str(), &end);
+  if (*end != '\0' || errno == ERANGE || !(parsed > 0)) return false;
+  value = parsed;
+  return true;
+}
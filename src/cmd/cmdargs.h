@@ -45,4 +45,8 @@ public:
 
 bool parse_cmdargs(cmdargs &cmd, int argc, char *argv[]);
 
+// parse the value of a numeric option, false unless it is a positive number
+bool parse_positive_int(const std::string &text, int &value);
+bool parse_positive_number(const std::string &text, double &value);
+
 #endif /* AUTOLAB_CMDARGS_H_ */
\ No newline at end of file
@@ -1,10 +1,15 @@
+#include <unistd.h> // isatty
+
+#include <cctype>
 #include <cmath>
 #include <ctime>
 
 #include <algorithm>
 #include <chrono>
+#include <future>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <thread> // sleep_for
@@ -15,8 +20,10 @@
 #include "logger.h"
 
 #include "../app_credentials.h"
+#include "../archive/tar_gz_stream.h"
 #include "../cache/cache.h"
 #include "../context_manager/context_manager.h"
+#include "../crypto/sha256.h"
 #include "../file/file_utils.h"
 #include "../pretty_print/pretty_print.h"
 
@@ -28,8 +35,10 @@ Autolab::Client client(server_domain, client_id, client_secret, redirect_uri, st
 
 bool init_autolab_client() {
   std::string at, rt;
-  if (!load_tokens(at, rt)) return false;
-  client.set_tokens(at, rt);
+  std::time_t expires_at;
+  if (!load_tokens(at, rt, expires_at)) return false;
+  client.set_tokens(at, rt, expires_at);
+  client.set_token_lock_callbacks(lock_tokens, unlock_tokens);
   return true;
 }
 
@@ -77,6 +86,15 @@ void parse_course_and_asmt(std::string raw_input, std::string &course, std::stri
   asmt = raw_input.substr(split_pos + 1, std::string::npos);
 }
 
+/* waits until every one of fetches is done, then rethrows the first error
+ * if any. Nothing the fetches write into is touched after this returns,
+ * even if one of them fails early.
+ */
+void wait_for_all(std::vector<std::future<void>> &fetches) {
+  for (auto &f : fetches) f.wait();
+  for (auto &f : fetches) f.get();
+}
+
 /* if the supplied names are empty, it assigns them the values from the autolab asmt file.
  * if the context file doesn't exist, it reports an error and exits.
  * If the user does specify names and they don't match, it reports an error and exits.
@@ -207,6 +225,136 @@ int show_status(cmdargs &cmd) {
   return 0;
 }
 
+// reports where an attachment of an assessment went, e.g. for "Handout"
+void print_attachment(const std::string &title, const Autolab::Attachment &attachment) {
+  std::string name(title);
+  std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+  switch (attachment.format) {
+    case Autolab::AttachmentFormat::none:
+      Logger::info << "Assessment has no " << name << Logger::endl;
+      break;
+    case Autolab::AttachmentFormat::url:
+      Logger::info << title << " URL: " << attachment.url << Logger::endl;
+      break;
+    case Autolab::AttachmentFormat::file:
+      Logger::info << title << " downloaded into assessment directory" << Logger::endl;
+      break;
+  }
+}
+
+// an assessment being downloaded into a directory of its own
+struct asmt_download {
+  std::string course_name;
+  std::string asmt_name;
+  std::string dir;
+  bool resuming;
+  Autolab::DetailedAssessment dasmt;
+  Autolab::Attachment handout, writeup;
+  std::future<void> details_done, handout_done, writeup_done;
+};
+
+/* sets up the directory of the download, unless a directory of the same name
+ * is in the way. Returns false in that case.
+ */
+bool prepare_asmt_dir(asmt_download &d) {
+  d.dir = get_curr_dir();
+  d.dir.append("/" + d.asmt_name);
+  bool dir_exists = dir_find(get_curr_dir(), d.asmt_name.c_str(), true);
+  // unless it holds a download that broke off, which is picked up again
+  d.resuming = dir_exists &&
+    (file_exists((d.dir + "/.handout.part").c_str()) ||
+     file_exists((d.dir + "/.writeup.part").c_str()));
+  if (dir_exists && !d.resuming) return false;
+
+  if (!d.resuming) create_dir(d.dir.c_str());
+  return true;
+}
+
+/* the details (which make sure the assessment exists) and the attachments
+ * are fetched at the same time, and reported in order once all are in
+ */
+void start_asmt_download(asmt_download &d) {
+  d.details_done = client.get_assessment_details_async(d.dasmt,
+    d.course_name, d.asmt_name);
+  d.handout_done = client.download_handout_async(d.handout, d.dir,
+    d.course_name, d.asmt_name);
+  d.writeup_done = client.download_writeup_async(d.writeup, d.dir,
+    d.course_name, d.asmt_name);
+}
+
+void finish_asmt_download(asmt_download &d) {
+  d.handout_done.wait();
+  d.writeup_done.wait();
+  try {
+    d.details_done.get();
+  } catch (...) {
+    // nothing is downloaded for an assessment that does not exist
+    if (!d.resuming) remove_empty_dir(d.dir.c_str());
+    throw;
+  }
+
+  Logger::info << (d.resuming ? "Resuming download into " : "Created directory ")
+    << d.dir << Logger::endl;
+  d.handout_done.get();
+  print_attachment("Handout", d.handout);
+  d.writeup_done.get();
+  print_attachment("Writeup", d.writeup);
+
+  // write assessment file
+  write_asmt_file(d.dir, d.course_name, d.asmt_name);
+
+  // additional info
+  Logger::info << Logger::endl << "Due: " << std::ctime(&d.dasmt.asmt.due_at);
+}
+
+/* downloads every assessment of a course, at most jobs of them at once.
+ * Assessments whose directory is in the way or that fail are reported and
+ * skipped.
+ */
+void download_course(const std::string &course_name, std::size_t jobs) {
+  std::vector<Autolab::Assessment> asmts;
+  client.get_assessments(asmts, course_name);
+  std::sort(asmts.begin(), asmts.end(), Autolab::Utility::compare_assessments_by_name);
+
+  std::vector<asmt_download> downloads;
+  downloads.reserve(asmts.size());
+  for (auto &a : asmts) {
+    asmt_download d;
+    d.course_name = course_name;
+    d.asmt_name = a.name;
+    if (!prepare_asmt_dir(d)) {
+      Logger::info << "Skipping '" << a.name << "': directory already exists"
+        << Logger::endl;
+      continue;
+    }
+    downloads.push_back(std::move(d));
+  }
+
+  // a window of jobs downloads is in progress, each one started as soon as
+  // the oldest one is reported
+  std::size_t started = 0;
+  for (; started < downloads.size() && started < jobs; started++) {
+    start_asmt_download(downloads[started]);
+  }
+  int failed = 0;
+  for (std::size_t i = 0; i < downloads.size(); i++) {
+    Logger::info << Logger::endl << "[" << downloads[i].asmt_name << "]" << Logger::endl;
+    try {
+      finish_asmt_download(downloads[i]);
+    } catch (std::exception &e) {
+      Logger::info << "Failed: " << e.what() << Logger::endl;
+      failed++;
+    }
+    if (started < downloads.size()) {
+      start_asmt_download(downloads[started++]);
+    }
+  }
+
+  Logger::info << Logger::endl << "Downloaded " << (downloads.size() - failed)
+    << " of " << asmts.size() << " assessments of '" << course_name << "'"
+    << Logger::endl;
+}
+
 /* download assessment into a new directory
  */
 int download_asmt(cmdargs &cmd) {
@@ -215,75 +363,138 @@ int download_asmt(cmdargs &cmd) {
       "and the handout are downloaded into the directory if they are files. "
       "The assessment directory is also setup with a local config so that "
       "running certain commands inside it works without the need to specify "
-      "the names of the course and assessment.");
+      "the names of the course and assessment. Use '*' as the assessment name "
+      "(quoted, e.g. 'course:*') to set up a directory for every assessment "
+      "of the course.");
   cmd.new_arg("course_name:assessment_name", true);
+  std::string option_jobs = cmd.new_option("-j", "--jobs", "num",
+    "How many assessments of a course are downloaded at once (default 4)");
   cmd.setup_done();
 
   // parse course and assessment name
   std::string course_name, asmt_name;
   parse_course_and_asmt(cmd.args[2], course_name, asmt_name);
 
+  if (asmt_name == "*") {
+    int jobs = 4;
+    if (option_jobs.length() > 0 && !parse_positive_int(option_jobs, jobs)) {
+      Logger::fatal << "Invalid number of jobs: " << option_jobs << Logger::endl
+        << "Expected a positive number." << Logger::endl;
+      return 0;
+    }
+    Logger::info << "Querying assessments of course '" << course_name << "' ..."
+      << Logger::endl;
+    download_course(course_name, jobs);
+    return 0;
+  }
+
   Logger::info << "Querying assessment '" << asmt_name << "' of course '" <<
     course_name << "' ..." << Logger::endl;
 
-  // make sure assessment exists
-  Autolab::DetailedAssessment dasmt;
-  client.get_assessment_details(dasmt, course_name, asmt_name);
-
-  // setup directory
-  bool dir_exists = dir_find(get_curr_dir(), asmt_name.c_str(), true);
-  if (dir_exists) {
+  asmt_download d;
+  d.course_name = course_name;
+  d.asmt_name = asmt_name;
+  if (!prepare_asmt_dir(d)) {
     Logger::fatal << "Directory named '" << asmt_name << "' already exists. "
       << "Please delete or rename before proceeding." << Logger::endl;
     return 0;
   }
+  start_asmt_download(d);
+  finish_asmt_download(d);
 
-  std::string new_dir(get_curr_dir());
-  new_dir.append("/" + asmt_name);
-  Logger::info << "Creating directory " << new_dir << Logger::endl;
-
-  create_dir(new_dir.c_str());
+  return 0;
+}
 
-  // download files into directory
-  Autolab::Attachment handout, writeup;
-  client.download_handout(handout, new_dir, course_name, asmt_name);
-  switch (handout.format) {
-    case Autolab::AttachmentFormat::none:
-      Logger::info << "Assessment has no handout" << Logger::endl;
-      break;
-    case Autolab::AttachmentFormat::url:
-      Logger::info << "Handout URL: " << handout.url << Logger::endl;
-      break;
-    case Autolab::AttachmentFormat::file:
-      Logger::info << "Handout downloaded into assessment directory" << Logger::endl;
-      break;
+// percentage of the current upload last shown, -1 if none
+int upload_percent_shown = -1;
+
+// shows the progress of an upload, rewriting the same line
+void print_upload_progress(long long bytes_sent, long long bytes_total) {
+  std::ostringstream size;
+  size << std::fixed << std::setprecision(1);
+  if (bytes_total <= 0) {
+    // packed while it is uploaded, so there is no total yet
+    int tenths_of_mib = static_cast<int>(bytes_sent * 10 / 1048576);
+    if (tenths_of_mib == upload_percent_shown) return;
+    upload_percent_shown = tenths_of_mib;
+    size << tenths_of_mib / 10.0;
+    Logger::info << "\rUploading ... " << size.str() << " MiB";
+  } else {
+    int percent = static_cast<int>(bytes_sent * 100 / bytes_total);
+    if (percent == upload_percent_shown) return;
+    upload_percent_shown = percent;
+    size << bytes_total / 1048576.0;
+    Logger::info << "\rUploading ... " << percent << "% of " << size.str() << " MiB";
   }
+  std::cout.flush();
+}
 
-  client.download_writeup(writeup, new_dir, course_name, asmt_name);
-  switch (writeup.format) {
-    case Autolab::AttachmentFormat::none:
-      Logger::info << "Assessment has no writeup" << Logger::endl;
-      break;
-    case Autolab::AttachmentFormat::url:
-      Logger::info << "Writeup URL: " << writeup.url << Logger::endl;
-      break;
-    case Autolab::AttachmentFormat::file:
-      Logger::info << "Writeup downloaded into assessment directory" << Logger::endl;
-      break;
+// name of the archive a directory is submitted as, after the directory
+std::string archive_name_for(const std::string &dirname) {
+  std::string name = dirname;
+  name.erase(name.find_last_not_of('/') + 1);
+  if (name.empty() || name == ".") {
+    name = get_curr_dir();
+    name.erase(name.find_last_not_of('/') + 1);
   }
+  std::string::size_type slash = name.rfind('/');
+  if (slash != std::string::npos) name = name.substr(slash + 1);
+  if (name.empty()) name = "handin";
+  return name + ".tar.gz";
+}
 
-  // write assessment file
-  write_asmt_file(new_dir, course_name, asmt_name);
+// how waiting for the scores of a submission ended
+enum class scores_wait { ready, timed_out, missing };
 
-  // additional info
-  Logger::info << Logger::endl << "Due: " << std::ctime(&dasmt.asmt.due_at);
+/* waits for at least some scores of version to be available, and puts its
+ * submission in sub. Doesn't wait for all scores because the autograder may
+ * not assign scores to all problems. Polls quickly at first, since small jobs
+ * are graded within seconds, then backs off. Only a changed list of
+ * submissions is downloaded, and a server that supports long polls holds
+ * each poll until the list changes.
+ */
+scores_wait wait_for_scores(Autolab::Submission &sub,
+  const std::string &course_name, const std::string &asmt_name, int version)
+{
+  const std::chrono::seconds timeout(300); // 5 minutes
+  const std::chrono::seconds long_poll(30);
+  const std::chrono::milliseconds max_interval(15000);
+  std::chrono::milliseconds interval(1000);
+  auto t_end = std::chrono::steady_clock::now() + timeout;
 
-  return 0;
+  std::vector<Autolab::Submission> subs;
+  std::string etag;
+  while (true) {
+    auto t_poll = std::chrono::steady_clock::now();
+    if (t_poll >= t_end) return scores_wait::timed_out;
+    std::chrono::seconds wait = std::min(long_poll,
+      std::chrono::duration_cast<std::chrono::seconds>(t_end - t_poll));
+
+    if (client.poll_submissions(subs, course_name, asmt_name, etag, wait)) {
+      auto target = std::find_if(subs.begin(), subs.end(),
+        [version](const Autolab::Submission &s) { return s.version == version; });
+      if (target == subs.end()) return scores_wait::missing;
+
+      for (auto &score : target->scores) {
+        if (!std::isnan(score.second)) {
+          sub = *target;
+          return scores_wait::ready;
+        }
+      }
+    }
+
+    // a held poll has waited long enough already
+    auto elapsed = std::chrono::steady_clock::now() - t_poll;
+    if (elapsed < interval) std::this_thread::sleep_for(interval - elapsed);
+    interval = std::min(interval * 3 / 2, max_interval);
+  }
 }
 
 /* two ways of calling:
  *   1. autolab submit <filename>                  (must have autolab-asmt file)
  *   2. autolab submit <course>:<asmt> <filename>  (from anywhere)
+ * If filename is a directory, it is submitted as a tar.gz archive of its
+ * contents, packed while it is uploaded.
  */
 int submit_asmt(cmdargs &cmd) {
   cmd.setup_help("autolab submit",
@@ -291,15 +502,28 @@ int submit_asmt(cmdargs &cmd) {
       "needed if the current directory or its ancestor directories include an "
       "assessment config file. The operation fails if the specified names and "
       "the config file do not match, unless the '-f' option is used, in which "
-      "case the assessment config file is ignored.");
+      "case the assessment config file is ignored. A directory is submitted "
+      "as a tar.gz archive of its contents.");
   cmd.new_arg("course_name:assessment_name", false);
   cmd.new_arg("filename", true);
   bool option_force = cmd.new_flag_option("-f","--force", "Force use the "
     "specified course:assessment pair, overriding the local config");
   bool option_wait = cmd.new_flag_option("-w","--wait", "Wait until the "
     "autograder is finished, then display the scores for this submission");
+  std::string option_limit_rate = cmd.new_option("--limit-rate", "", "KiB/s",
+    "Upload the file at most this fast");
+  bool option_resubmit = cmd.new_flag_option("--resubmit", "", "Submit even "
+    "if the same contents were submitted from this directory before");
   cmd.setup_done();
 
+  int limit_rate = 0;
+  if (option_limit_rate.length() > 0 &&
+      !parse_positive_int(option_limit_rate, limit_rate)) {
+    Logger::fatal << "Invalid upload rate: " << option_limit_rate << Logger::endl
+      << "Expected a whole number of KiB/s, at least 1." << Logger::endl;
+    return 0;
+  }
+
   std::string course_name, asmt_name, filename;
 
   if (cmd.nargs() >= 4) {
@@ -320,11 +544,55 @@ int submit_asmt(cmdargs &cmd) {
     check_names_with_asmt_file(course_name, asmt_name);
   }
 
-  if (!file_exists(filename.c_str())) {
+  bool submit_dir = dir_exists(filename.c_str());
+  if (!submit_dir && !file_exists(filename.c_str())) {
     Logger::fatal << "File not found: " << filename << Logger::endl;
     return 0;
   }
 
+  // hashed before anything is sent, so that a resubmission can be skipped.
+  // A directory is packed for that, so only when the ledger may skip it;
+  // otherwise its digest is taken while it is packed for the upload.
+  bool has_ledger = has_submission_ledger();
+  bool check_ledger = has_ledger && !option_resubmit;
+  std::unique_ptr<TarGzStream> archive;
+  const char *data = nullptr;
+  size_t length = 0;
+  std::string digest;
+  if (submit_dir) {
+    archive.reset(new TarGzStream(filename,
+      {".autolab-asmt", ".autolab-submissions"}));
+    if (check_ledger) {
+      digest = archive->content_digest();
+      if (digest.empty()) {
+        Logger::fatal << "Failed to pack " << filename << ": " << archive->error() << Logger::endl;
+        return 0;
+      }
+    }
+  } else {
+    // the same mapping is hashed and then uploaded
+    data = map_file(filename.c_str(), length);
+    if (has_ledger) {
+      Sha256 hash;
+      hash.update(data, length);
+      digest = hash.hex_digest();
+    }
+  }
+
+  submission_record previous;
+  if (check_ledger &&
+      find_submission(course_name, asmt_name, digest, previous)) {
+    unmap_file(data, length);
+    char submitted_at[32];
+    std::strftime(submitted_at, sizeof(submitted_at), "%Y-%m-%d %H:%M",
+      std::localtime(&previous.submitted_at));
+    Logger::info << "The same contents were already submitted to " << course_name
+      << ":" << asmt_name << " as version " << previous.version << " on "
+      << submitted_at << ", skipping." << Logger::endl
+      << "Use '--resubmit' to submit them again." << Logger::endl;
+    return 0;
+  }
+
   Logger::info << "Submitting to " << course_name << ":" << asmt_name << " ...";
   if (option_force) {
     Logger::info << " (force)" << Logger::endl;
@@ -332,60 +600,82 @@ int submit_asmt(cmdargs &cmd) {
     Logger::info << Logger::endl;
   }
 
+  if (limit_rate > 0) {
+    client.set_max_upload_speed(static_cast<long long>(limit_rate) * 1024);
+  }
+  if (isatty(STDOUT_FILENO)) {
+    client.set_upload_progress_callback(print_upload_progress);
+  }
+
   // conflicts resolved, use course_name and asmt_name from now on
-  int version = client.submit_assessment(course_name, asmt_name, filename);
+  int version;
+  if (submit_dir) {
+    try {
+      version = client.submit_assessment(course_name, asmt_name,
+        archive_name_for(filename), *archive);
+    } catch (Autolab::HttpException &e) {
+      if (upload_percent_shown >= 0) Logger::info << Logger::endl;
+      std::string packing_error = archive->error();
+      if (packing_error.length() > 0) {
+        Logger::fatal << "Failed to pack " << filename << ": " << packing_error << Logger::endl;
+        return 0;
+      }
+      throw;
+    }
+    // what was actually sent, in case the files changed in the meantime
+    std::string packed_digest = archive->packed_digest();
+    if (packed_digest.length() > 0) digest = packed_digest;
+  } else {
+    try {
+      version = client.submit_assessment(course_name, asmt_name, filename,
+        data, length);
+    } catch (...) {
+      unmap_file(data, length);
+      throw;
+    }
+    unmap_file(data, length);
+  }
+  if (upload_percent_shown >= 0) Logger::info << Logger::endl;
+
+  if (has_ledger && digest.length() > 0) {
+    submission_record record;
+    record.digest = digest;
+    record.course_name = course_name;
+    record.asmt_name = asmt_name;
+    record.version = version;
+    record.submitted_at = std::time(nullptr);
+    record.filename = filename;
+    record_submission(record);
+  }
 
   Logger::info << Logger::GREEN << "Successfully submitted to Autolab (version " << version << ")" << Logger::NONE << Logger::endl;
 
   if (option_wait) {
     Logger::info << Logger::endl
       << "Waiting for scores to be ready ..." << Logger::endl;
-    // wait for at least some scores to be available.
-    // Don't wait for all scores because the autograder may not assign scores
-    // to all problems
-    bool scores_ready = false;
-    std::chrono::seconds timeout(300); // 5 minutes
-    std::chrono::seconds wait_per_trial(5);
-    auto t_now = std::chrono::steady_clock::now();
-    auto t_end = t_now + timeout;
-    int target_sub_idx = -1;
-    std::vector<Autolab::Submission> subs;
-    while (t_now < t_end && !scores_ready) {
-      subs.clear();
-      client.get_submissions(subs, course_name, asmt_name);
-
-      target_sub_idx = -1;
-      for (std::size_t i = 0; i < subs.size(); i++) {
-        if (subs[i].version == version) {
-          // this is our version
-          target_sub_idx = i;
-          break;
-        }
-      }
-      if (target_sub_idx < 0) {
-        Logger::fatal << "Failed to get scores for this current submission."
-          << Logger::endl;
-        return -1;
-      }
-
-      for (auto &score : subs[target_sub_idx].scores) {
-        if (!std::isnan(score.second)) {
-          scores_ready = true;
-          break;
-        }
-      }
-      if (scores_ready) break;
-
-      std::this_thread::sleep_for(wait_per_trial);
-      t_now = std::chrono::steady_clock::now();
+    // the problems are needed once the scores are in, fetch them meanwhile
+    std::vector<Autolab::Problem> problems;
+    std::future<void> problems_done =
+      client.get_problems_async(problems, course_name, asmt_name);
+    Autolab::Submission sub;
+    scores_wait result;
+    try {
+      result = wait_for_scores(sub, course_name, asmt_name, version);
+    } catch (...) {
+      problems_done.wait();
+      throw;
+    }
+    problems_done.wait();
+    if (result == scores_wait::missing) {
+      Logger::fatal << "Failed to get scores for this current submission."
+        << Logger::endl;
+      return -1;
     }
 
-    if (scores_ready) {
+    if (result == scores_wait::ready) {
       // found scores
-      std::vector<Autolab::Submission> one_sub = { subs[target_sub_idx] };
-      // get problem names
-      std::vector<Autolab::Problem> problems;
-      client.get_problems(problems, course_name, asmt_name);
+      std::vector<Autolab::Submission> one_sub = { sub };
+      problems_done.get();
       // draw the table
       std::vector<std::vector<std::string>> sub_table;
       create_scores_table(sub_table, problems, one_sub, 1);
@@ -406,17 +696,32 @@ int submit_asmt(cmdargs &cmd) {
 int show_courses(cmdargs &cmd) {
   cmd.setup_help("autolab courses",
       "List all current courses of the user.");
+  bool option_cached = cmd.new_flag_option("-c", "--cached",
+    "Use the courses cached by an earlier listing, if any");
   cmd.setup_done();
 
-  // hidden option --use-cache
-  if (cmd.has_option("-u", "--use-cache")) {
-    print_course_cache_entry();
+  // hidden option --use-cache, for shell completion: lists the bare names of
+  // the cached courses, or nothing without a cache, and never goes online
+  bool use_cache = cmd.has_option("-u", "--use-cache");
+  std::vector<Autolab::Course> courses;
+  std::time_t fetched_at;
+  if ((use_cache || option_cached) &&
+      find_course_cache_entry(courses, fetched_at)) {
+    LogDebug("Using courses cached at " << std::ctime(&fetched_at));
+  } else if (use_cache) {
+    return 0;
+  } else {
+    client.get_courses(courses);
+    LogDebug("Found " << courses.size() << " current courses." << Logger::endl);
+    // save to cache as well
+    update_course_cache_entry(courses);
+  }
+  if (use_cache) {
+    for (auto &c : courses) {
+      Logger::info << "  " << c.name << " (" << c.display_name << ")" << Logger::endl;
+    }
     return 0;
   }
-
-  std::vector<Autolab::Course> courses;
-  client.get_courses(courses);
-  LogDebug("Found " << courses.size() << " current courses." << Logger::endl);
 
   std::string course_name_config, asmt_name_config;
   read_asmt_file(course_name_config, asmt_name_config);
@@ -437,9 +742,6 @@ int show_courses(cmdargs &cmd) {
     }
   }
 
-  // save to cache as well
-  update_course_cache_entry(courses);
-
   return 0;
 }
 
@@ -564,26 +866,40 @@ int show_assessments(cmdargs &cmd) {
   cmd.setup_help("autolab assessments",
       "List all available assessments of a course.");
   cmd.new_arg("course_name", true);
+  bool option_cached = cmd.new_flag_option("-c", "--cached",
+    "Use the assessments cached by an earlier listing, if any");
   cmd.setup_done();
 
   std::string course_name(cmd.args[2]);
 
-  // hidden option --use-cache
-  if (cmd.has_option("-u", "--use-cache")) {
-    print_asmt_cache_entry(course_name);
+  // hidden option --use-cache, see show_courses
+  bool use_cache = cmd.has_option("-u", "--use-cache");
+  std::vector<Autolab::Assessment> asmts;
+  std::time_t fetched_at;
+  if ((use_cache || option_cached) &&
+      find_asmt_cache_entry(course_name, asmts, fetched_at)) {
+    LogDebug("Using assessments cached at " << std::ctime(&fetched_at));
+  } else if (use_cache) {
+    return 0;
+  } else {
+    client.get_assessments(asmts, course_name);
+    LogDebug("Found " << asmts.size() << " assessments." << Logger::endl);
+    std::sort(asmts.begin(), asmts.end(), Autolab::Utility::compare_assessments_by_name);
+    // save to cache as well
+    update_asmt_cache_entry(course_name, asmts);
+  }
+  if (use_cache) {
+    for (auto &a : asmts) {
+      Logger::info << "  " << a.name << " (" << a.display_name << ")" << Logger::endl;
+    }
     return 0;
   }
-
-  std::vector<Autolab::Assessment> asmts;
-  client.get_assessments(asmts, course_name);
-  LogDebug("Found " << asmts.size() << " assessments." << Logger::endl);
 
   std::string course_name_config, asmt_name_config;
   read_asmt_file(course_name_config, asmt_name_config);
   bool is_curr_course = case_insensitive_str_equal(course_name, course_name_config);
   std::string asmt_name_config_lower = to_lowercase(asmt_name_config);
 
-  std::sort(asmts.begin(), asmts.end(), Autolab::Utility::compare_assessments_by_name);
   for (auto &a : asmts) {
     bool is_curr_asmt = is_curr_course && (asmt_name_config_lower == to_lowercase(a.name));
     if (is_curr_asmt) {
@@ -599,9 +915,6 @@ int show_assessments(cmdargs &cmd) {
     }
   }
 
-  // save to cache as well
-  update_asmt_cache_entry(course_name, asmts);
-
   return 0;
 }
 
@@ -660,12 +973,13 @@ int show_scores(cmdargs &cmd) {
     }
   }
 
+  // the problems and the submissions are fetched at the same time
   std::vector<Autolab::Problem> problems;
-  client.get_problems(problems, course_name, asmt_name);
-
-  // get submissions
   std::vector<Autolab::Submission> subs;
-  client.get_submissions(subs, course_name, asmt_name);
+  std::vector<std::future<void>> fetches;
+  fetches.push_back(client.get_problems_async(problems, course_name, asmt_name));
+  fetches.push_back(client.get_submissions_async(subs, course_name, asmt_name));
+  wait_for_all(fetches);
   LogDebug("Found " << subs.size() << " submissions." << Logger::endl);
 
   Logger::info << "Scores for " << course_name << ":" << asmt_name << Logger::endl
@@ -683,17 +997,63 @@ int show_scores(cmdargs &cmd) {
   return 0;
 }
 
+/* one piece of feedback that show_feedback fetches */
+struct feedback_request {
+  int version;
+  std::string problem;
+  std::string feedback;
+  bool cached;
+  std::future<void> done;
+
+  feedback_request() : version(0), cached(false) {}
+};
+
+// whether problem of version has a score in subs, so that its feedback is
+// final. Other problems of the same version may still be pending.
+bool problem_graded(const std::vector<Autolab::Submission> &subs, int version,
+  const std::string &problem)
+{
+  for (auto &sub : subs) {
+    if (sub.version != version) continue;
+    auto score = sub.scores.find(problem);
+    return score != sub.scores.end() && !std::isnan(score->second);
+  }
+  return false;
+}
+
+// shows the feedback of r once it is in, and caches it if it is final
+void finish_feedback_request(feedback_request &r, const std::string &course_name,
+  const std::string &asmt_name, const std::vector<Autolab::Submission> &subs)
+{
+  if (!r.cached) {
+    r.done.get();
+    if (problem_graded(subs, r.version, r.problem)) {
+      update_feedback_cache_entry(course_name, asmt_name, r.version, r.problem,
+        r.feedback);
+    }
+  }
+  Logger::info << r.feedback << Logger::endl;
+}
+
+// most versions a single feedback command shows, each costs a request per
+// problem
+const int max_feedback_versions = 100;
+
 int show_feedback(cmdargs &cmd) {
   cmd.setup_help("autolab feedback",
       "Gets feedback for a problem of an assessment. If version number is not "
       "given, the latest version will be used. If problem_name is not given, "
-      "the first problem will be used. Course and assessment names are "
-      "optional if inside an autolab assessment directory.");
+      "the first problem will be used, or every problem with '-a'. A range of "
+      "versions such as '2-5' gets the feedback of each of them. Course and "
+      "assessment names are optional if inside an autolab assessment "
+      "directory.");
   cmd.new_arg("course_name:assessment_name", false);
   std::string option_problem = cmd.new_option("-p", "--problem","problem_name",
       "Get feedback for this problem");
   std::string option_version = cmd.new_option("-v", "--version","version_num",
-      "Get feedback for this particular version");
+      "Get feedback for this particular version, or range of versions");
+  bool option_all_problems = cmd.new_flag_option("-a", "--all-problems",
+      "Get feedback for every problem");
   cmd.setup_done();
 
   std::string course_name, asmt_name;
@@ -707,41 +1067,125 @@ int show_feedback(cmdargs &cmd) {
     }
   }
 
-  // determine version number
-  int version = -1;
+  if (option_all_problems && option_problem.length() > 0) {
+    Logger::fatal << "The '-a' and '-p' options cannot be used together." << Logger::endl;
+    return 0;
+  }
+
+  // a given version or range of versions, checked before any request
+  int first_version = 0, last_version = 0;
+  if (option_version.length() > 0) {
+    std::string::size_type dash = option_version.find('-', 1);
+    bool valid = parse_positive_int(option_version.substr(0, dash), first_version);
+    if (dash == std::string::npos) {
+      last_version = first_version;
+    } else {
+      valid = valid &&
+        parse_positive_int(option_version.substr(dash + 1), last_version);
+    }
+    if (!valid || last_version < first_version) {
+      Logger::fatal << "Invalid version or range of versions: " << option_version
+        << Logger::endl << "Expected a version number such as '3' or a range "
+        << "such as '2-5'." << Logger::endl;
+      return 0;
+    }
+    if (last_version - first_version >= max_feedback_versions) {
+      Logger::fatal << "Too many versions in " << option_version
+        << ", at most " << max_feedback_versions << " can be shown at once."
+        << Logger::endl;
+      return 0;
+    }
+  }
+
+  // the latest version and the problems are looked up at the same time
+  // if they are needed
+  std::vector<Autolab::Submission> subs;
+  std::vector<Autolab::Problem> problems;
+  std::vector<std::future<void>> fetches;
   if (option_version.length() == 0) {
-    // use latest version
-    std::vector<Autolab::Submission> subs;
-    client.get_submissions(subs, course_name, asmt_name);
+    fetches.push_back(client.get_submissions_async(subs, course_name, asmt_name));
+  }
+  if (option_problem.length() == 0) {
+    fetches.push_back(client.get_problems_async(problems, course_name, asmt_name));
+  }
+  wait_for_all(fetches);
 
+  // use latest version unless one was given
+  if (option_version.length() == 0) {
     if (subs.size() == 0) {
       Logger::fatal << "No submissions available for this assessment." << Logger::endl;
       return 0;
     }
 
-    version = subs[0].version;
-  } else {
-    version = std::stoi(option_version);
+    first_version = last_version = subs[0].version;
   }
 
-  // determine problem name
-  if (option_problem.length() == 0) {
-    // use first problem
-    std::vector<Autolab::Problem> problems;
-    client.get_problems(problems, course_name, asmt_name);
-
+  // determine problem names
+  std::vector<std::string> problem_names;
+  if (option_problem.length() > 0) {
+    problem_names.push_back(option_problem);
+  } else {
     if (problems.size() == 0) {
       Logger::fatal << "This assessment has no problems." << Logger::endl;
       return 0;
     }
 
-    option_problem = problems[0].name;
+    if (option_all_problems) {
+      for (auto &p : problems) problem_names.push_back(p.name);
+    } else {
+      // use first problem
+      problem_names.push_back(problems[0].name);
+    }
+  }
+  LogDebug("Getting feedback for " << problem_names.size() << " problems"
+    << Logger::endl);
+
+  // the feedback of graded versions is cached. Whatever is not is requested
+  // all at once, and each one is shown as soon as it and the ones before it
+  // are in.
+  std::vector<feedback_request> requests(
+    (last_version - first_version + 1) * problem_names.size());
+  std::size_t next = 0;
+  bool all_cached = true;
+  for (int version = first_version; version <= last_version; version++) {
+    for (auto &name : problem_names) {
+      feedback_request &r = requests[next++];
+      r.version = version;
+      r.problem = name;
+      r.cached = find_feedback_cache_entry(course_name, asmt_name, version,
+        name, r.feedback);
+      if (r.cached) continue;
+      all_cached = false;
+      r.done = client.get_feedback_async(r.feedback, course_name, asmt_name,
+        version, name);
+    }
+  }
+  // which versions are graded is only known from the submissions
+  std::vector<std::future<void>> subs_fetch;
+  if (!all_cached && option_version.length() > 0) {
+    subs_fetch.push_back(client.get_submissions_async(subs, course_name, asmt_name));
+  }
+  try {
+    wait_for_all(subs_fetch);
+  } catch (std::exception &e) {
+    // nothing is cached then
+    LogDebug("Cannot tell which versions are graded: " << e.what() << Logger::endl);
+    subs.clear();
   }
-  LogDebug("Using problem name: " << option_problem << Logger::endl);
 
-  std::string feedback;
-  client.get_feedback(feedback, course_name, asmt_name, version, option_problem);
+  if (requests.size() == 1) {
+    finish_feedback_request(requests[0], course_name, asmt_name, subs);
+    return 0;
+  }
 
-  Logger::info << feedback << Logger::endl;
+  for (auto &r : requests) {
+    Logger::info << Logger::CYAN << "==> version " << r.version << ", "
+      << r.problem << Logger::NONE << Logger::endl;
+    try {
+      finish_feedback_request(r, course_name, asmt_name, subs);
+    } catch (std::exception &e) {
+      Logger::info << "Failed to get feedback: " << e.what() << Logger::endl;
+    }
+  }
   return 0;
 }
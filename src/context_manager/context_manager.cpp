@@ -1,5 +1,18 @@
 #include "context_manager.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
 #include "../app_credentials.h"
 #include "../file/file_utils.h"
 #include "autolab/autolab.h"
@@ -9,14 +22,24 @@
 #define TOKEN_CACHE_FILE_MAXSIZE 256
 
 const std::string token_cache_filename = ".arcache";
+const std::string token_lock_filename = ".arcache.lock";
+// long enough for another process to finish a refresh
+const std::chrono::seconds token_lock_timeout(10);
+const std::chrono::milliseconds token_lock_poll_interval(50);
 const std::string cred_dirname = ".autolab";
 
-std::string token_pair_to_string(std::string at, std::string rt) {
-  std::string pre_crypt = at + "\n" + rt;
+// the expiry goes on a third line, which older versions ignore
+std::string token_pair_to_string(std::string at, std::string rt,
+  std::time_t expires_at)
+{
+  std::string pre_crypt = at + "\n" + rt + "\n" +
+    std::to_string(static_cast<long long>(expires_at));
   return encrypt_string(pre_crypt, crypto_key, crypto_iv);
 }
 
-bool token_pair_from_string(char *raw_src, size_t raw_len, std::string &at, std::string &rt) {
+bool token_pair_from_string(char *raw_src, size_t raw_len, std::string &at,
+  std::string &rt, std::time_t &expires_at)
+{
   std::string src = decrypt_string(raw_src, raw_len, crypto_key, crypto_iv);
 
   std::string::size_type split_pos_1 = src.find('\n');
@@ -25,6 +48,10 @@ bool token_pair_from_string(char *raw_src, size_t raw_len, std::string &at, std:
 
   at.assign(src, 0, split_pos_1);
   rt.assign(src, split_pos_1+1, split_pos_2 - split_pos_1 - 1);
+  expires_at = 0;
+  if (split_pos_2 != std::string::npos) {
+    expires_at = std::strtoll(src.c_str() + split_pos_2 + 1, nullptr, 10);
+  }
   return true;
 }
 
@@ -69,13 +96,19 @@ bool token_cache_file_exists() {
 }
 
 /* interface */
-void store_tokens(std::string at, std::string rt) {
+void store_tokens(std::string at, std::string rt, std::time_t expires_at) {
   check_and_create_token_directory();
   try {
-      std::string token_pair = token_pair_to_string(at, rt);
+      std::string token_pair = token_pair_to_string(at, rt, expires_at);
 
-      write_file(get_token_cache_file_full_path().c_str(),
-                 token_pair.c_str(), token_pair.length());
+      // replaced in one step, so other processes never read half a file
+      std::string filename = get_token_cache_file_full_path();
+      std::string temp_filename = filename + "." + std::to_string(getpid());
+      write_file(temp_filename.c_str(), token_pair.c_str(), token_pair.length());
+      if (rename(temp_filename.c_str(), filename.c_str()) != 0) {
+        remove(temp_filename.c_str());
+        write_file(filename.c_str(), token_pair.c_str(), token_pair.length());
+      }
   } catch (Autolab::CryptoException &e) {
     Logger::fatal << "OpenSSL error in store_tokens." << Logger::endl;
     Logger::fatal << e.what() << Logger::endl;
@@ -86,7 +119,7 @@ void store_tokens(std::string at, std::string rt) {
 
 // returns true if got token, false if failed to get token.
 // Failure likely because token cache file doesn't exist.
-bool load_tokens(std::string &at, std::string &rt) {
+bool load_tokens(std::string &at, std::string &rt, std::time_t &expires_at) {
   if (!check_and_create_token_directory()) return false;
   if (!token_cache_file_exists()) return false;
 
@@ -96,7 +129,7 @@ bool load_tokens(std::string &at, std::string &rt) {
   LogDebug("read size " << num_read << "\n");
 
   try {
-    if (!token_pair_from_string(raw_result, num_read, at, rt)) return false;
+    if (!token_pair_from_string(raw_result, num_read, at, rt, expires_at)) return false;
   } catch (Autolab::CryptoException &e) {
     LogDebug("OpenSSL error in load_tokens." << Logger::endl);
     LogDebug(e.what() << Logger::endl);
@@ -108,6 +141,46 @@ bool load_tokens(std::string &at, std::string &rt) {
   return true;
 }
 
+int token_lock_fd = -1;
+
+bool lock_tokens(std::string &at, std::string &rt, std::time_t &expires_at) {
+  check_and_create_token_directory();
+  std::string lock_filename = get_cred_dir_full_path() + "/" + token_lock_filename;
+  int fd = open(lock_filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    // whoever holds the tokens may have replaced them anyway
+    if (!load_tokens(at, rt, expires_at)) at.clear();
+    return false;
+  }
+
+  // polled rather than blocking, so that a stuck process cannot hang us
+  auto deadline = std::chrono::steady_clock::now() + token_lock_timeout;
+  while (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    if ((errno != EWOULDBLOCK && errno != EINTR) ||
+        std::chrono::steady_clock::now() >= deadline) {
+      LogDebug("[ContextManager] could not lock tokens" << Logger::endl);
+      close(fd);
+      // the holder of the lock has probably stored new tokens by now
+      if (!load_tokens(at, rt, expires_at)) at.clear();
+      return false;
+    }
+    std::this_thread::sleep_for(token_lock_poll_interval);
+  }
+  token_lock_fd = fd;
+  LogDebug("[ContextManager] tokens locked" << Logger::endl);
+
+  if (!load_tokens(at, rt, expires_at)) at.clear();
+  return true;
+}
+
+void unlock_tokens() {
+  if (token_lock_fd < 0) return;
+  flock(token_lock_fd, LOCK_UN);
+  close(token_lock_fd);
+  token_lock_fd = -1;
+  LogDebug("[ContextManager] tokens unlocked" << Logger::endl);
+}
+
 
 /************* asmt *************/
 #define ASMT_FILE_MAXSIZE 128
@@ -145,3 +218,70 @@ void write_asmt_file(std::string dir_name, std::string course_name, std::string
   std::string formatted_asmt = format_asmt_file(course_name, asmt_name);
   write_file(full_path.c_str(), formatted_asmt.c_str(), formatted_asmt.length());
 }
+
+
+/************* submission ledger *************/
+const std::string ledger_filename = ".autolab-submissions";
+
+// path of the ledger next to the asmt file, empty if there is no asmt file
+std::string get_ledger_full_path() {
+  char buffer[MAX_DIR_LENGTH];
+  if (!recur_find(buffer, get_curr_dir(), asmt_filename.c_str())) return "";
+
+  std::string path(buffer);
+  return path.substr(0, path.rfind('/') + 1) + ledger_filename;
+}
+
+bool has_submission_ledger() {
+  return !get_ledger_full_path().empty();
+}
+
+// one line per submission, fields separated by tabs
+bool find_submission(const std::string &course_name,
+  const std::string &asmt_name, const std::string &digest,
+  submission_record &record)
+{
+  std::string ledger_path = get_ledger_full_path();
+  if (ledger_path.empty()) return false;
+  std::ifstream ledger(ledger_path);
+
+  bool found = false;
+  std::string line;
+  while (std::getline(ledger, line)) {
+    std::istringstream fields(line);
+    submission_record entry;
+    std::string version, submitted_at;
+    std::getline(fields, entry.digest, '\t');
+    std::getline(fields, entry.course_name, '\t');
+    std::getline(fields, entry.asmt_name, '\t');
+    std::getline(fields, version, '\t');
+    std::getline(fields, submitted_at, '\t');
+    if (!std::getline(fields, entry.filename)) continue;
+
+    if (entry.digest == digest && entry.course_name == course_name &&
+        entry.asmt_name == asmt_name) {
+      entry.version = std::atoi(version.c_str());
+      entry.submitted_at = std::strtoll(submitted_at.c_str(), nullptr, 10);
+      record = entry;
+      found = true;
+    }
+  }
+  return found;
+}
+
+void record_submission(const submission_record &record) {
+  std::string ledger_path = get_ledger_full_path();
+  if (ledger_path.empty()) return;
+
+  std::string line = record.digest + "\t" + record.course_name + "\t" +
+    record.asmt_name + "\t" + std::to_string(record.version) + "\t" +
+    std::to_string(static_cast<long long>(record.submitted_at)) + "\t" +
+    record.filename + "\n";
+  // appended in a single write, so that concurrent submissions do not mix
+  int fd = open(ledger_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+    S_IRUSR | S_IWUSR);
+  if (fd < 0 || write(fd, line.c_str(), line.length()) != (ssize_t)line.length()) {
+    LogDebug("[ContextManager] cannot write " << ledger_path << Logger::endl);
+  }
+  if (fd >= 0) close(fd);
+}
@@ -8,19 +8,52 @@
 #ifndef AUTOLAB_CONTEXT_MANAGER_H_
 #define AUTOLAB_CONTEXT_MANAGER_H_
 
+#include <ctime>
+
 #include <string>
 
 std::string get_cred_dir_full_path();
 bool check_and_create_token_directory();
 
-// read tokens from file. If nonexistent, return false.
-bool load_tokens(std::string &at, std::string &rt);
+// read tokens from file. If nonexistent, return false. expires_at is 0 if
+// the file does not record when the access token expires.
+bool load_tokens(std::string &at, std::string &rt, std::time_t &expires_at);
 
 // store tokens to file.
-void store_tokens(std::string at, std::string rt);
+void store_tokens(std::string at, std::string rt, std::time_t expires_at);
+
+// lock the token file against refreshes by other processes, waiting a few
+// seconds at most, and read the tokens stored in it (at is empty if there
+// are none). Returns false if the lock could not be taken, but still reads
+// the tokens.
+bool lock_tokens(std::string &at, std::string &rt, std::time_t &expires_at);
+void unlock_tokens();
 
 bool read_asmt_file(std::string &course_name, std::string &asmt_name);
 void write_asmt_file(std::string filename, std::string course_name, std::string asmt_name);
 
+// a submission made from an assessment directory
+struct submission_record {
+  std::string digest; // SHA-256 of the submitted bytes
+  std::string course_name;
+  std::string asmt_name;
+  int version;
+  std::time_t submitted_at;
+  std::string filename;
+
+  submission_record() : version(0), submitted_at(0) {}
+};
+
+// The submission ledger lives next to the asmt file found from the current
+// directory upwards. Outside of an assessment directory there is none.
+// whether there is a ledger to look up and record submissions in
+bool has_submission_ledger();
+// finds the latest submission of digest to the assessment in the ledger.
+bool find_submission(const std::string &course_name,
+  const std::string &asmt_name, const std::string &digest,
+  submission_record &record);
+// adds a submission to the ledger
+void record_submission(const submission_record &record);
+
 
 #endif /* AUTOLAB_CONTEXT_MANAGER_H_ */
\ No newline at end of file
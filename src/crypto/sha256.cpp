@@ -0,0 +1,40 @@
+#include "sha256.h"
+
+#include <openssl/err.h>
+
+#include "autolab/autolab.h"
+
+static void raise_digest_error() {
+  throw Autolab::CryptoException(ERR_error_string(ERR_get_error(), nullptr));
+}
+
+Sha256::Sha256() {
+  ctx = EVP_MD_CTX_new();
+  if (!ctx) raise_digest_error();
+  if (1 != EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr)) {
+    EVP_MD_CTX_free(ctx);
+    raise_digest_error();
+  }
+}
+
+Sha256::~Sha256() {
+  EVP_MD_CTX_free(ctx);
+}
+
+void Sha256::update(const void *data, std::size_t length) {
+  if (1 != EVP_DigestUpdate(ctx, data, length)) raise_digest_error();
+}
+
+std::string Sha256::hex_digest() {
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_length = 0;
+  if (1 != EVP_DigestFinal_ex(ctx, digest, &digest_length)) raise_digest_error();
+
+  static const char hex[] = "0123456789abcdef";
+  std::string result;
+  for (unsigned int i = 0; i < digest_length; i++) {
+    result.push_back(hex[digest[i] >> 4]);
+    result.push_back(hex[digest[i] & 0xf]);
+  }
+  return result;
+}
@@ -0,0 +1,32 @@
+/*
+ * Incremental SHA-256 hashing, for recognizing contents that were seen
+ * before.
+ */
+
+#ifndef AUTOLAB_SHA256_H_
+#define AUTOLAB_SHA256_H_
+
+#include <cstddef>
+
+#include <string>
+
+#include <openssl/evp.h>
+
+class Sha256 {
+public:
+  // throws Autolab::CryptoException if OpenSSL fails
+  Sha256();
+  ~Sha256();
+
+  Sha256(const Sha256 &) = delete;
+  Sha256 &operator=(const Sha256 &) = delete;
+
+  void update(const void *data, std::size_t length);
+  // lowercase hex digest of everything passed to update. Ends the hash.
+  std::string hex_digest();
+
+private:
+  EVP_MD_CTX *ctx;
+};
+
+#endif /* AUTOLAB_SHA256_H_ */
@@ -6,8 +6,9 @@
 #include <pwd.h>      // getpwuid
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h> // mmap
 #include <sys/stat.h> // mkdir, stat
-#include <unistd.h>   // close, write
+#include <unistd.h>   // close, write, rmdir
 
 #include "logger.h"
 
@@ -118,6 +119,10 @@ void create_dir(const char *dirname) {
   if (res < 0 && errno != EEXIST) exit_with_errno();
 }
 
+void remove_empty_dir(const char *dirname) {
+  rmdir(dirname);
+}
+
 // open a file for reading only. Reads at most max_length bytes into result.
 // returns the number of bytes read.
 size_t read_file(const char *filename, char *result, size_t max_length) {
@@ -162,6 +167,35 @@ void write_file(const char *filename, const char *data, size_t length) {
   close(fd);
 }
 
+const char *map_file(const char *filename, size_t &length) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) exit_with_errno();
+
+  struct stat buffer;
+  if (fstat(fd, &buffer) != 0) {
+    close(fd);
+    exit_with_errno();
+  }
+  length = (size_t)buffer.st_size;
+  // an empty file cannot be mapped
+  if (length == 0) {
+    close(fd);
+    return "";
+  }
+
+  void *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    close(fd);
+    exit_with_errno();
+  }
+  close(fd);
+  return (const char *)data;
+}
+
+void unmap_file(const char *data, size_t length) {
+  if (length > 0) munmap((void *)data, length);
+}
+
 const char *get_home_dir() {
   if (home_directory) return home_directory;
 
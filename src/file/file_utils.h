@@ -24,8 +24,14 @@ bool recur_find(char *result, const char *dirstart, const char *targetname,
 // always succeeds on return. If an action fails, error is printed to stderr
 // and the program is exited immediately.
 void create_dir(const char *dirname);
+// removes dirname if it is empty, and leaves it alone otherwise
+void remove_empty_dir(const char *dirname);
 size_t read_file(const char *filename, char *result, size_t max_length);
 void write_file(const char *filename, const char *data, size_t length);
+// map a whole file into memory, read-only. Sets length to its size. Must be
+// released with unmap_file.
+const char *map_file(const char *filename, size_t &length);
+void unmap_file(const char *data, size_t length);
 
 const char *get_home_dir();
 const char *get_curr_dir();
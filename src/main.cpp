@@ -1,8 +1,12 @@
 #include <iomanip>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
 
 #include "autolab/autolab.h"
 #include "autolab/client.h"
+#include "autolab/mock_server.h"
 #include "logger.h"
 
 #include "app_credentials.h"
@@ -43,8 +47,16 @@ void print_help() {
   // Then we print general help
   Logger::info << Logger::endl
     << "options:" << Logger::endl
-    << "  -h,--help      Show this help message" << Logger::endl
-    << "  -v,--version   Show the version number of this build" << Logger::endl
+    << "  -h,--help             Show this help message" << Logger::endl
+    << "  -v,--version          Show the version number of this build" << Logger::endl
+    << "  --rate-limit <n>      Send at most n requests per second" << Logger::endl
+    << "  --max-concurrent <n>  Run at most n requests at the same time" << Logger::endl
+    << "  --timing              Show where the time of each request went" << Logger::endl
+    << "  --mock-server [dir]   Answer requests offline from built-in fixtures," << Logger::endl
+    << "                        overridden by the files in dir" << Logger::endl
+    << "  --record <dir>        Record all requests and responses into dir" << Logger::endl
+    << "  --replay <dir>        Answer requests offline from a recording" << Logger::endl
+    << "  --original-timing     Replay responses as slowly as they were recorded" << Logger::endl
     << Logger::endl
     << "run 'autolab <command> -h' to view usage instructions for each command." << Logger::endl;
 }
@@ -60,6 +72,81 @@ void print_version() {
     << "Target server: " << server_domain << Logger::endl;
 }
 
+/* request timings, shown with --timing */
+std::mutex timing_output_mutex;
+
+void print_request_timing(const Autolab::RawClient::RequestTiming &timing) {
+  std::ostringstream line;
+  line << std::fixed << std::setprecision(1)
+    << "[timing] " << timing.path << " " << timing.response_code
+    << " " << timing.http_version
+    << ": dns " << timing.dns_seconds * 1000 << "ms"
+    << ", connect " << timing.connect_seconds * 1000 << "ms"
+    << ", tls " << timing.tls_seconds * 1000 << "ms"
+    << ", ttfb " << timing.ttfb_seconds * 1000 << "ms"
+    << ", total " << timing.total_seconds * 1000 << "ms"
+    << ", sent " << timing.bytes_sent << "B"
+    << ", received " << timing.bytes_received << "B";
+
+  // asynchronous requests report from the transfer thread
+  std::lock_guard<std::mutex> guard(timing_output_mutex);
+  Logger::info << line.str() << Logger::endl;
+}
+
+/* offline mode, set up by --mock-server or --replay */
+std::shared_ptr<Autolab::MockServer> mock_server;
+
+void use_mock_server(const std::string &fixture_dir) {
+  mock_server = std::make_shared<Autolab::MockServer>();
+  mock_server->add_default_fixtures();
+  if (fixture_dir.length() > 0) {
+    mock_server->load_fixtures(fixture_dir);
+  }
+  client.set_transport(mock_server);
+  // the stored tokens belong to the real server, never replace them
+  client.set_new_tokens_callback(nullptr);
+  client.set_tokens("mock-access-token", "mock-refresh-token");
+}
+
+/* options that apply to every command, false if one of them is invalid */
+bool apply_global_options(cmdargs &cmd) {
+  std::string rate_limit, max_concurrent;
+  double requests_per_second = 0;
+  int concurrent = 0;
+  if (cmd.get_option(rate_limit, "--rate-limit") &&
+      !parse_positive_number(rate_limit, requests_per_second)) {
+    Logger::fatal << "Invalid rate limit: " << rate_limit << Logger::endl
+      << "Expected a positive number of requests per second." << Logger::endl;
+    return false;
+  }
+  if (cmd.get_option(max_concurrent, "--max-concurrent") &&
+      !parse_positive_int(max_concurrent, concurrent)) {
+    Logger::fatal << "Invalid number of concurrent requests: " << max_concurrent
+      << Logger::endl << "Expected a whole number, at least 1." << Logger::endl;
+    return false;
+  }
+  if (requests_per_second > 0 || concurrent > 0) {
+    client.set_rate_limit(requests_per_second, concurrent);
+  }
+  if (cmd.has_option("--timing")) {
+    client.set_timing_callback(print_request_timing);
+  }
+  std::string fixture_dir, replay_dir;
+  bool use_fixtures = cmd.get_option(fixture_dir, "--mock-server");
+  bool replay = cmd.get_option(replay_dir, "--replay");
+  if (use_fixtures || replay) {
+    use_mock_server(fixture_dir);
+    if (replay) {
+      mock_server->load_recording(replay_dir, cmd.has_option("--original-timing"));
+    }
+  }
+  std::string record_dir;
+  if (cmd.get_option(record_dir, "--record") && record_dir.length() > 0) {
+    client.start_recording(record_dir);
+  }
+  return true;
+}
+
 /* must manually init client */
 int user_setup(cmdargs &cmd) {
   cmd.setup_help("autolab setup",
@@ -138,10 +225,12 @@ int main(int argc, char *argv[]) {
   std::string command(argv[1]);
 
   try {
+    if (!apply_global_options(cmd)) return 0;
+
     if ("setup" == command) {
       return user_setup(cmd);
     } else {
-      if (!init_autolab_client()) {
+      if (!mock_server && !init_autolab_client()) {
         Logger::fatal << "No user set up on this client yet." << Logger::endl
           << Logger::endl
           << "Please run 'autolab setup' to setup your Autolab account." << Logger::endl;
@@ -160,6 +249,12 @@ int main(int argc, char *argv[]) {
   } catch (Autolab::HttpException &e) {
     Logger::fatal << e.what() << Logger::endl;
     return -1;
+  } catch (Autolab::TokenLockException &e) {
+    Logger::fatal << "The tokens need refreshing, but another autolab process "
+      << "holds the token lock." << Logger::endl
+      << Logger::endl
+      << "Please try again once it is done." << Logger::endl;
+    return 0;
   } catch (Autolab::InvalidResponseException &e) {
     Logger::fatal << Logger::endl
       << "Received invalid response from API server: " << Logger::endl